@@ -0,0 +1,222 @@
+#include "anim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Frames start cache line aligned, like pool slots */
+#define ANIM_ALIGN 64
+
+static size_t buffer_size(int32_t width, int32_t height) {
+    return ((size_t)width * height * 4 + ANIM_ALIGN - 1) & ~(size_t)(ANIM_ALIGN - 1);
+}
+
+size_t anim_size(int buffer_count, int32_t width, int32_t height) {
+    return buffer_size(width, height) * buffer_count;
+}
+
+static void free_arrays(struct anim* anim) {
+    free(anim->buffers);
+    free(anim->buffer_frames);
+    free(anim->delays);
+    free(anim->hashed);
+    free(anim->same);
+    free(anim->changes);
+    free(anim->known);
+}
+
+bool anim_init(
+    struct anim* anim,
+    struct wl_shm* wl_shm,
+    enum shm_backend backend,
+    unsigned shm_flags,
+    int frame_count,
+    const int* delays,
+    bool ring,
+    int32_t width,
+    int32_t height,
+    uint32_t format
+) {
+    memset(anim, 0, sizeof(*anim));
+    int buffer_count = frame_count;
+    if (ring && frame_count > ANIM_RING_BUFFERS)
+        buffer_count = ANIM_RING_BUFFERS;
+    size_t size = anim_size(buffer_count, width, height);
+    if (size > INT32_MAX) {
+        printf(
+            "[lwr] error: %d frames of %dx%d exceed wl_shm limits\n",
+            buffer_count,
+            width,
+            height
+        );
+        return false;
+    }
+
+    anim->buffers = calloc(buffer_count, sizeof(*anim->buffers));
+    anim->buffer_frames = calloc(buffer_count, sizeof(*anim->buffer_frames));
+    anim->delays = malloc(frame_count * sizeof(*anim->delays));
+    anim->hashed = calloc(frame_count, sizeof(*anim->hashed));
+    anim->same = malloc(frame_count * sizeof(*anim->same));
+    anim->changes = calloc(frame_count, sizeof(*anim->changes));
+    anim->known = calloc(frame_count, sizeof(*anim->known));
+    struct shm_file shm;
+    bool allocated = anim->buffers != NULL && anim->buffer_frames != NULL &&
+                     anim->delays != NULL && anim->hashed != NULL &&
+                     anim->same != NULL && anim->changes != NULL && anim->known != NULL;
+    if (!allocated || !shm_file_open(&shm, backend, shm_flags)) {
+        free_arrays(anim);
+        memset(anim, 0, sizeof(*anim));
+        return false;
+    }
+    if (!shm_file_grow(&shm, size)) {
+        shm_file_close(&shm);
+        free_arrays(anim);
+        memset(anim, 0, sizeof(*anim));
+        return false;
+    }
+    memcpy(anim->delays, delays, frame_count * sizeof(*anim->delays));
+    for (int i = 0; i < frame_count; ++i)
+        anim->same[i] = i;
+
+    pool_init_file(&anim->pool, wl_shm, shm.fd, shm.data, shm.size);
+    size_t spacing = buffer_size(width, height);
+    for (int i = 0; i < buffer_count; ++i) {
+        pool_buffer_init(
+            &anim->pool,
+            &anim->buffers[i],
+            i * spacing,
+            width,
+            height,
+            width * 4,
+            format
+        );
+        anim->buffer_frames[i] = i;
+    }
+    anim->buffer_count = buffer_count;
+    anim->frame_count = frame_count;
+    printf(
+        "[lwr] animation: %d frames of %dx%d in %d buffers, %zu bytes\n",
+        frame_count,
+        width,
+        height,
+        buffer_count,
+        shm.size
+    );
+    return true;
+}
+
+void anim_finish(struct anim* anim) {
+    if (anim->buffers == NULL)
+        return;
+    for (int i = 0; i < anim->buffer_count; ++i)
+        pool_buffer_finish(&anim->buffers[i]);
+    free_arrays(anim);
+    pool_finish(&anim->pool);
+    memset(anim, 0, sizeof(*anim));
+}
+
+struct pool_buffer* anim_find(struct anim* anim, int frame) {
+    frame = anim->same[frame];
+    if (!anim_ring(anim)) {
+        struct pool_buffer* buffer = &anim->buffers[frame];
+        return buffer->generation != 0 ? buffer : NULL;
+    }
+    for (int i = 0; i < anim->buffer_count; ++i) {
+        struct pool_buffer* buffer = &anim->buffers[i];
+        if (anim->same[anim->buffer_frames[i]] == frame && buffer->generation != 0) {
+            /* frames looking alike keep it from being the least recently shown */
+            buffer->last_used = ++anim->pool.clock;
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+struct pool_buffer* anim_claim(struct anim* anim, int frame, int* previous) {
+    *previous = -1;
+    if (!anim_ring(anim))
+        return &anim->buffers[anim->same[frame]];
+    int oldest = -1;
+    for (int i = 0; i < anim->buffer_count; ++i) {
+        if (anim->buffers[i].busy)
+            continue;
+        if (oldest < 0 || anim->buffers[i].last_used < anim->buffers[oldest].last_used)
+            oldest = i;
+    }
+    if (oldest < 0)
+        return NULL;
+    struct pool_buffer* buffer = &anim->buffers[oldest];
+    if (buffer->generation != 0)
+        *previous = anim->buffer_frames[oldest];
+    anim->buffer_frames[oldest] = frame;
+    buffer->generation = 0;
+    buffer->last_used = ++anim->pool.clock;
+    return buffer;
+}
+
+bool anim_complete(const struct anim* anim) {
+    if (anim_ring(anim) || anim->hashed_count < anim->frame_count)
+        return false;
+    for (int i = 0; i < anim->frame_count; ++i) {
+        if (anim->buffers[anim->same[i]].generation == 0)
+            return false;
+    }
+    return true;
+}
+
+int anim_add_same(struct anim* anim, int frame, int same) {
+    anim->hashed[frame] = true;
+    ++anim->hashed_count;
+    if (same != frame && anim->hashed[same]) {
+        anim->same[frame] = anim->same[same];
+        ++anim->duplicates;
+    }
+    /* the first frame starts the loop, it is never merged into the last */
+    if (frame == 0 || !anim->hashed[frame - 1] || anim->same[frame] != anim->same[frame - 1])
+        return -1;
+    int first = frame - 1;
+    while (anim->delays[first] == 0)
+        --first;
+    anim->delays[first] += anim->delays[frame];
+    anim->delays[frame] = 0;
+    return first;
+}
+
+size_t anim_saved(const struct anim* anim) {
+    if (anim_ring(anim))
+        return 0;
+    int unfilled = 0;
+    for (int i = 0; i < anim->frame_count; ++i) {
+        if (anim->same[i] != i && anim->buffers[i].generation == 0)
+            ++unfilled;
+    }
+    return (size_t)unfilled * buffer_size(anim->buffers[0].width, anim->buffers[0].height);
+}
+
+bool anim_changes(const struct anim* anim, int from, int to, struct region* out) {
+    region_clear(out);
+    while (from != to) {
+        from = (from + 1) % anim->frame_count;
+        if (!anim->known[from])
+            return false;
+        region_union(out, &anim->changes[from]);
+    }
+    return true;
+}
+
+void anim_fix_delays(int* delays, int frame_count) {
+    for (int i = 0; i < frame_count; ++i) {
+        if (delays[i] <= ANIM_MIN_DELAY)
+            delays[i] = ANIM_DEFAULT_DELAY;
+    }
+}
+
+int anim_advance(const int* delays, int frame_count, int frame, double* due, double now) {
+    if (now - *due > ANIM_MAX_LAG)
+        *due = now;
+    do {
+        frame = (frame + 1) % frame_count;
+        *due += delays[frame];
+    } while (*due <= now || delays[frame] == 0);
+    return frame;
+}
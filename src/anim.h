@@ -0,0 +1,125 @@
+#ifndef LWR_ANIM_H
+#define LWR_ANIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client.h>
+
+#include "pool.h"
+#include "region.h"
+#include "shm.h"
+
+/* Animations are shown from a store of their frames drawn at one size and
+ * format, wl_buffers over a single file shared with the compositor. A full
+ * store has a buffer per frame: a frame is drawn the first time it comes up
+ * and never written again, so its buffer can be reattached while the
+ * compositor still holds it and every loop after the first draws nothing.
+ * Animations too large for that get a ring of ANIM_RING_BUFFERS buffers
+ * instead, each frame drawn again whenever it comes up into the least
+ * recently shown buffer the compositor released. Knowing what changed from
+ * each frame to the next, a ring buffer is brought from the frame it held to
+ * the one it gets by redrawing only that.
+ *
+ * Frames found to have the same pixels as an earlier one are shown from that
+ * one's buffer, and a run of frames like the one before them is shown as a single
+ * frame lasting as long as all of them. */
+
+/* GIFs asking for this many ms or less per frame are shown at
+ * ANIM_DEFAULT_DELAY instead, as browsers do */
+#define ANIM_MIN_DELAY 10
+#define ANIM_DEFAULT_DELAY 100
+
+/* Falling further behind than this, as when the compositor stops asking for
+ * frames of a hidden surface, picks the animation up from now rather than
+ * skipping ahead */
+#define ANIM_MAX_LAG 1000.0
+
+/* Buffers of a ring: the one shown, one the compositor may still read, and
+ * one to draw the next frame into */
+#define ANIM_RING_BUFFERS 3
+
+struct anim {
+    /* the file backing every frame */
+    struct pool pool;
+    /* buffers[i] holds frame buffer_frames[i], unless at generation 0. In a
+     * full store that is frame i. */
+    struct pool_buffer* buffers;
+    int* buffer_frames;
+    int buffer_count;
+    int frame_count;
+    /* the image's delays, those of frames like the one before them added
+     * onto the first of the run and set to 0 */
+    int* delays;
+    /* frame i looks like frame same[i], the first that does, once hashed[i] */
+    bool* hashed;
+    int* same;
+    int hashed_count;
+    int duplicates;
+    /* what changed from the frame before frame i, in image coordinates, once
+     * known[i] */
+    struct region* changes;
+    bool* known;
+    /* what the frames are drawn from, chosen by the caller */
+    struct pool_key key;
+    uint64_t generation;
+};
+
+/* Creates the store for `frame_count` frames shown for `delays` ms each, of
+ * the given size and format on `backend`, none of them drawn, full unless
+ * `ring` */
+bool anim_init(
+    struct anim* anim,
+    struct wl_shm* wl_shm,
+    enum shm_backend backend,
+    unsigned shm_flags,
+    int frame_count,
+    const int* delays,
+    bool ring,
+    int32_t width,
+    int32_t height,
+    uint32_t format
+);
+void anim_finish(struct anim* anim);
+
+/* Bytes of the file behind a store */
+size_t anim_size(int buffer_count, int32_t width, int32_t height);
+
+static inline bool anim_ring(const struct anim* anim) {
+    return anim->buffer_count < anim->frame_count;
+}
+
+/* The buffer holding `frame` drawn, or a frame it looks like, or NULL */
+struct pool_buffer* anim_find(struct anim* anim, int frame);
+
+/* The buffer to draw `frame` into, at generation 0 until the caller sets it.
+ * NULL when every buffer of a ring is still held by the compositor.
+ * `previous` is set to the frame the buffer still holds, or -1. */
+struct pool_buffer* anim_claim(struct anim* anim, int frame, int* previous);
+
+/* Every frame of a full store is hashed and found in a buffer, nothing more
+ * needs drawing */
+bool anim_complete(const struct anim* anim);
+
+/* Records that `frame` has the same pixels as the earlier frame `same`, or
+ * none when `same` is `frame`, which must come after the frames before it. A
+ * frame like the one before it has its delay added to the first of their run,
+ * whose index is returned, -1 otherwise. */
+int anim_add_same(struct anim* anim, int frame, int same);
+
+/* Bytes of buffers a full store doesn't fill because their frames look like
+ * earlier ones */
+size_t anim_saved(const struct anim* anim);
+
+/* What changed on the way from frame `from` to frame `to`, every frame in
+ * between shown. Returns false when some of it is unknown. */
+bool anim_changes(const struct anim* anim, int from, int to, struct region* out);
+
+/* Replaces GIF delays the browsers wouldn't honour either */
+void anim_fix_delays(int* delays, int frame_count);
+
+/* The frame to show at `now` after `frame`, whose time ends at `*due`, moving
+ * `*due` on to the end of the returned frame's time. Frames whose time passed
+ * already are skipped, and so are those of no time. */
+int anim_advance(const int* delays, int frame_count, int frame, double* due, double now);
+
+#endif
@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include "bake.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "convert.h"
+#include "resize.h"
+
+static size_t page_round(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+static bool valid_header(const struct bake_header* header, size_t size) {
+    if (header->magic != BAKE_MAGIC || header->version != BAKE_VERSION)
+        return false;
+    if (header->level_count < 1 || header->level_count > BAKE_MAX_LEVELS)
+        return false;
+    for (int i = 0; i < header->level_count; ++i) {
+        const struct bake_level* level = &header->levels[i];
+        if (level->width <= 0 || level->height <= 0 || level->stride < level->width * 4)
+            return false;
+        if (level->opaque_count < 0 || level->opaque_count > REGION_MAX_RECTS)
+            return false;
+        if (level->offset + (uint64_t)level->stride * level->height > size)
+            return false;
+    }
+    return true;
+}
+
+bool bake_probe(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    uint32_t magic = 0;
+    bool baked = read(fd, &magic, sizeof(magic)) == sizeof(magic) && magic == BAKE_MAGIC;
+    close(fd);
+    return baked;
+}
+
+bool bake_open(struct bake_file* file, const char* path) {
+    memset(file, 0, sizeof(*file));
+    file->fd = -1;
+    if (!bake_probe(path))
+        return false;
+
+    file->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0) {
+        printf("[lwr] error: unable to open baked image %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(file->fd, &st) < 0 || (size_t)st.st_size < sizeof(struct bake_header) ||
+        st.st_size > INT32_MAX) {
+        printf("[lwr] error: baked image %s has an invalid size\n", path);
+        bake_close(file);
+        return false;
+    }
+    file->size = st.st_size;
+    file->data = mmap(NULL, file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+    if (file->data == MAP_FAILED) {
+        printf("[lwr] error: unable to map baked image %s: %s\n", path, strerror(errno));
+        file->data = NULL;
+        bake_close(file);
+        return false;
+    }
+    file->header = (const struct bake_header*)file->data;
+    if (!valid_header(file->header, file->size)) {
+        printf("[lwr] error: baked image %s is corrupt or from another version\n", path);
+        bake_close(file);
+        return false;
+    }
+
+    /* compositors map shm pools writable, which a read-only fd can't back. The
+     * mapping outlives the fd it was made from. */
+    close(file->fd);
+    file->fd = open(path, O_RDWR | O_CLOEXEC);
+    return true;
+}
+
+void bake_close(struct bake_file* file) {
+    if (file->data != NULL)
+        munmap(file->data, file->size);
+    if (file->fd >= 0)
+        close(file->fd);
+    memset(file, 0, sizeof(*file));
+    file->fd = -1;
+}
+
+static int compare_sizes(const void* a, const void* b) {
+    const struct bake_size* sa = a;
+    const struct bake_size* sb = b;
+    int64_t area_a = (int64_t)sa->width * sa->height;
+    int64_t area_b = (int64_t)sb->width * sb->height;
+    return area_a < area_b ? 1 : area_a > area_b ? -1 : 0;
+}
+
+/* Draws one level into the mapped file */
+static bool bake_level(
+    uint8_t* dst,
+    const struct bake_level* level,
+    const uint8_t* data,
+    int32_t width,
+    int32_t height
+) {
+    if (level->width == width && level->height == height) {
+        for (int32_t y = 0; y < height; ++y) {
+            convert_rgba_to_argb(
+                dst + (size_t)y * level->stride,
+                data + (size_t)y * width * 4,
+                width
+            );
+        }
+        return true;
+    }
+
+    STBIR_RESIZE resize;
+    stbir_resize_init(
+        &resize,
+        data,
+        width,
+        height,
+        0,
+        dst,
+        level->width,
+        level->height,
+        level->stride,
+        STBIR_RGBA_PM,
+        STBIR_TYPE_UINT8_SRGB
+    );
+    stbir_set_pixel_layouts(&resize, STBIR_RGBA_PM, STBIR_BGRA_PM);
+    return resize_run(&resize);
+}
+
+bool bake_write(
+    const char* path,
+    const uint8_t* data,
+    int32_t width,
+    int32_t height,
+    bool opaque,
+    struct bake_size* sizes,
+    int count
+) {
+    if (count < 1 || count > BAKE_MAX_LEVELS) {
+        printf("[lwr] error: a baked image holds 1 to %d sizes\n", BAKE_MAX_LEVELS);
+        return false;
+    }
+    qsort(sizes, count, sizeof(*sizes), compare_sizes);
+
+    struct bake_header header = {
+        .magic = BAKE_MAGIC,
+        .version = BAKE_VERSION,
+        .opaque = opaque,
+        .level_count = count,
+    };
+    uint64_t size = page_round(sizeof(header));
+    for (int i = 0; i < count; ++i) {
+        if (sizes[i].width <= 0 || sizes[i].height <= 0) {
+            printf("[lwr] error: invalid size %dx%d\n", sizes[i].width, sizes[i].height);
+            return false;
+        }
+        struct bake_level* level = &header.levels[i];
+        level->width = sizes[i].width;
+        level->height = sizes[i].height;
+        level->stride = sizes[i].width * 4;
+        level->offset = size;
+        size += page_round((uint64_t)level->stride * level->height);
+    }
+    if (size > INT32_MAX) {
+        printf("[lwr] error: %llu bytes exceed wl_shm limits\n", (unsigned long long)size);
+        return false;
+    }
+
+    /* written aside and renamed in place, a running overlay keeps the old one */
+    char temp[PATH_MAX];
+    if ((size_t)snprintf(temp, sizeof(temp), "%s.tmp", path) >= sizeof(temp)) {
+        printf("[lwr] error: path %s is too long\n", path);
+        return false;
+    }
+    int fd = open(temp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        printf("[lwr] error: unable to create %s: %s\n", temp, strerror(errno));
+        return false;
+    }
+    uint8_t* map = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("[lwr] error: unable to write %s: %s\n", temp, strerror(errno));
+        unlink(temp);
+        return false;
+    }
+
+    bool drawn = true;
+    for (int i = 0; i < count && drawn; ++i) {
+        struct bake_level* level = &header.levels[i];
+        uint8_t* dst = map + level->offset;
+        drawn = bake_level(dst, level, data, width, height);
+        if (opaque) {
+            level->opaque[0] = (struct rect){ 0, 0, level->width, level->height };
+            level->opaque_count = 1;
+        } else {
+            level->opaque_count = region_find_opaque(
+                dst,
+                level->width,
+                level->height,
+                level->stride,
+                REGION_TILE * REGION_TILE * 4,
+                level->opaque,
+                REGION_MAX_RECTS
+            );
+        }
+        printf("[lwr] baked %dx%d\n", level->width, level->height);
+    }
+    memcpy(map, &header, sizeof(header));
+    munmap(map, size);
+
+    if (!drawn || rename(temp, path) < 0) {
+        printf("[lwr] error: unable to write %s\n", path);
+        unlink(temp);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,73 @@
+#ifndef LWR_BAKE_H
+#define LWR_BAKE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "region.h"
+
+/* Baked images are files laid out the way wl_shm wants them: a header on its
+ * own page, then each size of the image as rows of premultiplied ARGB8888 at
+ * a stride of four bytes per pixel, every size starting on a page. The file
+ * itself can back a wl_shm_pool, so showing one of its sizes takes no decode,
+ * no copy and no memory besides the page cache. */
+
+#define BAKE_MAGIC 0x424b574c /* "LWKB" */
+#define BAKE_VERSION 1
+/* one wl_buffer per size, all in the same pool */
+#define BAKE_MAX_LEVELS 8
+
+struct bake_level {
+    int32_t width;
+    int32_t height;
+    int32_t stride;
+    int32_t opaque_count;
+    uint64_t offset;
+    struct rect opaque[REGION_MAX_RECTS];
+};
+
+struct bake_header {
+    uint32_t magic;
+    uint32_t version;
+    /* every pixel of every level has alpha 255 */
+    uint32_t opaque;
+    /* largest first */
+    int32_t level_count;
+    struct bake_level levels[BAKE_MAX_LEVELS];
+};
+
+struct bake_file {
+    /* -1 when the file isn't writable, and can't be shared */
+    int fd;
+    uint8_t* data;
+    size_t size;
+    const struct bake_header* header;
+};
+
+struct bake_size {
+    int32_t width;
+    int32_t height;
+};
+
+/* Whether the file at `path` starts like a baked image, without mapping it */
+bool bake_probe(const char* path);
+
+/* Opens and maps the baked image at `path`, read only. Returns false, quietly,
+ * when the file isn't one, and with an error when it is but can't be used. */
+bool bake_open(struct bake_file* file, const char* path);
+void bake_close(struct bake_file* file);
+
+/* Writes premultiplied RGBA `data` to `path` as a baked image at each of
+ * `sizes`, which get sorted largest first */
+bool bake_write(
+    const char* path,
+    const uint8_t* data,
+    int32_t width,
+    int32_t height,
+    bool opaque,
+    struct bake_size* sizes,
+    int count
+);
+
+#endif
@@ -0,0 +1,983 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "convert.h"
+#include "resize.h"
+#include "shm.h"
+#include "stream.h"
+#include "stb_image.h"
+#include "stb_image_resize2.h"
+
+/* Benchmarks for the CPU side of the pipeline, run with synthetic images so
+ * results don't depend on a compositor being around. */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint8_t* synthetic_rgba(int width, int height) {
+    size_t size = (size_t)width * height * 4;
+    uint8_t* data = malloc(size);
+    if (data == NULL) {
+        printf("[lwr] error: unable to allocate %zu bytes\n", size);
+        exit(1);
+    }
+    uint32_t x = 0x12345678;
+    for (size_t i = 0; i < size; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = x;
+    }
+    return data;
+}
+
+/* Average seconds per call over at least a quarter second of calls */
+static double time_kernel(convert_fn fn, uint8_t* dst, const uint8_t* src, size_t pixels) {
+    int iterations = 0;
+    double start = now();
+    double elapsed;
+    do {
+        fn(dst, src, pixels);
+        ++iterations;
+        elapsed = now() - start;
+    } while (elapsed < 0.25);
+    return elapsed / iterations;
+}
+
+static void bench_convert(int width, int height) {
+    size_t pixels = (size_t)width * height;
+    uint8_t* src = synthetic_rgba(width, height);
+    uint8_t* dst = malloc(pixels * 4);
+    uint8_t* reference = malloc(pixels * 4);
+    if (dst == NULL || reference == NULL) {
+        printf("[lwr] error: unable to allocate benchmark buffers\n");
+        exit(1);
+    }
+    convert_rgba_to_argb_level(CONVERT_SCALAR)(reference, src, pixels);
+
+    printf("rgba -> argb8888, %dx%d\n", width, height);
+    for (int level = CONVERT_SCALAR; level < CONVERT_LEVEL_COUNT; ++level) {
+        convert_fn fn = convert_rgba_to_argb_level(level);
+        if (fn == NULL) {
+            printf("  %-8s unsupported\n", convert_level_name(level));
+            continue;
+        }
+
+        fn(dst, src, pixels);
+        if (memcmp(dst, reference, pixels * 4) != 0) {
+            printf("  %-8s MISMATCH\n", convert_level_name(level));
+            continue;
+        }
+
+        double seconds = time_kernel(fn, dst, src, pixels);
+        printf(
+            "  %-8s %8.3f ms  %6.2f GB/s\n",
+            convert_level_name(level),
+            seconds * 1e3,
+            pixels * 4 / seconds / 1e9
+        );
+    }
+
+    /* what the ABGR8888 path costs instead */
+    double seconds = time_kernel(convert_copy, dst, src, pixels);
+    printf(
+        "  %-8s %8.3f ms  %6.2f GB/s\n",
+        "memcpy",
+        seconds * 1e3,
+        pixels * 4 / seconds / 1e9
+    );
+
+    free(reference);
+    free(dst);
+    free(src);
+}
+
+static void bench_opaque(int width, int height) {
+    size_t pixels = (size_t)width * height;
+    uint8_t* data = synthetic_rgba(width, height);
+    /* worst case: opaque everywhere, so the scan has to read everything */
+    for (size_t i = 0; i < pixels; ++i)
+        data[i * 4 + 3] = 255;
+
+    printf("alpha scan, %dx%d\n", width, height);
+    for (int level = CONVERT_SCALAR; level < CONVERT_LEVEL_COUNT; ++level) {
+        opaque_fn fn = convert_is_opaque_level(level);
+        if (fn == NULL) {
+            printf("  %-8s unsupported\n", convert_level_name(level));
+            continue;
+        }
+
+        int iterations = 0;
+        bool opaque = true;
+        double start = now();
+        double elapsed;
+        do {
+            opaque &= fn(data, pixels);
+            ++iterations;
+            elapsed = now() - start;
+        } while (elapsed < 0.25);
+
+        double seconds = elapsed / iterations;
+        printf(
+            "  %-8s %8.3f ms  %6.2f GB/s%s\n",
+            convert_level_name(level),
+            seconds * 1e3,
+            pixels * 4 / seconds / 1e9,
+            opaque ? "" : "  MISMATCH"
+        );
+    }
+
+    free(data);
+}
+
+/* Startup work to get a premultiplied image into an ARGB8888 buffer for an
+ * overlay about 480 pixels wide: an exact stbir resample in cpu mode, against
+ * box halvings plus a swizzle in compositor mode, which leaves the final
+ * scaling to the compositor. */
+static void bench_scale_modes(int width, int height) {
+    uint8_t* src = synthetic_rgba(width, height);
+    int target_width = 480;
+    int target_height = (int)((int64_t)height * target_width / width);
+
+    int reduced_width = width;
+    int reduced_height = height;
+    while (reduced_width / 2 >= target_width && reduced_height / 2 >= target_height) {
+        reduced_width /= 2;
+        reduced_height /= 2;
+    }
+
+    uint8_t* dst = malloc((size_t)reduced_width * reduced_height * 4);
+    uint8_t* level[2] = {
+        malloc((size_t)(width / 2) * (height / 2) * 4),
+        malloc((size_t)(width / 4) * (height / 4) * 4),
+    };
+    if (dst == NULL || level[0] == NULL || level[1] == NULL) {
+        printf("[lwr] error: unable to allocate benchmark buffers\n");
+        exit(1);
+    }
+
+    printf("startup prep, %dx%d\n", width, height);
+
+    int iterations = 0;
+    double start = now();
+    double elapsed;
+    do {
+        /* set up as draw_rect does for an ARGB8888 buffer */
+        STBIR_RESIZE resize;
+        stbir_resize_init(
+            &resize,
+            src,
+            width,
+            height,
+            0,
+            dst,
+            target_width,
+            target_height,
+            0,
+            STBIR_RGBA_PM,
+            STBIR_TYPE_UINT8_SRGB
+        );
+        stbir_set_pixel_layouts(&resize, STBIR_RGBA_PM, STBIR_BGRA_PM);
+        if (!resize_run(&resize)) {
+            printf("[lwr] error: resize failed\n");
+            exit(1);
+        }
+        ++iterations;
+        elapsed = now() - start;
+    } while (elapsed < 0.25);
+    printf(
+        "  %-10s %8.3f ms  -> %dx%d\n",
+        "cpu",
+        elapsed / iterations * 1e3,
+        target_width,
+        target_height
+    );
+
+    iterations = 0;
+    start = now();
+    do {
+        const uint8_t* from = src;
+        int w = width;
+        int h = height;
+        for (int i = 0; w != reduced_width; ++i) {
+            uint8_t* to = level[i % 2];
+            convert_halve(to, w / 2 * 4, from, w * 4, w / 2, h / 2);
+            from = to;
+            w /= 2;
+            h /= 2;
+        }
+        convert_rgba_to_argb(dst, from, (size_t)w * h);
+        ++iterations;
+        elapsed = now() - start;
+    } while (elapsed < 0.25);
+    printf(
+        "  %-10s %8.3f ms  -> %dx%d\n",
+        "compositor",
+        elapsed / iterations * 1e3,
+        reduced_width,
+        reduced_height
+    );
+
+    free(level[1]);
+    free(level[0]);
+    free(dst);
+    free(src);
+}
+
+/* Each resize filter against stbir_resize_uint8_srgb, single threaded, with
+ * how far its pixels land from stbir's on average */
+static void bench_filters(int width, int height, int target_width, int target_height) {
+    uint8_t* src = synthetic_rgba(width, height);
+    convert_premultiply_rgba(src, (size_t)width * height);
+    size_t size = (size_t)target_width * target_height * 4;
+    uint8_t* dst = malloc(size);
+    uint8_t* reference = malloc(size);
+    if (dst == NULL || reference == NULL) {
+        printf("[lwr] error: unable to allocate benchmark buffers\n");
+        exit(1);
+    }
+
+    printf("resize filters, %dx%d -> %dx%d\n", width, height, target_width, target_height);
+    double stbir = 0;
+    for (int filter = RESIZE_STBIR; filter >= 0; --filter) {
+        struct rect r = { 0, 0, target_width, target_height };
+        int iterations = 0;
+        double start = now();
+        double elapsed;
+        do {
+            bool resized = true;
+            if (filter == RESIZE_STBIR) {
+                stbir_resize_uint8_srgb(
+                    src,
+                    width,
+                    height,
+                    0,
+                    reference,
+                    target_width,
+                    target_height,
+                    0,
+                    STBIR_RGBA_PM
+                );
+            } else {
+                resized = resize_fixed(
+                    filter,
+                    dst,
+                    target_width,
+                    target_height,
+                    target_width * 4,
+                    src,
+                    width,
+                    height,
+                    width * 4,
+                    r
+                );
+            }
+            if (!resized) {
+                printf("[lwr] error: resize failed\n");
+                exit(1);
+            }
+            ++iterations;
+            elapsed = now() - start;
+        } while (elapsed < 0.25);
+
+        double seconds = elapsed / iterations;
+        if (filter == RESIZE_STBIR) {
+            stbir = seconds;
+            printf("  %-8s %8.3f ms\n", resize_filter_name(filter), seconds * 1e3);
+            continue;
+        }
+        uint64_t error = 0;
+        for (size_t i = 0; i < size; ++i)
+            error += abs(dst[i] - reference[i]);
+        printf(
+            "  %-8s %8.3f ms  %6.2fx  %5.2f mean error\n",
+            resize_filter_name(filter),
+            seconds * 1e3,
+            stbir / seconds,
+            (double)error / size
+        );
+    }
+
+    free(reference);
+    free(dst);
+    free(src);
+}
+
+/* Doubles the thread count, ending on the core count whatever it is */
+static int next_thread_count(int threads, int cores) {
+    if (threads == cores)
+        return cores + 1;
+    return threads * 2 < cores ? threads * 2 : cores;
+}
+
+/* The cpu scale mode's resize of a large photo down to overlay size, split
+ * over 1 to one thread per core. Every thread count has to match the single
+ * threaded result. */
+static void bench_resize_threads(int width, int height) {
+    uint8_t* src = synthetic_rgba(width, height);
+    int target_width = 480;
+    int target_height = (int)((int64_t)height * target_width / width);
+    size_t size = (size_t)target_width * target_height * 4;
+    uint8_t* dst = malloc(size);
+    uint8_t* reference = malloc(size);
+    if (dst == NULL || reference == NULL) {
+        printf("[lwr] error: unable to allocate benchmark buffers\n");
+        exit(1);
+    }
+
+    resize_init(0);
+    int cores = resize_thread_count();
+    printf("resize threads, %dx%d -> %dx%d\n", width, height, target_width, target_height);
+
+    double single = 0;
+    for (int threads = 1; threads <= cores; threads = next_thread_count(threads, cores)) {
+        resize_init(threads);
+        STBIR_RESIZE resize;
+        stbir_resize_init(
+            &resize,
+            src,
+            width,
+            height,
+            0,
+            threads == 1 ? reference : dst,
+            target_width,
+            target_height,
+            0,
+            STBIR_RGBA_PM,
+            STBIR_TYPE_UINT8_SRGB
+        );
+        stbir_set_pixel_layouts(&resize, STBIR_RGBA_PM, STBIR_BGRA_PM);
+
+        int iterations = 0;
+        double start = now();
+        double elapsed;
+        do {
+            if (!resize_run(&resize)) {
+                printf("[lwr] error: resize failed\n");
+                exit(1);
+            }
+            ++iterations;
+            elapsed = now() - start;
+        } while (elapsed < 0.5);
+
+        if (threads > 1 && memcmp(dst, reference, size) != 0) {
+            printf("  %2d threads MISMATCH\n", threads);
+            continue;
+        }
+        double seconds = elapsed / iterations;
+        if (threads == 1)
+            single = seconds;
+        printf(
+            "  %2d threads %8.3f ms  %5.2fx\n",
+            threads,
+            seconds * 1e3,
+            single / seconds
+        );
+    }
+    resize_finish();
+
+    free(reference);
+    free(dst);
+    free(src);
+}
+
+/* Creating, mapping and writing a whole frame once, as the first draw into a
+ * fresh pool does. */
+static void bench_shm(int width, int height) {
+    size_t size = (size_t)width * height * 4;
+    printf("buffer memory, %dx%d\n", width, height);
+
+    for (int backend = 0; backend < SHM_BACKEND_COUNT; ++backend) {
+        for (unsigned flags = 0; flags <= SHM_PREFAULT; flags += SHM_PREFAULT) {
+            char name[32];
+            snprintf(
+                name,
+                sizeof(name),
+                "%s%s",
+                shm_backend_name(backend),
+                flags & SHM_PREFAULT ? "+prefault" : ""
+            );
+
+            /* skip backends that fell back to another */
+            struct shm_file file;
+            bool supported = shm_file_open(&file, backend, flags) &&
+                             file.backend == (enum shm_backend)backend;
+            shm_file_close(&file);
+            if (!supported) {
+                printf("  %-17s unsupported\n", name);
+                continue;
+            }
+
+            int iterations = 0;
+            double alloc = 0;
+            double start = now();
+            double elapsed;
+            do {
+                double begin = now();
+                if (!shm_file_open(&file, backend, flags) || !shm_file_grow(&file, size)) {
+                    printf("[lwr] error: unable to allocate %zu bytes\n", size);
+                    exit(1);
+                }
+                alloc += now() - begin;
+                memset(file.data, 0xff, size);
+                shm_file_close(&file);
+                ++iterations;
+                elapsed = now() - start;
+            } while (elapsed < 0.25);
+
+            printf(
+                "  %-17s %8.3f ms  (%.3f ms allocating)\n",
+                name,
+                elapsed / iterations * 1e3,
+                alloc / iterations * 1e3
+            );
+        }
+    }
+}
+
+/* LSB first bit packing into GIF data sub-blocks */
+struct gif_writer {
+    FILE* file;
+    uint8_t block[255];
+    int block_size;
+    uint32_t bits;
+    int bit_count;
+};
+
+static void gif_put_code(struct gif_writer* writer, uint32_t code, int size) {
+    writer->bits |= code << writer->bit_count;
+    writer->bit_count += size;
+    while (writer->bit_count >= 8) {
+        writer->block[writer->block_size++] = writer->bits;
+        writer->bits >>= 8;
+        writer->bit_count -= 8;
+        if (writer->block_size == 255) {
+            fputc(255, writer->file);
+            fwrite(writer->block, 1, 255, writer->file);
+            writer->block_size = 0;
+        }
+    }
+}
+
+static void gif_flush_codes(struct gif_writer* writer) {
+    if (writer->bit_count > 0)
+        gif_put_code(writer, 0, 8 - writer->bit_count);
+    if (writer->block_size > 0) {
+        fputc(writer->block_size, writer->file);
+        fwrite(writer->block, 1, writer->block_size, writer->file);
+    }
+    fputc(0, writer->file);
+    writer->block_size = 0;
+}
+
+/* Writes an animated GIF of a diagonal gradient scrolling by, every frame
+ * whole and opaque, or when `partial` only in a box a quarter of the size
+ * sliding down the diagonal after the first. Its pixels go out as 9-bit
+ * literals with a clear code before the table would need 10 bits, which any
+ * decoder takes. */
+static void write_synthetic_gif(
+    const char* path,
+    int width,
+    int height,
+    int frame_count,
+    bool partial
+) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        printf("[lwr] error: unable to write %s\n", path);
+        exit(1);
+    }
+    uint8_t screen[] = {
+        width & 0xff, width >> 8, height & 0xff, height >> 8, 0xf7, 0, 0,
+    };
+    fwrite("GIF89a", 1, 6, file);
+    fwrite(screen, 1, sizeof(screen), file);
+    for (int i = 0; i < 256; ++i) {
+        uint8_t color[] = { i, 255 - i, (i * 7) & 0xff };
+        fwrite(color, 1, sizeof(color), file);
+    }
+
+    for (int f = 0; f < frame_count; ++f) {
+        /* 40 ms, drawn over the previous frame */
+        uint8_t control[] = { 0x21, 0xf9, 4, 1 << 2, 4, 0, 0, 0 };
+        int w = width, h = height, left = 0, top = 0;
+        if (partial && f > 0) {
+            w = width / 4;
+            h = height / 4;
+            left = (width - w) * f / frame_count;
+            top = (height - h) * f / frame_count;
+        }
+        uint8_t descriptor[] = {
+            0x2c,     left & 0xff, left >> 8, top & 0xff, top >> 8, w & 0xff,
+            w >> 8,   h & 0xff,    h >> 8,    0,          8,
+        };
+        fwrite(control, 1, sizeof(control), file);
+        fwrite(descriptor, 1, sizeof(descriptor), file);
+
+        struct gif_writer writer = { .file = file };
+        int run = 0;
+        for (int y = top; y < top + h; ++y) {
+            for (int x = left; x < left + w; ++x) {
+                if (run == 0)
+                    gif_put_code(&writer, 256, 9);
+                gif_put_code(&writer, (x + y + f * 7) & 0xff, 9);
+                run = (run + 1) % 250;
+            }
+        }
+        gif_put_code(&writer, 257, 9);
+        gif_flush_codes(&writer);
+    }
+    fputc(0x3b, file);
+    fclose(file);
+}
+
+static long rss_field_kib(const char* field) {
+    FILE* file = fopen("/proc/self/status", "r");
+    if (file == NULL)
+        return -1;
+    char line[256];
+    long kib = -1;
+    size_t length = strlen(field);
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, field, length) == 0) {
+            kib = atol(line + length + 1);
+            break;
+        }
+    }
+    fclose(file);
+    return kib;
+}
+
+/* Resets the peak RSS to the current one, on kernels that allow it */
+static bool reset_peak_rss(void) {
+    FILE* file = fopen("/proc/self/clear_refs", "w");
+    if (file == NULL)
+        return false;
+    bool reset = fputs("5", file) >= 0;
+    return fclose(file) == 0 && reset;
+}
+
+/* Decodes every frame at once, as stbi_load_gif_from_memory does, and
+ * premultiplies them */
+static bool decode_all_frames(const char* path, int frame_count) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t* contents = malloc(size);
+    bool read = contents != NULL && fread(contents, 1, size, file) == (size_t)size;
+    fclose(file);
+    int width, height, frames;
+    int* delays = NULL;
+    uint8_t* data = read ? stbi_load_gif_from_memory(
+                               contents,
+                               (int)size,
+                               &delays,
+                               &width,
+                               &height,
+                               &frames,
+                               NULL,
+                               4
+                           )
+                         : NULL;
+    free(contents);
+    bool decoded = data != NULL && frames == frame_count;
+    if (data != NULL)
+        convert_premultiply_rgba(data, (size_t)width * height * frames);
+    stbi_image_free(data);
+    free(delays);
+    return decoded;
+}
+
+/* Plays every frame through a stream `loops` times, converting each to
+ * ARGB8888 as an upload at the GIF's size would: whole, or only what changed
+ * from the frame before once that is known, and expanded straight from the
+ * kept frames once they all are */
+static bool stream_all_frames(
+    const char* path,
+    int width,
+    int height,
+    int frame_count,
+    int lookahead,
+    bool keep,
+    int loops
+) {
+    size_t pixels = (size_t)width * height;
+    uint8_t* upload = malloc(pixels * 4);
+    struct stream* stream =
+        stream_open(path, width, height, frame_count, false, lookahead, keep);
+    bool decoded = upload != NULL && stream != NULL;
+    for (int i = 0; decoded && i < frame_count * loops; ++i) {
+        struct rect whole = { 0, 0, width, height };
+        int previous = (i - 1) % frame_count;
+        if (i > 0 && keep &&
+            stream_draw(
+                stream,
+                i % frame_count,
+                previous,
+                whole,
+                upload,
+                (size_t)width * 4,
+                convert_rgba_to_argb
+            ))
+            continue;
+        const uint8_t* frame = stream_frame(stream, i % frame_count);
+        struct region changes;
+        if (frame == NULL) {
+            decoded = false;
+        } else if (i > 0 && stream_changes(stream, i % frame_count, &changes)) {
+            for (int r = 0; r < changes.count; ++r) {
+                const struct rect* rect = &changes.rects[r];
+                for (int32_t y = rect->y; y < rect->y + rect->height; ++y) {
+                    size_t offset = ((size_t)y * width + rect->x) * 4;
+                    convert_rgba_to_argb(upload + offset, frame + offset, rect->width);
+                }
+            }
+        } else {
+            convert_rgba_to_argb(upload, frame, pixels);
+        }
+    }
+    if (stream != NULL)
+        stream_close(stream);
+    free(upload);
+    return decoded;
+}
+
+/* One way of decoding a GIF for bench_gif, timed and measured in a process
+ * of its own: `args` are the path, size, frame count, lookahead, whether
+ * frames are kept, loops and the name to print */
+static int bench_gif_run(char** args) {
+    const char* path = args[0];
+    int width = atoi(args[1]);
+    int height = atoi(args[2]);
+    int frame_count = atoi(args[3]);
+    int lookahead = atoi(args[4]);
+    bool keep = atoi(args[5]) != 0;
+    int loops = atoi(args[6]);
+    const char* name = args[7];
+
+    if (!reset_peak_rss())
+        printf("  (peak RSS can't be reset, it includes the process start)\n");
+    long base = rss_field_kib("VmRSS:");
+    double start = now();
+    bool decoded = lookahead == 0 ? decode_all_frames(path, frame_count)
+                                  : stream_all_frames(
+                                        path,
+                                        width,
+                                        height,
+                                        frame_count,
+                                        lookahead,
+                                        keep,
+                                        loops
+                                    );
+    double elapsed = now() - start;
+    long peak = rss_field_kib("VmHWM:");
+    if (!decoded) {
+        printf("  %-17s failed\n", name);
+        return 1;
+    }
+    printf(
+        "  %-17s %8.3f ms  peak %7.1f MiB over the start",
+        name,
+        elapsed * 1e3,
+        (peak - base) / 1024.0
+    );
+    if (lookahead > 0) {
+        size_t held = stream_memory(width, height, lookahead);
+        if (keep)
+            held += stream_kept_memory(width, height, frame_count);
+        printf(
+            ", stream %s%.1f MiB",
+            keep ? "at most " : "",
+            held / (double)(1 << 20)
+        );
+    }
+    printf("\n");
+    return 0;
+}
+
+/* Peak RSS and time of decoding a whole animation, all frames at once against
+ * through streams of a few lookaheads, and of playing it a few times over
+ * with the frames decoded every loop or kept indexed. Each way runs in a
+ * fresh process, a forked one would fill its ring with heap pages resident
+ * since the benchmarks before and never see the peak grow. Streams also
+ * report the bytes stream_memory accounts them, which --anim-memory caps. */
+static void bench_gif(int width, int height, int frame_count, bool partial) {
+    char path[] = "/tmp/lwr-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("[lwr] error: unable to create a temporary file\n");
+        exit(1);
+    }
+    close(fd);
+    write_synthetic_gif(path, width, height, frame_count, partial);
+    printf(
+        "gif decode, %d %s frames of %dx%d (%.1f MiB decoded)\n",
+        frame_count,
+        partial ? "partial" : "whole",
+        width,
+        height,
+        (double)width * height * 4 * frame_count / (1 << 20)
+    );
+
+    struct {
+        const char* name;
+        /* 0 for all frames at once */
+        int lookahead;
+        bool keep;
+        int loops;
+    } runs[] = {
+        { "all frames", 0, false, 1 },
+        { "stream, 1 ahead", 1, false, 1 },
+        { "stream, 2 ahead", 2, false, 1 },
+        { "stream, 4 ahead", 4, false, 1 },
+        { "stream, 8 ahead", 8, false, 1 },
+        { "4 loops, decoded", 4, false, 4 },
+        { "4 loops, kept", 4, true, 4 },
+    };
+    for (size_t r = 0; r < sizeof(runs) / sizeof(runs[0]); ++r) {
+        char args[6][16];
+        snprintf(args[0], sizeof(args[0]), "%d", width);
+        snprintf(args[1], sizeof(args[1]), "%d", height);
+        snprintf(args[2], sizeof(args[2]), "%d", frame_count);
+        snprintf(args[3], sizeof(args[3]), "%d", runs[r].lookahead);
+        snprintf(args[4], sizeof(args[4]), "%d", runs[r].keep);
+        snprintf(args[5], sizeof(args[5]), "%d", runs[r].loops);
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0)
+            break;
+        if (pid > 0) {
+            waitpid(pid, NULL, 0);
+            continue;
+        }
+        execl(
+            "/proc/self/exe",
+            "lwr-bench",
+            "--gif-run",
+            path,
+            args[0],
+            args[1],
+            args[2],
+            args[3],
+            args[4],
+            args[5],
+            runs[r].name,
+            (char*)NULL
+        );
+        printf("  %-17s unable to run: %s\n", runs[r].name, strerror(errno));
+        fflush(stdout);
+        _exit(1);
+    }
+    unlink(path);
+}
+
+/* Expanding indexed pixels through an ARGB8888 palette, against swizzling
+ * the RGBA pixels they stand for */
+static void bench_expand(int width, int height) {
+    size_t pixels = (size_t)width * height;
+    /* random bytes, a quarter of the RGBA is enough for one per pixel */
+    uint8_t* indices = synthetic_rgba(width, height / 4 + 1);
+    uint8_t* colors = synthetic_rgba(16, 16);
+    uint32_t palette[256];
+    memcpy(palette, colors, sizeof(palette));
+    free(colors);
+    uint8_t* dst = malloc(pixels * 4);
+    uint8_t* reference = malloc(pixels * 4);
+    if (dst == NULL || reference == NULL) {
+        printf("[lwr] error: unable to allocate benchmark buffers\n");
+        exit(1);
+    }
+    convert_expand_palette_level(CONVERT_SCALAR)(reference, indices, palette, pixels);
+
+    printf("palette expand, %dx%d\n", width, height);
+    for (int level = CONVERT_SCALAR; level < CONVERT_LEVEL_COUNT; ++level) {
+        expand_fn fn = convert_expand_palette_level(level);
+        if (fn == NULL) {
+            printf("  %-8s unsupported\n", convert_level_name(level));
+            continue;
+        }
+
+        fn(dst, indices, palette, pixels);
+        if (memcmp(dst, reference, pixels * 4) != 0) {
+            printf("  %-8s MISMATCH\n", convert_level_name(level));
+            continue;
+        }
+
+        int iterations = 0;
+        double start = now();
+        double elapsed;
+        do {
+            fn(dst, indices, palette, pixels);
+            ++iterations;
+            elapsed = now() - start;
+        } while (elapsed < 0.25);
+        double seconds = elapsed / iterations;
+        printf(
+            "  %-8s %8.3f ms  %6.2f GB/s written\n",
+            convert_level_name(level),
+            seconds * 1e3,
+            pixels * 4 / seconds / 1e9
+        );
+    }
+
+    /* the same frame held as RGBA */
+    double seconds = time_kernel(convert_rgba_to_argb, dst, reference, pixels);
+    printf(
+        "  %-8s %8.3f ms  %6.2f GB/s written\n",
+        "swizzle",
+        seconds * 1e3,
+        pixels * 4 / seconds / 1e9
+    );
+
+    free(reference);
+    free(dst);
+    free(indices);
+}
+
+/* Hashing whole frames, as animations do to find the ones that repeat */
+static void bench_hash(int width, int height) {
+    size_t size = (size_t)width * height * 4;
+    uint8_t* data = synthetic_rgba(width, height);
+    uint64_t reference = convert_hash_level(CONVERT_SCALAR)(data, size);
+
+    printf("frame hash, %dx%d\n", width, height);
+    for (int level = CONVERT_SCALAR; level < CONVERT_LEVEL_COUNT; ++level) {
+        hash_fn fn = convert_hash_level(level);
+        if (fn == NULL) {
+            printf("  %-8s unsupported\n", convert_level_name(level));
+            continue;
+        }
+        if (fn(data, size) != reference) {
+            printf("  %-8s MISMATCH\n", convert_level_name(level));
+            continue;
+        }
+
+        /* called through a pointer, the unused hashes aren't optimized out */
+        int iterations = 0;
+        double start = now();
+        double elapsed;
+        do {
+            fn(data, size);
+            ++iterations;
+            elapsed = now() - start;
+        } while (elapsed < 0.25);
+        double seconds = elapsed / iterations;
+        printf(
+            "  %-8s %8.3f ms  %6.2f GB/s read\n",
+            convert_level_name(level),
+            seconds * 1e3,
+            size / seconds / 1e9
+        );
+    }
+
+    free(data);
+}
+
+/* Finding the changed span of rows that differ in a few pixels only, where
+ * the whole row has to be read */
+static void bench_diff(int width, int height) {
+    size_t pixels = (size_t)width * height;
+    uint8_t* a = synthetic_rgba(width, height);
+    uint8_t* b = malloc(pixels * 4);
+    if (b == NULL) {
+        printf("[lwr] error: unable to allocate benchmark buffers\n");
+        exit(1);
+    }
+    memcpy(b, a, pixels * 4);
+    for (int y = 0; y < height; ++y) {
+        size_t x = (size_t)(y * 7919) % width;
+        b[((size_t)y * width + x) * 4] ^= 1;
+    }
+
+    printf("row diff, %dx%d\n", width, height);
+    for (int level = CONVERT_SCALAR; level < CONVERT_LEVEL_COUNT; ++level) {
+        diff_fn fn = convert_diff_row_level(level);
+        if (fn == NULL) {
+            printf("  %-8s unsupported\n", convert_level_name(level));
+            continue;
+        }
+
+        bool matches = true;
+        for (int y = 0; y < height; ++y) {
+            size_t offset = (size_t)y * width * 4;
+            int32_t first, last;
+            bool changed = fn(a + offset, b + offset, width, &first, &last);
+            int32_t x = (int32_t)((size_t)(y * 7919) % width);
+            matches = matches && changed && first == x && last == x;
+        }
+        if (!matches) {
+            printf("  %-8s MISMATCH\n", convert_level_name(level));
+            continue;
+        }
+
+        int iterations = 0;
+        double start = now();
+        double elapsed;
+        do {
+            int32_t first, last;
+            for (int y = 0; y < height; ++y) {
+                size_t offset = (size_t)y * width * 4;
+                fn(a + offset, b + offset, width, &first, &last);
+            }
+            ++iterations;
+            elapsed = now() - start;
+        } while (elapsed < 0.25);
+        double seconds = elapsed / iterations;
+        printf(
+            "  %-8s %8.3f ms  %6.2f GB/s read\n",
+            convert_level_name(level),
+            seconds * 1e3,
+            pixels * 8 / seconds / 1e9
+        );
+    }
+
+    free(b);
+    free(a);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc == 10 && strcmp(argv[1], "--gif-run") == 0)
+        return bench_gif_run(argv + 2);
+
+    printf("active simd level: %s\n", convert_level_name(convert_active_level()));
+
+    bench_convert(1920, 1080);
+    bench_convert(3840, 2160);
+    bench_convert(7680, 4320);
+    bench_opaque(3840, 2160);
+    bench_scale_modes(1920, 1080);
+    bench_scale_modes(3840, 2160);
+    bench_scale_modes(7680, 4320);
+    bench_scale_modes(8192, 6144);
+    bench_filters(3840, 2160, 960, 540);
+    bench_filters(3840, 2160, 1280, 720);
+    bench_filters(8192, 6144, 480, 360);
+    bench_resize_threads(3840, 2160);
+    bench_resize_threads(8192, 6144);
+    bench_shm(1920, 1080);
+    bench_shm(3840, 2160);
+    bench_shm(7680, 4320);
+    bench_expand(1920, 1080);
+    bench_expand(3840, 2160);
+    bench_diff(1920, 1080);
+    bench_hash(1920, 1080);
+    bench_hash(3840, 2160);
+    bench_gif(640, 360, 60, false);
+    bench_gif(1280, 720, 60, false);
+    bench_gif(1280, 720, 60, true);
+    return 0;
+}
@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+#include "cache.h"
+
+#include <stdio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC 0x4352574c /* "LWRC" */
+#define CACHE_VERSION 1
+
+/* Starts each entry file, the pixels follow at data_offset */
+struct cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    int32_t width;
+    int32_t height;
+    int32_t stride;
+    uint32_t format;
+    uint32_t data_offset;
+    int32_t opaque_count;
+    struct rect opaque[REGION_MAX_RECTS];
+};
+
+/* Tags keeping the keys of image info and of drawn pixels apart */
+enum {
+    KEY_INFO = 1,
+    KEY_PIXELS = 2,
+};
+
+static uint64_t mix(uint64_t key, uint64_t field) {
+    /* splitmix64 */
+    key += field + 0x9e3779b97f4a7c15;
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111eb;
+    return key ^ (key >> 31);
+}
+
+static bool enabled(const struct cache* cache) {
+    return cache->index != NULL;
+}
+
+/* Creates $XDG_CACHE_HOME/live-wayland-reaction, or ~/.cache/... without it */
+static int open_directory(void) {
+    char path[PATH_MAX];
+    const char* base = getenv("XDG_CACHE_HOME");
+    int length;
+    if (base != NULL && base[0] == '/') {
+        length = snprintf(path, sizeof(path), "%s", base);
+    } else {
+        const char* home = getenv("HOME");
+        if (home == NULL)
+            return -1;
+        length = snprintf(path, sizeof(path), "%s/.cache", home);
+    }
+    if (length < 0 || (size_t)length >= sizeof(path) - sizeof("/" PROJECT_NAME))
+        return -1;
+
+    mkdir(path, 0700);
+    strcat(path, "/" PROJECT_NAME);
+    mkdir(path, 0700);
+    return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+static void entry_name(char* name, size_t size, uint64_t key) {
+    snprintf(name, size, "%016" PRIx64 ".lwr", key);
+}
+
+/* Removes the entry files an index that was thrown away still pointed to */
+static void remove_entries(struct cache* cache) {
+    int fd = dup(cache->dir_fd);
+    DIR* dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* suffix = strrchr(entry->d_name, '.');
+        if (suffix != NULL && (strcmp(suffix, ".lwr") == 0 || strcmp(suffix, ".tmp") == 0))
+            unlinkat(cache->dir_fd, entry->d_name, 0);
+    }
+    closedir(dir);
+}
+
+void cache_open(struct cache* cache, uint64_t limit) {
+    memset(cache, 0, sizeof(*cache));
+    cache->dir_fd = -1;
+    cache->index_fd = -1;
+    cache->limit = limit;
+    if (limit == 0)
+        return;
+
+    cache->dir_fd = open_directory();
+    if (cache->dir_fd < 0) {
+        printf("[lwr] cache unavailable: no cache directory\n");
+        return;
+    }
+    cache->index_fd = openat(cache->dir_fd, "index", O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (cache->index_fd < 0) {
+        printf("[lwr] cache unavailable: %s\n", strerror(errno));
+        cache_close(cache);
+        return;
+    }
+
+    flock(cache->index_fd, LOCK_EX);
+    struct stat st;
+    bool sized = fstat(cache->index_fd, &st) == 0 &&
+                 (size_t)st.st_size >= sizeof(struct cache_index);
+    if (!sized && ftruncate(cache->index_fd, sizeof(struct cache_index)) < 0) {
+        printf("[lwr] cache unavailable: %s\n", strerror(errno));
+        flock(cache->index_fd, LOCK_UN);
+        cache_close(cache);
+        return;
+    }
+    void* index = mmap(
+        NULL,
+        sizeof(struct cache_index),
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED,
+        cache->index_fd,
+        0
+    );
+    if (index == MAP_FAILED) {
+        printf("[lwr] cache unavailable: %s\n", strerror(errno));
+        flock(cache->index_fd, LOCK_UN);
+        cache_close(cache);
+        return;
+    }
+    cache->index = index;
+
+    /* a new index, or one another version wrote, starts over */
+    if (cache->index->magic != CACHE_MAGIC || cache->index->version != CACHE_VERSION) {
+        remove_entries(cache);
+        memset(cache->index, 0, sizeof(struct cache_index));
+        cache->index->magic = CACHE_MAGIC;
+        cache->index->version = CACHE_VERSION;
+    }
+    flock(cache->index_fd, LOCK_UN);
+}
+
+void cache_close(struct cache* cache) {
+    if (cache->index != NULL)
+        munmap(cache->index, sizeof(struct cache_index));
+    if (cache->index_fd >= 0)
+        close(cache->index_fd);
+    if (cache->dir_fd >= 0)
+        close(cache->dir_fd);
+    cache->index = NULL;
+    cache->index_fd = -1;
+    cache->dir_fd = -1;
+}
+
+uint64_t cache_source(const char* path) {
+    struct stat st;
+    if (stat(path, &st) < 0)
+        return 0;
+    /* FNV-1a over the path, then the file's mtime and size */
+    uint64_t key = 0xcbf29ce484222325;
+    for (const char* c = path; *c != '\0'; ++c)
+        key = (key ^ (uint8_t)*c) * 0x100000001b3;
+    key = mix(key, st.st_mtim.tv_sec);
+    key = mix(key, st.st_mtim.tv_nsec);
+    key = mix(key, st.st_size);
+    return key != 0 ? key : 1;
+}
+
+static uint64_t info_key(uint64_t source) {
+    uint64_t key = mix(mix(0, KEY_INFO), source);
+    return key != 0 ? key : 1;
+}
+
+static uint64_t pixels_key(
+    uint64_t source,
+    int32_t width,
+    int32_t height,
+    uint32_t format,
+    uint32_t variant
+) {
+    uint64_t key = mix(mix(0, KEY_PIXELS), source);
+    key = mix(key, (uint32_t)width);
+    key = mix(key, (uint32_t)height);
+    key = mix(key, format);
+    key = mix(key, variant);
+    return key != 0 ? key : 1;
+}
+
+static struct cache_entry* find(struct cache* cache, uint64_t key) {
+    struct cache_entry* set = &cache->index->entries[(key % CACHE_SETS) * CACHE_WAYS];
+    for (int i = 0; i < CACHE_WAYS; ++i) {
+        if (set[i].key == key)
+            return &set[i];
+    }
+    return NULL;
+}
+
+static void evict(struct cache* cache, struct cache_entry* entry) {
+    if (entry->bytes != 0) {
+        char name[32];
+        entry_name(name, sizeof(name), entry->key);
+        unlinkat(cache->dir_fd, name, 0);
+        cache->index->bytes -= entry->bytes;
+        ++cache->stats.evictions;
+    }
+    memset(entry, 0, sizeof(*entry));
+}
+
+/* Makes room for `key` in its set, evicting the least recently used way when
+ * all are taken */
+static struct cache_entry* insert(struct cache* cache, uint64_t key) {
+    struct cache_entry* entry = find(cache, key);
+    if (entry == NULL) {
+        struct cache_entry* set = &cache->index->entries[(key % CACHE_SETS) * CACHE_WAYS];
+        entry = &set[0];
+        for (int i = 1; i < CACHE_WAYS && entry->key != 0; ++i) {
+            if (set[i].key == 0 || set[i].last_used < entry->last_used)
+                entry = &set[i];
+        }
+    }
+    evict(cache, entry);
+    entry->key = key;
+    entry->last_used = ++cache->index->clock;
+    return entry;
+}
+
+/* Evicts the least recently used pixels until `bytes` more fit in the limit */
+static void make_room(struct cache* cache, uint64_t bytes) {
+    while (cache->index->bytes + bytes > cache->limit) {
+        struct cache_entry* oldest = NULL;
+        for (int i = 0; i < CACHE_SETS * CACHE_WAYS; ++i) {
+            struct cache_entry* entry = &cache->index->entries[i];
+            if (entry->bytes != 0 && (oldest == NULL || entry->last_used < oldest->last_used))
+                oldest = entry;
+        }
+        if (oldest == NULL) {
+            /* the index lost track of some bytes, start the count over */
+            cache->index->bytes = 0;
+            return;
+        }
+        evict(cache, oldest);
+    }
+}
+
+bool cache_get_info(
+    struct cache* cache,
+    uint64_t source,
+    int* width,
+    int* height,
+    bool* opaque
+) {
+    if (!enabled(cache) || source == 0)
+        return false;
+    flock(cache->index_fd, LOCK_EX);
+    struct cache_entry* entry = find(cache, info_key(source));
+    if (entry != NULL) {
+        entry->last_used = ++cache->index->clock;
+        *width = entry->width;
+        *height = entry->height;
+        *opaque = entry->opaque;
+    }
+    flock(cache->index_fd, LOCK_UN);
+    return entry != NULL;
+}
+
+void cache_put_info(struct cache* cache, uint64_t source, int width, int height, bool opaque) {
+    if (!enabled(cache) || source == 0)
+        return;
+    flock(cache->index_fd, LOCK_EX);
+    struct cache_entry* entry = insert(cache, info_key(source));
+    entry->width = width;
+    entry->height = height;
+    entry->opaque = opaque;
+    flock(cache->index_fd, LOCK_UN);
+}
+
+bool cache_get(
+    struct cache* cache,
+    uint64_t source,
+    int32_t width,
+    int32_t height,
+    uint32_t format,
+    uint32_t variant,
+    struct cache_pixels* out
+) {
+    if (!enabled(cache) || source == 0)
+        return false;
+    uint64_t key = pixels_key(source, width, height, format, variant);
+
+    flock(cache->index_fd, LOCK_EX);
+    struct cache_entry* entry = find(cache, key);
+    void* map = MAP_FAILED;
+    size_t size = 0;
+    if (entry != NULL) {
+        char name[32];
+        entry_name(name, sizeof(name), key);
+        int fd = openat(cache->dir_fd, name, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        bool sized = fd >= 0 && fstat(fd, &st) == 0 &&
+                     (size_t)st.st_size >= sizeof(struct cache_header);
+        if (sized) {
+            size = st.st_size;
+            map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+
+    const struct cache_header* header = map != MAP_FAILED ? map : NULL;
+    bool valid = header != NULL && header->magic == CACHE_MAGIC &&
+                 header->version == CACHE_VERSION && header->key == key &&
+                 header->width == width && header->height == height &&
+                 header->format == format && header->stride >= width * 4 &&
+                 header->opaque_count >= 0 && header->opaque_count <= REGION_MAX_RECTS &&
+                 header->data_offset + (uint64_t)header->stride * height <= size;
+    if (!valid) {
+        if (header != NULL)
+            munmap(map, size);
+        /* a file gone missing or cut short is dropped from the index */
+        if (entry != NULL)
+            evict(cache, entry);
+        flock(cache->index_fd, LOCK_UN);
+        ++cache->stats.misses;
+        return false;
+    }
+    entry->last_used = ++cache->index->clock;
+    flock(cache->index_fd, LOCK_UN);
+
+    out->map = map;
+    out->map_size = size;
+    out->data = (const uint8_t*)map + header->data_offset;
+    out->stride = header->stride;
+    out->opaque.count = header->opaque_count;
+    memcpy(out->opaque.rects, header->opaque, sizeof(header->opaque));
+    ++cache->stats.hits;
+    return true;
+}
+
+void cache_pixels_release(struct cache_pixels* pixels) {
+    if (pixels->map != NULL)
+        munmap(pixels->map, pixels->map_size);
+    pixels->map = NULL;
+}
+
+static bool write_at(int fd, const void* data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data = (const uint8_t*)data + written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+void cache_put(
+    struct cache* cache,
+    uint64_t source,
+    int32_t width,
+    int32_t height,
+    uint32_t format,
+    uint32_t variant,
+    const uint8_t* data,
+    int32_t stride,
+    const struct region* opaque
+) {
+    if (!enabled(cache) || source == 0)
+        return;
+
+    /* pixels start on a page so they can be mapped on their own */
+    uint32_t page = sysconf(_SC_PAGESIZE);
+    uint32_t data_offset = (sizeof(struct cache_header) + page - 1) / page * page;
+    int32_t row = width * 4;
+    uint64_t bytes = data_offset + (uint64_t)row * height;
+    if (bytes > cache->limit)
+        return;
+
+    uint64_t key = pixels_key(source, width, height, format, variant);
+    struct cache_header header = {
+        .magic = CACHE_MAGIC,
+        .version = CACHE_VERSION,
+        .key = key,
+        .width = width,
+        .height = height,
+        .stride = row,
+        .format = format,
+        .data_offset = data_offset,
+        .opaque_count = opaque->count,
+    };
+    memcpy(header.opaque, opaque->rects, sizeof(header.opaque));
+
+    /* written aside and renamed in place, so readers never see half a file */
+    char name[32], temp[48];
+    entry_name(name, sizeof(name), key);
+    snprintf(temp, sizeof(temp), "%016" PRIx64 ".%ld.tmp", key, (long)getpid());
+    int fd = openat(cache->dir_fd, temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+    bool written = write_at(fd, &header, sizeof(header), 0);
+    for (int32_t y = 0; y < height && written; ++y) {
+        written = write_at(
+            fd,
+            data + (size_t)y * stride,
+            row,
+            data_offset + (off_t)y * row
+        );
+    }
+    close(fd);
+    if (!written) {
+        printf("[lwr] unable to write cache entry: %s\n", strerror(errno));
+        unlinkat(cache->dir_fd, temp, 0);
+        return;
+    }
+
+    flock(cache->index_fd, LOCK_EX);
+    struct cache_entry* entry = find(cache, key);
+    if (entry != NULL)
+        evict(cache, entry);
+    make_room(cache, bytes);
+    if (renameat(cache->dir_fd, temp, cache->dir_fd, name) == 0) {
+        entry = insert(cache, key);
+        entry->bytes = bytes;
+        entry->width = width;
+        entry->height = height;
+        cache->index->bytes += bytes;
+        ++cache->stats.stores;
+    } else {
+        unlinkat(cache->dir_fd, temp, 0);
+    }
+    flock(cache->index_fd, LOCK_UN);
+}
+
+void cache_print_stats(const struct cache* cache) {
+    if (!enabled(cache))
+        return;
+    printf(
+        "[lwr] cache: %.1f of %.1f MiB, %lu hits, %lu misses, %lu stores, %lu evictions\n",
+        cache->index->bytes / 1048576.0,
+        cache->limit / 1048576.0,
+        cache->stats.hits,
+        cache->stats.misses,
+        cache->stats.stores,
+        cache->stats.evictions
+    );
+}
@@ -0,0 +1,110 @@
+#ifndef LWR_CACHE_H
+#define LWR_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "region.h"
+
+/* On-disk cache of drawn buffers under $XDG_CACHE_HOME, shared between runs.
+ * Each entry is a file holding a header and the pixels exactly as they go
+ * into a wl_shm buffer, page aligned so they can be mapped. A memory mapped
+ * set-associative index finds entries in constant time and evicts the least
+ * recently used ones to stay under a size limit. Images are identified by
+ * path, mtime and size, so editing one misses rather than showing old
+ * pixels. */
+
+#define CACHE_SETS 256
+#define CACHE_WAYS 4
+
+struct cache_entry {
+    /* 0 for a free way */
+    uint64_t key;
+    uint64_t last_used;
+    /* size of the entry's file, 0 for image info */
+    uint64_t bytes;
+    int32_t width;
+    int32_t height;
+    uint32_t opaque;
+    uint32_t padding;
+};
+
+struct cache_index {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t clock;
+    uint64_t bytes;
+    struct cache_entry entries[CACHE_SETS * CACHE_WAYS];
+};
+
+struct cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stores;
+    unsigned long evictions;
+};
+
+struct cache {
+    int dir_fd;
+    int index_fd;
+    struct cache_index* index;
+    uint64_t limit;
+    struct cache_stats stats;
+};
+
+/* A drawn buffer mapped from the cache */
+struct cache_pixels {
+    void* map;
+    size_t map_size;
+    const uint8_t* data;
+    int32_t stride;
+    struct region opaque;
+};
+
+/* Opens the cache with room for `limit` bytes of pixels. A limit of 0, or a
+ * cache that can't be opened, leaves it disabled and every lookup missing. */
+void cache_open(struct cache* cache, uint64_t limit);
+void cache_close(struct cache* cache);
+
+/* Identity of the file at `path` as it is now, 0 when it can't be read */
+uint64_t cache_source(const char* path);
+
+/* Size and opacity of a decoded source, found without decoding it */
+bool cache_get_info(
+    struct cache* cache,
+    uint64_t source,
+    int* width,
+    int* height,
+    bool* opaque
+);
+void cache_put_info(struct cache* cache, uint64_t source, int width, int height, bool opaque);
+
+/* Pixels of `source` drawn at a size and format. `variant` tells apart ways
+ * of drawing that give different pixels at the same size. */
+bool cache_get(
+    struct cache* cache,
+    uint64_t source,
+    int32_t width,
+    int32_t height,
+    uint32_t format,
+    uint32_t variant,
+    struct cache_pixels* out
+);
+void cache_pixels_release(struct cache_pixels* pixels);
+
+void cache_put(
+    struct cache* cache,
+    uint64_t source,
+    int32_t width,
+    int32_t height,
+    uint32_t format,
+    uint32_t variant,
+    const uint8_t* data,
+    int32_t stride,
+    const struct region* opaque
+);
+
+void cache_print_stats(const struct cache* cache);
+
+#endif
@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+#include "control.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+bool control_socket_path(char* path, size_t size) {
+    const char* socket = getenv("LWR_SOCKET");
+    if (socket != NULL && socket[0] != '\0') {
+        if ((size_t)snprintf(path, size, "%s", socket) >= size) {
+            printf("[lwr] error: socket path %s is too long\n", socket);
+            return false;
+        }
+        return true;
+    }
+
+    const char* runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime == NULL) {
+        printf("[lwr] error: XDG_RUNTIME_DIR is not set\n");
+        return false;
+    }
+    const char* display = getenv("WAYLAND_DISPLAY");
+    if (display == NULL)
+        display = "wayland-0";
+    /* the display may be given as a path */
+    const char* slash = strrchr(display, '/');
+    if (slash != NULL)
+        display = slash + 1;
+
+    if ((size_t)snprintf(path, size, "%s/" PROJECT_NAME "-%s.sock", runtime, display) >= size) {
+        printf("[lwr] error: socket path in %s is too long\n", runtime);
+        return false;
+    }
+    return true;
+}
+
+static bool socket_address(struct sockaddr_un* addr, const char* path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        printf("[lwr] error: socket path %s is too long\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+/* Reads until the peer shuts down, NUL terminating what was read. Returns the
+ * length, or -1 on errors and when it doesn't fit. */
+static ssize_t read_all(int fd, char* buffer, size_t size) {
+    size_t length = 0;
+    while (true) {
+        if (length == size - 1)
+            return -1;
+        ssize_t got = read(fd, buffer + length, size - 1 - length);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (got == 0)
+            break;
+        length += got;
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+int control_listen(const char* path) {
+    struct sockaddr_un addr;
+    if (!socket_address(&addr, path))
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        printf("[lwr] error: unable to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int ret = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    if (ret < 0 && errno == EADDRINUSE) {
+        /* only take the path over if nobody answers on it */
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool live = probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        if (probe >= 0)
+            close(probe);
+        if (live) {
+            printf("[lwr] error: a daemon is already listening on %s\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+        ret = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    }
+    if (ret < 0 || listen(fd, 8) < 0) {
+        printf("[lwr] error: unable to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool control_accept(int listen_fd, struct control_client* client) {
+    client->fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    client->length = 0;
+    return client->fd >= 0;
+}
+
+static enum control_read refuse(struct control_client* client, const char* reply) {
+    control_reply(client, reply);
+    return CONTROL_READ_FAILED;
+}
+
+enum control_read control_read(struct control_client* client, char** words, int* word_count) {
+    char* request = client->request;
+    while (true) {
+        size_t room = CONTROL_MAX_REQUEST - 1 - client->length;
+        if (room == 0)
+            return refuse(client, "error: request too long");
+        ssize_t got = read(client->fd, request + client->length, room);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONTROL_READ_PENDING;
+            return refuse(client, "error: unreadable request");
+        }
+        if (got == 0)
+            break;
+        client->length += got;
+    }
+    request[client->length] = '\0';
+
+    int count = 0;
+    for (size_t i = 0; i < client->length; i += strlen(request + i) + 1) {
+        if (count == CONTROL_MAX_WORDS - 1)
+            return refuse(client, "error: too many words");
+        words[count++] = request + i;
+    }
+    words[count] = NULL;
+    *word_count = count;
+    return CONTROL_READ_DONE;
+}
+
+void control_reply(struct control_client* client, const char* reply) {
+    /* a reply fits in an empty socket buffer, non-blocking sends go through */
+    write_all(client->fd, reply, strlen(reply));
+    write_all(client->fd, "\n", 1);
+    close(client->fd);
+    client->fd = -1;
+}
+
+bool control_send(int word_count, char** words) {
+    char path[CONTROL_MAX_PATH];
+    struct sockaddr_un addr;
+    if (!control_socket_path(path, sizeof(path)) || !socket_address(&addr, path))
+        return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("[lwr] error: no daemon on %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    bool sent = true;
+    for (int i = 0; i < word_count && sent; ++i)
+        sent = write_all(fd, words[i], strlen(words[i]) + 1);
+    shutdown(fd, SHUT_WR);
+
+    char reply[CONTROL_MAX_REPLY];
+    ssize_t length = sent ? read_all(fd, reply, sizeof(reply)) : -1;
+    close(fd);
+    if (length <= 0) {
+        printf("[lwr] error: no reply from the daemon\n");
+        return false;
+    }
+
+    reply[strcspn(reply, "\n")] = '\0';
+    if (strncmp(reply, "ok", 2) == 0 && (reply[2] == '\0' || reply[2] == ' ')) {
+        if (reply[2] == ' ')
+            printf("%s\n", reply + 3);
+        return true;
+    }
+    printf("[lwr] %s\n", reply);
+    return false;
+}
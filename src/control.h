@@ -0,0 +1,63 @@
+#ifndef LWR_CONTROL_H
+#define LWR_CONTROL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* The daemon's control socket. A request is the words of a command line,
+ * each NUL terminated, sent over a fresh connection that the client then
+ * shuts down for writing. The reply is one line, "ok" optionally followed by
+ * a space and output for the user, or "error: <reason>". */
+
+#define CONTROL_MAX_REQUEST 4096
+#define CONTROL_MAX_WORDS 32
+#define CONTROL_MAX_REPLY 512
+/* sizeof(sockaddr_un.sun_path) on Linux */
+#define CONTROL_MAX_PATH 108
+/* connections read from at once, more wait to be accepted */
+#define CONTROL_MAX_CLIENTS 4
+/* a client that hasn't sent its whole request by then is dropped */
+#define CONTROL_TIMEOUT_MS 1000
+
+/* A connection whose request is still coming in, fd -1 for none */
+struct control_client {
+    int fd;
+    char request[CONTROL_MAX_REQUEST];
+    size_t length;
+    /* when it was accepted, on the caller's clock */
+    double accepted;
+};
+
+enum control_read {
+    /* more of the request is to come */
+    CONTROL_READ_PENDING,
+    /* the request is in, reply on the client's fd */
+    CONTROL_READ_DONE,
+    /* the request was unusable, the client got an error and is closed */
+    CONTROL_READ_FAILED,
+};
+
+/* $LWR_SOCKET, or a socket per Wayland display in $XDG_RUNTIME_DIR */
+bool control_socket_path(char* path, size_t size);
+
+/* Returns a listening socket at `path`, or -1. A stale socket left by a
+ * daemon that died is replaced, a live one is not. */
+int control_listen(const char* path);
+
+/* Accepts one connection into `client`, non-blocking so its request is read
+ * as it comes in. Returns false when there was none. */
+bool control_accept(int listen_fd, struct control_client* client);
+
+/* Reads what has arrived of the client's request, without waiting for more.
+ * Once the client has shut its end down, the request is split into `words`,
+ * which point into the client. */
+enum control_read control_read(struct control_client* client, char** words, int* word_count);
+
+/* Sends the reply line and closes the client */
+void control_reply(struct control_client* client, const char* reply);
+
+/* Sends a request as the thin client, printing the reply's output or error.
+ * Returns whether the daemon answered "ok". */
+bool control_send(int word_count, char** words);
+
+#endif
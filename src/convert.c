@@ -0,0 +1,1150 @@
+#include "convert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+static const char* level_names[CONVERT_LEVEL_COUNT] = {
+    [CONVERT_SCALAR] = "scalar",
+    [CONVERT_SSE2] = "sse2",
+    [CONVERT_SSSE3] = "ssse3",
+    [CONVERT_AVX2] = "avx2",
+    [CONVERT_AVX512] = "avx512",
+};
+
+const char* convert_level_name(enum convert_level level) {
+    return level < CONVERT_LEVEL_COUNT ? level_names[level] : "unknown";
+}
+
+bool convert_level_supported(enum convert_level level) {
+    switch (level) {
+        case CONVERT_SCALAR:
+            return true;
+#ifdef CONVERT_X86
+        case CONVERT_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case CONVERT_SSSE3:
+            return __builtin_cpu_supports("ssse3");
+        case CONVERT_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case CONVERT_AVX512:
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+        default:
+            return false;
+    }
+}
+
+/* Scalar kernels */
+
+static void rgba_to_argb_scalar(uint8_t* dst, const uint8_t* src, size_t pixels) {
+    for (size_t i = 0; i < pixels; ++i) {
+        uint32_t p;
+        memcpy(&p, src + i * 4, 4);
+        /* bytes R G B A read as 0xAABBGGRR, swap R and B */
+        p = (p & 0xff00ff00) | ((p & 0x00ff0000) >> 16) | ((p & 0x000000ff) << 16);
+        memcpy(dst + i * 4, &p, 4);
+    }
+}
+
+static bool is_opaque_scalar(const uint8_t* data, size_t pixels) {
+    for (size_t i = 0; i < pixels; ++i) {
+        if (data[i * 4 + 3] != 255)
+            return false;
+    }
+    return true;
+}
+
+static bool diff_row_scalar(
+    const uint8_t* a,
+    const uint8_t* b,
+    int32_t pixels,
+    int32_t* first,
+    int32_t* last
+) {
+    if (memcmp(a, b, (size_t)pixels * 4) == 0)
+        return false;
+    int32_t left = 0, right = pixels;
+    while (memcmp(a + left * 4, b + left * 4, 4) == 0)
+        ++left;
+    while (memcmp(a + (right - 1) * 4, b + (right - 1) * 4, 4) == 0)
+        --right;
+    *first = left;
+    *last = right - 1;
+    return true;
+}
+
+/* The hash accumulates 64-byte stripes into eight 64-bit lanes, each adding
+ * its word and the product of the word's halves mixed with a secret that
+ * differs from stripe to stripe. Every HASH_BLOCK stripes the lanes are
+ * scrambled, so moving data between blocks changes the hash as well. The
+ * vector kernels run the same lanes side by side. */
+
+#define HASH_STRIPE 64
+#define HASH_BLOCK 16
+#define HASH_PRIME 0x9e3779b1u
+
+/* a lane of stripe s mixes in the secret word s % HASH_BLOCK further on */
+static const uint64_t hash_secret[8 + HASH_BLOCK] = {
+    0x97c85d628ce650a5, 0x3ac493b88f839f21, 0x94fc674b3cf95bfb, 0x5ad7aaf57f696b07,
+    0x2a3f736979a3a6ec, 0x6cbace482501c2e1, 0x7a23cad1fd3cbf07, 0x27fcb28ebbd40846,
+    0xf687a4cb6b4c68e6, 0x3af6413d7dd558d5, 0x1e624f75b1aff121, 0xd521dae39cb58440,
+    0x6492d416287a197c, 0x92a56796d3fa2464, 0x61d5c52eb645b494, 0xd54d344b20e43f79,
+    0xfc365290e5c45e4c, 0xf1749cdcd64a4d28, 0xcb9ce403ba499dec, 0x0de9dfd7db626bbe,
+    0x2283991c7d6aa86d, 0xc1d62adff5307fed, 0x185cb820378a0b7c, 0x37214e288638a355,
+};
+
+static inline void hash_stripe_scalar(uint64_t* acc, const uint8_t* data, size_t stripe) {
+    const uint64_t* secret = hash_secret + stripe % HASH_BLOCK;
+    for (int i = 0; i < 8; ++i) {
+        uint64_t word;
+        memcpy(&word, data + i * 8, 8);
+        uint64_t x = word ^ secret[i];
+        acc[i] += word + (x & 0xffffffff) * (x >> 32);
+    }
+}
+
+static inline void hash_scramble_scalar(uint64_t* acc) {
+    for (int i = 0; i < 8; ++i)
+        acc[i] = (acc[i] ^ (acc[i] >> 47)) * HASH_PRIME;
+}
+
+/* Hashes the stripes after the first `done`, the last one zero padded, and
+ * folds the lanes together with the size */
+static uint64_t hash_finish(uint64_t* acc, const uint8_t* data, size_t size, size_t done) {
+    size_t stripes = size / HASH_STRIPE;
+    for (size_t s = done; s < stripes; ++s) {
+        hash_stripe_scalar(acc, data + s * HASH_STRIPE, s);
+        if ((s + 1) % HASH_BLOCK == 0)
+            hash_scramble_scalar(acc);
+    }
+    size_t tail = size % HASH_STRIPE;
+    if (tail != 0) {
+        uint8_t last[HASH_STRIPE] = { 0 };
+        memcpy(last, data + size - tail, tail);
+        hash_stripe_scalar(acc, last, stripes);
+    }
+
+    uint64_t hash = size * 0x9e3779b97f4a7c15;
+    for (int i = 0; i < 8; ++i) {
+        /* splitmix64 */
+        hash ^= acc[i];
+        hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+        hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+        hash ^= hash >> 31;
+    }
+    return hash;
+}
+
+static uint64_t hash_scalar(const uint8_t* data, size_t size) {
+    uint64_t acc[8];
+    memcpy(acc, hash_secret, sizeof(acc));
+    return hash_finish(acc, data, size, 0);
+}
+
+static void
+halve_row_scalar(uint8_t* dst, const uint8_t* row0, const uint8_t* row1, int32_t width) {
+    for (int32_t x = 0; x < width; ++x) {
+        for (int c = 0; c < 4; ++c) {
+            unsigned sum = row0[x * 8 + c] + row0[x * 8 + 4 + c] + row1[x * 8 + c] +
+                           row1[x * 8 + 4 + c];
+            dst[x * 4 + c] = (sum + 2) >> 2;
+        }
+    }
+}
+
+static void halve_scalar(
+    uint8_t* dst,
+    int32_t dst_stride,
+    const uint8_t* src,
+    int32_t src_stride,
+    int32_t dst_width,
+    int32_t dst_height
+) {
+    for (int32_t y = 0; y < dst_height; ++y) {
+        const uint8_t* row0 = src + (size_t)y * 2 * src_stride;
+        halve_row_scalar(dst + (size_t)y * dst_stride, row0, row0 + src_stride, dst_width);
+    }
+}
+
+static void expand_palette_scalar(
+    uint8_t* dst,
+    const uint8_t* indices,
+    const uint32_t* palette,
+    size_t pixels
+) {
+    for (size_t i = 0; i < pixels; ++i)
+        memcpy(dst + i * 4, &palette[indices[i]], 4);
+}
+
+/* Rounding for the two passes of the fixed-point filters */
+#define FILTER_ROW_SHIFT (CONVERT_FILTER_BITS - CONVERT_ROW_BITS)
+#define FILTER_COLUMN_SHIFT (CONVERT_FILTER_BITS + CONVERT_ROW_BITS)
+
+static void filter_row_scalar(
+    int16_t* dst,
+    const uint8_t* src,
+    int32_t width,
+    const int32_t* starts,
+    const int32_t* counts,
+    const int16_t* weights,
+    int32_t taps
+) {
+    for (int32_t x = 0; x < width; ++x) {
+        const uint8_t* p = src + (size_t)starts[x] * 4;
+        const int16_t* w = weights + (size_t)x * taps;
+        int32_t sum[4] = { 0, 0, 0, 0 };
+        for (int32_t t = 0; t < counts[x]; ++t) {
+            for (int c = 0; c < 4; ++c)
+                sum[c] += w[t] * p[t * 4 + c];
+        }
+        for (int c = 0; c < 4; ++c)
+            dst[x * 4 + c] = (sum[c] + (1 << (FILTER_ROW_SHIFT - 1))) >> FILTER_ROW_SHIFT;
+    }
+}
+
+/* Channels `from` to `to` of a vertical filter */
+static void filter_column_channels(
+    uint8_t* dst,
+    const int16_t* const* rows,
+    const int16_t* weights,
+    int32_t count,
+    int32_t from,
+    int32_t to
+) {
+    for (int32_t i = from; i < to; ++i) {
+        int32_t sum = 1 << (FILTER_COLUMN_SHIFT - 1);
+        for (int32_t t = 0; t < count; ++t)
+            sum += weights[t] * rows[t][i];
+        sum >>= FILTER_COLUMN_SHIFT;
+        dst[i] = sum < 0 ? 0 : sum > 255 ? 255 : sum;
+    }
+}
+
+static void filter_column_scalar(
+    uint8_t* dst,
+    const int16_t* const* rows,
+    const int16_t* weights,
+    int32_t count,
+    int32_t width
+) {
+    filter_column_channels(dst, rows, weights, count, 0, width * 4);
+}
+
+#ifdef CONVERT_X86
+
+/* x86 kernels. Each one handles whole vectors and leaves the tail to the
+ * scalar kernel, so none of them needs masked loads. */
+
+__attribute__((target("sse2"))) static void
+rgba_to_argb_sse2(uint8_t* dst, const uint8_t* src, size_t pixels) {
+    const __m128i ag_mask = _mm_set1_epi32((int)0xff00ff00);
+    const __m128i rb_mask = _mm_set1_epi32(0x00ff00ff);
+    size_t i = 0;
+    for (; i + 4 <= pixels; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        __m128i ag = _mm_and_si128(p, ag_mask);
+        __m128i rb = _mm_and_si128(p, rb_mask);
+        rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_or_si128(ag, rb));
+    }
+    rgba_to_argb_scalar(dst + i * 4, src + i * 4, pixels - i);
+}
+
+__attribute__((target("ssse3"))) static void
+rgba_to_argb_ssse3(uint8_t* dst, const uint8_t* src, size_t pixels) {
+    const __m128i shuffle =
+        _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    size_t i = 0;
+    for (; i + 4 <= pixels; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        _mm_storeu_si128((__m128i*)(dst + i * 4), _mm_shuffle_epi8(p, shuffle));
+    }
+    rgba_to_argb_scalar(dst + i * 4, src + i * 4, pixels - i);
+}
+
+__attribute__((target("avx2"))) static void
+rgba_to_argb_avx2(uint8_t* dst, const uint8_t* src, size_t pixels) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15
+    );
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        __m256i p0 = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        __m256i p1 = _mm256_loadu_si256((const __m256i*)(src + i * 4 + 32));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_shuffle_epi8(p0, shuffle));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4 + 32), _mm256_shuffle_epi8(p1, shuffle));
+    }
+    for (; i + 8 <= pixels; i += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), _mm256_shuffle_epi8(p, shuffle));
+    }
+    rgba_to_argb_scalar(dst + i * 4, src + i * 4, pixels - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+rgba_to_argb_avx512(uint8_t* dst, const uint8_t* src, size_t pixels) {
+    const __m512i shuffle = _mm512_broadcast_i32x4(
+        _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15)
+    );
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        __m512i p = _mm512_loadu_si512((const void*)(src + i * 4));
+        _mm512_storeu_si512((void*)(dst + i * 4), _mm512_shuffle_epi8(p, shuffle));
+    }
+    rgba_to_argb_scalar(dst + i * 4, src + i * 4, pixels - i);
+}
+
+/* The alpha scans AND pixels together and only look at the accumulator every
+ * OPAQUE_BLOCK pixels, so an opaque image costs one load and one AND per
+ * vector while a transparent one still bails out early. */
+#define OPAQUE_BLOCK 1024
+
+__attribute__((target("sse2"))) static bool
+is_opaque_sse2(const uint8_t* data, size_t pixels) {
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    size_t i = 0;
+    while (i + 4 <= pixels) {
+        __m128i acc = alpha;
+        size_t end = i + OPAQUE_BLOCK < pixels ? i + OPAQUE_BLOCK : pixels;
+        for (; i + 4 <= end; i += 4)
+            acc = _mm_and_si128(acc, _mm_loadu_si128((const __m128i*)(data + i * 4)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(acc, alpha)) != 0xffff)
+            return false;
+    }
+    return is_opaque_scalar(data + i * 4, pixels - i);
+}
+
+__attribute__((target("avx2"))) static bool
+is_opaque_avx2(const uint8_t* data, size_t pixels) {
+    const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+    size_t i = 0;
+    while (i + 8 <= pixels) {
+        __m256i acc = alpha;
+        size_t end = i + OPAQUE_BLOCK < pixels ? i + OPAQUE_BLOCK : pixels;
+        for (; i + 8 <= end; i += 8)
+            acc = _mm256_and_si256(acc, _mm256_loadu_si256((const __m256i*)(data + i * 4)));
+        if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi32(acc, alpha)) != 0xffffffffu)
+            return false;
+    }
+    return is_opaque_scalar(data + i * 4, pixels - i);
+}
+
+__attribute__((target("avx512f"))) static bool
+is_opaque_avx512(const uint8_t* data, size_t pixels) {
+    const __m512i alpha = _mm512_set1_epi32((int)0xff000000);
+    size_t i = 0;
+    while (i + 16 <= pixels) {
+        __m512i acc = alpha;
+        size_t end = i + OPAQUE_BLOCK < pixels ? i + OPAQUE_BLOCK : pixels;
+        for (; i + 16 <= end; i += 16)
+            acc = _mm512_and_si512(acc, _mm512_loadu_si512((const void*)(data + i * 4)));
+        if (_mm512_cmpneq_epi32_mask(acc, alpha) != 0)
+            return false;
+    }
+    return is_opaque_scalar(data + i * 4, pixels - i);
+}
+
+/* The row diffs look for the first differing vector from the left, then for
+ * the last one from the right, stopping at the first. The pixels between the
+ * two are never compared. */
+
+static inline bool pixel_differs(const uint8_t* a, const uint8_t* b, int32_t i) {
+    return memcmp(a + i * 4, b + i * 4, 4) != 0;
+}
+
+__attribute__((target("sse2"))) static inline int
+diff_mask_sse2(const uint8_t* a, const uint8_t* b, int32_t i) {
+    __m128i eq = _mm_cmpeq_epi32(
+        _mm_loadu_si128((const __m128i*)(a + i * 4)),
+        _mm_loadu_si128((const __m128i*)(b + i * 4))
+    );
+    return _mm_movemask_ps(_mm_castsi128_ps(eq)) ^ 0xf;
+}
+
+__attribute__((target("sse2"))) static bool diff_row_sse2(
+    const uint8_t* a,
+    const uint8_t* b,
+    int32_t pixels,
+    int32_t* first,
+    int32_t* last
+) {
+    int32_t left = 0;
+    int mask = 0;
+    for (; left + 4 <= pixels; left += 4) {
+        if ((mask = diff_mask_sse2(a, b, left)) != 0)
+            break;
+    }
+    if (mask != 0) {
+        left += __builtin_ctz(mask);
+    } else {
+        while (left < pixels && !pixel_differs(a, b, left))
+            ++left;
+        if (left == pixels)
+            return false;
+    }
+
+    /* pixels from `right` on are equal, and so is everything left of `left` */
+    int32_t right = pixels;
+    while ((right - left - 1) % 4 != 0 && !pixel_differs(a, b, right - 1))
+        --right;
+    if ((right - left - 1) % 4 == 0) {
+        for (; right - 4 > left; right -= 4) {
+            if ((mask = diff_mask_sse2(a, b, right - 4)) != 0) {
+                right = right - 4 + 32 - __builtin_clz(mask);
+                break;
+            }
+        }
+    }
+    *first = left;
+    *last = right - 1;
+    return true;
+}
+
+__attribute__((target("avx2"))) static inline int
+diff_mask_avx2(const uint8_t* a, const uint8_t* b, int32_t i) {
+    __m256i eq = _mm256_cmpeq_epi32(
+        _mm256_loadu_si256((const __m256i*)(a + i * 4)),
+        _mm256_loadu_si256((const __m256i*)(b + i * 4))
+    );
+    return _mm256_movemask_ps(_mm256_castsi256_ps(eq)) ^ 0xff;
+}
+
+__attribute__((target("avx2"))) static bool diff_row_avx2(
+    const uint8_t* a,
+    const uint8_t* b,
+    int32_t pixels,
+    int32_t* first,
+    int32_t* last
+) {
+    int32_t left = 0;
+    int mask = 0;
+    for (; left + 8 <= pixels; left += 8) {
+        if ((mask = diff_mask_avx2(a, b, left)) != 0)
+            break;
+    }
+    if (mask != 0) {
+        left += __builtin_ctz(mask);
+    } else {
+        while (left < pixels && !pixel_differs(a, b, left))
+            ++left;
+        if (left == pixels)
+            return false;
+    }
+
+    int32_t right = pixels;
+    while ((right - left - 1) % 8 != 0 && !pixel_differs(a, b, right - 1))
+        --right;
+    if ((right - left - 1) % 8 == 0) {
+        for (; right - 8 > left; right -= 8) {
+            if ((mask = diff_mask_avx2(a, b, right - 8)) != 0) {
+                right = right - 8 + 32 - __builtin_clz(mask);
+                break;
+            }
+        }
+    }
+    *first = left;
+    *last = right - 1;
+    return true;
+}
+
+/* A lane's product is of its low half by its high half, which _mm_mul_epu32
+ * does for every 64-bit lane at once. Scrambling multiplies 64-bit lanes by a
+ * 32-bit prime, as two of those. */
+
+__attribute__((target("sse2"))) static inline __m128i
+hash_stripe_sse2(__m128i acc, __m128i word, __m128i secret) {
+    __m128i x = _mm_xor_si128(word, secret);
+    __m128i product = _mm_mul_epu32(x, _mm_srli_epi64(x, 32));
+    return _mm_add_epi64(acc, _mm_add_epi64(word, product));
+}
+
+__attribute__((target("sse2"))) static inline __m128i hash_scramble_sse2(__m128i acc) {
+    __m128i prime = _mm_set1_epi32((int)HASH_PRIME);
+    acc = _mm_xor_si128(acc, _mm_srli_epi64(acc, 47));
+    __m128i low = _mm_mul_epu32(acc, prime);
+    __m128i high = _mm_mul_epu32(_mm_srli_epi64(acc, 32), prime);
+    return _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+}
+
+__attribute__((target("sse2"))) static uint64_t hash_sse2(const uint8_t* data, size_t size) {
+    __m128i acc[4];
+    for (int j = 0; j < 4; ++j)
+        acc[j] = _mm_loadu_si128((const __m128i*)hash_secret + j);
+    size_t stripes = size / HASH_STRIPE;
+    for (size_t s = 0; s < stripes; ++s) {
+        const __m128i* stripe = (const __m128i*)(data + s * HASH_STRIPE);
+        const __m128i* secret = (const __m128i*)(hash_secret + s % HASH_BLOCK);
+        for (int j = 0; j < 4; ++j) {
+            acc[j] = hash_stripe_sse2(
+                acc[j],
+                _mm_loadu_si128(stripe + j),
+                _mm_loadu_si128(secret + j)
+            );
+        }
+        if ((s + 1) % HASH_BLOCK == 0) {
+            for (int j = 0; j < 4; ++j)
+                acc[j] = hash_scramble_sse2(acc[j]);
+        }
+    }
+    uint64_t lanes[8];
+    for (int j = 0; j < 4; ++j)
+        _mm_storeu_si128((__m128i*)lanes + j, acc[j]);
+    return hash_finish(lanes, data, size, stripes);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+hash_stripe_avx2(__m256i acc, __m256i word, __m256i secret) {
+    __m256i x = _mm256_xor_si256(word, secret);
+    __m256i product = _mm256_mul_epu32(x, _mm256_srli_epi64(x, 32));
+    return _mm256_add_epi64(acc, _mm256_add_epi64(word, product));
+}
+
+__attribute__((target("avx2"))) static inline __m256i hash_scramble_avx2(__m256i acc) {
+    __m256i prime = _mm256_set1_epi32((int)HASH_PRIME);
+    acc = _mm256_xor_si256(acc, _mm256_srli_epi64(acc, 47));
+    __m256i low = _mm256_mul_epu32(acc, prime);
+    __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(acc, 32), prime);
+    return _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+}
+
+__attribute__((target("avx2"))) static uint64_t hash_avx2(const uint8_t* data, size_t size) {
+    __m256i acc[2];
+    for (int j = 0; j < 2; ++j)
+        acc[j] = _mm256_loadu_si256((const __m256i*)hash_secret + j);
+    size_t stripes = size / HASH_STRIPE;
+    for (size_t s = 0; s < stripes; ++s) {
+        const __m256i* stripe = (const __m256i*)(data + s * HASH_STRIPE);
+        const __m256i* secret = (const __m256i*)(hash_secret + s % HASH_BLOCK);
+        for (int j = 0; j < 2; ++j) {
+            acc[j] = hash_stripe_avx2(
+                acc[j],
+                _mm256_loadu_si256(stripe + j),
+                _mm256_loadu_si256(secret + j)
+            );
+        }
+        if ((s + 1) % HASH_BLOCK == 0) {
+            for (int j = 0; j < 2; ++j)
+                acc[j] = hash_scramble_avx2(acc[j]);
+        }
+    }
+    uint64_t lanes[8];
+    for (int j = 0; j < 2; ++j)
+        _mm256_storeu_si256((__m256i*)lanes + j, acc[j]);
+    return hash_finish(lanes, data, size, stripes);
+}
+
+/* Sums two vertically adjacent pairs of pixels into 16-bit lanes and folds each
+ * pair horizontally, leaving the 2x2 sums of two output pixels */
+__attribute__((target("sse2"))) static inline __m128i
+halve_sums_sse2(__m128i top, __m128i bottom) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero));
+    lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+    hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+    return _mm_unpacklo_epi64(lo, hi);
+}
+
+__attribute__((target("sse2"))) static void halve_sse2(
+    uint8_t* dst,
+    int32_t dst_stride,
+    const uint8_t* src,
+    int32_t src_stride,
+    int32_t dst_width,
+    int32_t dst_height
+) {
+    const __m128i two = _mm_set1_epi16(2);
+    for (int32_t y = 0; y < dst_height; ++y) {
+        const uint8_t* row0 = src + (size_t)y * 2 * src_stride;
+        const uint8_t* row1 = row0 + src_stride;
+        uint8_t* out = dst + (size_t)y * dst_stride;
+        int32_t x = 0;
+        for (; x + 4 <= dst_width; x += 4) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(row0 + x * 8));
+            __m128i b = _mm_loadu_si128((const __m128i*)(row0 + x * 8 + 16));
+            __m128i c = _mm_loadu_si128((const __m128i*)(row1 + x * 8));
+            __m128i d = _mm_loadu_si128((const __m128i*)(row1 + x * 8 + 16));
+            __m128i first = _mm_srli_epi16(_mm_add_epi16(halve_sums_sse2(a, c), two), 2);
+            __m128i second = _mm_srli_epi16(_mm_add_epi16(halve_sums_sse2(b, d), two), 2);
+            _mm_storeu_si128((__m128i*)(out + x * 4), _mm_packus_epi16(first, second));
+        }
+        halve_row_scalar(out + x * 4, row0 + x * 8, row1 + x * 8, dst_width - x);
+    }
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+halve_sums_avx2(__m256i top, __m256i bottom) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo =
+        _mm256_add_epi16(_mm256_unpacklo_epi8(top, zero), _mm256_unpacklo_epi8(bottom, zero));
+    __m256i hi =
+        _mm256_add_epi16(_mm256_unpackhi_epi8(top, zero), _mm256_unpackhi_epi8(bottom, zero));
+    lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+    hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+    return _mm256_unpacklo_epi64(lo, hi);
+}
+
+__attribute__((target("avx2"))) static void halve_avx2(
+    uint8_t* dst,
+    int32_t dst_stride,
+    const uint8_t* src,
+    int32_t src_stride,
+    int32_t dst_width,
+    int32_t dst_height
+) {
+    const __m256i two = _mm256_set1_epi16(2);
+    for (int32_t y = 0; y < dst_height; ++y) {
+        const uint8_t* row0 = src + (size_t)y * 2 * src_stride;
+        const uint8_t* row1 = row0 + src_stride;
+        uint8_t* out = dst + (size_t)y * dst_stride;
+        int32_t x = 0;
+        for (; x + 8 <= dst_width; x += 8) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(row0 + x * 8));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(row0 + x * 8 + 32));
+            __m256i c = _mm256_loadu_si256((const __m256i*)(row1 + x * 8));
+            __m256i d = _mm256_loadu_si256((const __m256i*)(row1 + x * 8 + 32));
+            __m256i first = _mm256_srli_epi16(_mm256_add_epi16(halve_sums_avx2(a, c), two), 2);
+            __m256i second = _mm256_srli_epi16(_mm256_add_epi16(halve_sums_avx2(b, d), two), 2);
+            /* packus works per 128-bit lane, put the quarters back in order */
+            __m256i packed = _mm256_packus_epi16(first, second);
+            packed = _mm256_permute4x64_epi64(packed, 0xd8);
+            _mm256_storeu_si256((__m256i*)(out + x * 4), packed);
+        }
+        halve_row_scalar(out + x * 4, row0 + x * 8, row1 + x * 8, dst_width - x);
+    }
+}
+
+/* The filters multiply with pmaddwd, which takes 16-bit pairs: interleaving
+ * the channels of two pixels, or of two rows, and pairing their weights sums
+ * two taps per instruction. */
+
+/* Pair of weights as pmaddwd wants them, the second one may be missing */
+static inline int32_t weight_pair(const int16_t* weights, bool second) {
+    return (uint16_t)weights[0] | (second ? (uint32_t)(uint16_t)weights[1] << 16 : 0);
+}
+
+/* Adds taps `t` to `count` of one output pixel to its channel sums */
+__attribute__((target("sse2"))) static inline __m128i filter_taps_sse2(
+    __m128i acc,
+    const uint8_t* p,
+    const int16_t* w,
+    int32_t t,
+    int32_t count
+) {
+    const __m128i zero = _mm_setzero_si128();
+    for (; t + 2 <= count; t += 2) {
+        /* r0 g0 b0 a0 r1 g1 b1 a1 into r0 r1 g0 g1 b0 b1 a0 a1 */
+        __m128i px = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(p + t * 4)), zero);
+        px = _mm_unpacklo_epi16(px, _mm_srli_si128(px, 8));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(weight_pair(w + t, true))));
+    }
+    if (t < count) {
+        uint32_t last;
+        memcpy(&last, p + t * 4, 4);
+        __m128i px = _mm_unpacklo_epi8(_mm_cvtsi32_si128(last), zero);
+        px = _mm_unpacklo_epi16(px, zero);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32(weight_pair(w + t, false))));
+    }
+    return acc;
+}
+
+__attribute__((target("sse2"))) static inline void
+filter_store_row_sse2(int16_t* dst, __m128i acc) {
+    acc = _mm_add_epi32(acc, _mm_set1_epi32(1 << (FILTER_ROW_SHIFT - 1)));
+    acc = _mm_srai_epi32(acc, FILTER_ROW_SHIFT);
+    _mm_storel_epi64((__m128i*)dst, _mm_packs_epi32(acc, acc));
+}
+
+__attribute__((target("sse2"))) static void filter_row_sse2(
+    int16_t* dst,
+    const uint8_t* src,
+    int32_t width,
+    const int32_t* starts,
+    const int32_t* counts,
+    const int16_t* weights,
+    int32_t taps
+) {
+    for (int32_t x = 0; x < width; ++x) {
+        const uint8_t* p = src + (size_t)starts[x] * 4;
+        const int16_t* w = weights + (size_t)x * taps;
+        __m128i acc = filter_taps_sse2(_mm_setzero_si128(), p, w, 0, counts[x]);
+        filter_store_row_sse2(dst + x * 4, acc);
+    }
+}
+
+__attribute__((target("avx2"))) static void filter_row_avx2(
+    int16_t* dst,
+    const uint8_t* src,
+    int32_t width,
+    const int32_t* starts,
+    const int32_t* counts,
+    const int16_t* weights,
+    int32_t taps
+) {
+    /* the first weight pair for the low lane, the second for the high one */
+    const __m256i pairs = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+    for (int32_t x = 0; x < width; ++x) {
+        const uint8_t* p = src + (size_t)starts[x] * 4;
+        const int16_t* w = weights + (size_t)x * taps;
+        int32_t count = counts[x];
+        __m256i acc4 = _mm256_setzero_si256();
+        int32_t t = 0;
+        for (; t + 4 <= count; t += 4) {
+            /* pixels 0 and 1 in the low lane, 2 and 3 in the high one */
+            __m256i px = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(p + t * 4)));
+            px = _mm256_unpacklo_epi16(px, _mm256_srli_si256(px, 8));
+            __m256i wv = _mm256_castsi128_si256(_mm_loadl_epi64((const __m128i*)(w + t)));
+            wv = _mm256_permutevar8x32_epi32(wv, pairs);
+            acc4 = _mm256_add_epi32(acc4, _mm256_madd_epi16(px, wv));
+        }
+        __m128i acc = _mm_add_epi32(
+            _mm256_castsi256_si128(acc4),
+            _mm256_extracti128_si256(acc4, 1)
+        );
+        acc = filter_taps_sse2(acc, p, w, t, count);
+        filter_store_row_sse2(dst + x * 4, acc);
+    }
+}
+
+/* Rounds and narrows the sums of 16 channels into bytes */
+__attribute__((target("sse2"))) static inline __m128i
+filter_pack_sse2(__m128i a0, __m128i a1, __m128i a2, __m128i a3) {
+    const __m128i round = _mm_set1_epi32(1 << (FILTER_COLUMN_SHIFT - 1));
+    a0 = _mm_srai_epi32(_mm_add_epi32(a0, round), FILTER_COLUMN_SHIFT);
+    a1 = _mm_srai_epi32(_mm_add_epi32(a1, round), FILTER_COLUMN_SHIFT);
+    a2 = _mm_srai_epi32(_mm_add_epi32(a2, round), FILTER_COLUMN_SHIFT);
+    a3 = _mm_srai_epi32(_mm_add_epi32(a3, round), FILTER_COLUMN_SHIFT);
+    return _mm_packus_epi16(_mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3));
+}
+
+__attribute__((target("sse2"))) static void filter_column_sse2(
+    uint8_t* dst,
+    const int16_t* const* rows,
+    const int16_t* weights,
+    int32_t count,
+    int32_t width
+) {
+    const __m128i zero = _mm_setzero_si128();
+    int32_t channels = width * 4;
+    int32_t i = 0;
+    for (; i + 16 <= channels; i += 16) {
+        __m128i a0 = zero, a1 = zero, a2 = zero, a3 = zero;
+        for (int32_t t = 0; t < count; t += 2) {
+            bool pair = t + 1 < count;
+            __m128i w = _mm_set1_epi32(weight_pair(weights + t, pair));
+            __m128i r0 = _mm_loadu_si128((const __m128i*)(rows[t] + i));
+            __m128i r1 = _mm_loadu_si128((const __m128i*)(rows[t] + i + 8));
+            __m128i s0 = pair ? _mm_loadu_si128((const __m128i*)(rows[t + 1] + i)) : zero;
+            __m128i s1 = pair ? _mm_loadu_si128((const __m128i*)(rows[t + 1] + i + 8)) : zero;
+            a0 = _mm_add_epi32(a0, _mm_madd_epi16(_mm_unpacklo_epi16(r0, s0), w));
+            a1 = _mm_add_epi32(a1, _mm_madd_epi16(_mm_unpackhi_epi16(r0, s0), w));
+            a2 = _mm_add_epi32(a2, _mm_madd_epi16(_mm_unpacklo_epi16(r1, s1), w));
+            a3 = _mm_add_epi32(a3, _mm_madd_epi16(_mm_unpackhi_epi16(r1, s1), w));
+        }
+        _mm_storeu_si128((__m128i*)(dst + i), filter_pack_sse2(a0, a1, a2, a3));
+    }
+    filter_column_channels(dst, rows, weights, count, i, channels);
+}
+
+__attribute__((target("avx2"))) static void filter_column_avx2(
+    uint8_t* dst,
+    const int16_t* const* rows,
+    const int16_t* weights,
+    int32_t count,
+    int32_t width
+) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi32(1 << (FILTER_COLUMN_SHIFT - 1));
+    int32_t channels = width * 4;
+    int32_t i = 0;
+    for (; i + 32 <= channels; i += 32) {
+        __m256i a0 = zero, a1 = zero, a2 = zero, a3 = zero;
+        for (int32_t t = 0; t < count; t += 2) {
+            bool pair = t + 1 < count;
+            __m256i w = _mm256_set1_epi32(weight_pair(weights + t, pair));
+            __m256i r0 = _mm256_loadu_si256((const __m256i*)(rows[t] + i));
+            __m256i r1 = _mm256_loadu_si256((const __m256i*)(rows[t] + i + 16));
+            __m256i s0 = pair ? _mm256_loadu_si256((const __m256i*)(rows[t + 1] + i)) : zero;
+            __m256i s1 =
+                pair ? _mm256_loadu_si256((const __m256i*)(rows[t + 1] + i + 16)) : zero;
+            a0 = _mm256_add_epi32(a0, _mm256_madd_epi16(_mm256_unpacklo_epi16(r0, s0), w));
+            a1 = _mm256_add_epi32(a1, _mm256_madd_epi16(_mm256_unpackhi_epi16(r0, s0), w));
+            a2 = _mm256_add_epi32(a2, _mm256_madd_epi16(_mm256_unpacklo_epi16(r1, s1), w));
+            a3 = _mm256_add_epi32(a3, _mm256_madd_epi16(_mm256_unpackhi_epi16(r1, s1), w));
+        }
+        a0 = _mm256_srai_epi32(_mm256_add_epi32(a0, round), FILTER_COLUMN_SHIFT);
+        a1 = _mm256_srai_epi32(_mm256_add_epi32(a1, round), FILTER_COLUMN_SHIFT);
+        a2 = _mm256_srai_epi32(_mm256_add_epi32(a2, round), FILTER_COLUMN_SHIFT);
+        a3 = _mm256_srai_epi32(_mm256_add_epi32(a3, round), FILTER_COLUMN_SHIFT);
+        /* the unpacks and packs work per 128-bit lane, put the quarters back in order */
+        __m256i packed =
+            _mm256_packus_epi16(_mm256_packs_epi32(a0, a1), _mm256_packs_epi32(a2, a3));
+        packed = _mm256_permute4x64_epi64(packed, 0xd8);
+        _mm256_storeu_si256((__m256i*)(dst + i), packed);
+    }
+    filter_column_channels(dst, rows, weights, count, i, channels);
+}
+
+/* Without a gather, SSE2 looks the pixels up one by one and only gets to
+ * store them four at a time */
+__attribute__((target("sse2"))) static void expand_palette_sse2(
+    uint8_t* dst,
+    const uint8_t* indices,
+    const uint32_t* palette,
+    size_t pixels
+) {
+    size_t i = 0;
+    for (; i + 4 <= pixels; i += 4) {
+        __m128i p = _mm_setr_epi32(
+            (int)palette[indices[i]],
+            (int)palette[indices[i + 1]],
+            (int)palette[indices[i + 2]],
+            (int)palette[indices[i + 3]]
+        );
+        _mm_storeu_si128((__m128i*)(dst + i * 4), p);
+    }
+    expand_palette_scalar(dst + i * 4, indices + i, palette, pixels - i);
+}
+
+__attribute__((target("avx2"))) static void expand_palette_avx2(
+    uint8_t* dst,
+    const uint8_t* indices,
+    const uint32_t* palette,
+    size_t pixels
+) {
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(indices + i));
+        __m256i lo = _mm256_cvtepu8_epi32(bytes);
+        __m256i hi = _mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8));
+        __m256i p0 = _mm256_i32gather_epi32((const int*)palette, lo, 4);
+        __m256i p1 = _mm256_i32gather_epi32((const int*)palette, hi, 4);
+        _mm256_storeu_si256((__m256i*)(dst + i * 4), p0);
+        _mm256_storeu_si256((__m256i*)(dst + i * 4 + 32), p1);
+    }
+    expand_palette_scalar(dst + i * 4, indices + i, palette, pixels - i);
+}
+
+__attribute__((target("avx512f"))) static void expand_palette_avx512(
+    uint8_t* dst,
+    const uint8_t* indices,
+    const uint32_t* palette,
+    size_t pixels
+) {
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        __m512i lanes = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(indices + i)));
+        __m512i p = _mm512_i32gather_epi32(lanes, (const void*)palette, 4);
+        _mm512_storeu_si512((void*)(dst + i * 4), p);
+    }
+    expand_palette_scalar(dst + i * 4, indices + i, palette, pixels - i);
+}
+
+#endif
+
+static const convert_fn rgba_to_argb_kernels[CONVERT_LEVEL_COUNT] = {
+    [CONVERT_SCALAR] = rgba_to_argb_scalar,
+#ifdef CONVERT_X86
+    [CONVERT_SSE2] = rgba_to_argb_sse2,
+    [CONVERT_SSSE3] = rgba_to_argb_ssse3,
+    [CONVERT_AVX2] = rgba_to_argb_avx2,
+    [CONVERT_AVX512] = rgba_to_argb_avx512,
+#endif
+};
+
+convert_fn convert_rgba_to_argb_level(enum convert_level level) {
+    if (level >= CONVERT_LEVEL_COUNT || !convert_level_supported(level))
+        return NULL;
+    return rgba_to_argb_kernels[level];
+}
+
+static const opaque_fn is_opaque_kernels[CONVERT_LEVEL_COUNT] = {
+    [CONVERT_SCALAR] = is_opaque_scalar,
+#ifdef CONVERT_X86
+    [CONVERT_SSE2] = is_opaque_sse2,
+    [CONVERT_SSSE3] = is_opaque_sse2,
+    [CONVERT_AVX2] = is_opaque_avx2,
+    [CONVERT_AVX512] = is_opaque_avx512,
+#endif
+};
+
+opaque_fn convert_is_opaque_level(enum convert_level level) {
+    if (level >= CONVERT_LEVEL_COUNT || !convert_level_supported(level))
+        return NULL;
+    return is_opaque_kernels[level];
+}
+
+static const diff_fn diff_row_kernels[CONVERT_LEVEL_COUNT] = {
+    [CONVERT_SCALAR] = diff_row_scalar,
+#ifdef CONVERT_X86
+    [CONVERT_SSE2] = diff_row_sse2,
+    [CONVERT_SSSE3] = diff_row_sse2,
+    [CONVERT_AVX2] = diff_row_avx2,
+    [CONVERT_AVX512] = diff_row_avx2,
+#endif
+};
+
+diff_fn convert_diff_row_level(enum convert_level level) {
+    if (level >= CONVERT_LEVEL_COUNT || !convert_level_supported(level))
+        return NULL;
+    return diff_row_kernels[level];
+}
+
+static const hash_fn hash_kernels[CONVERT_LEVEL_COUNT] = {
+    [CONVERT_SCALAR] = hash_scalar,
+#ifdef CONVERT_X86
+    [CONVERT_SSE2] = hash_sse2,
+    [CONVERT_SSSE3] = hash_sse2,
+    [CONVERT_AVX2] = hash_avx2,
+    [CONVERT_AVX512] = hash_avx2,
+#endif
+};
+
+hash_fn convert_hash_level(enum convert_level level) {
+    if (level >= CONVERT_LEVEL_COUNT || !convert_level_supported(level))
+        return NULL;
+    return hash_kernels[level];
+}
+
+static const halve_fn halve_kernels[CONVERT_LEVEL_COUNT] = {
+    [CONVERT_SCALAR] = halve_scalar,
+#ifdef CONVERT_X86
+    [CONVERT_SSE2] = halve_sse2,
+    [CONVERT_SSSE3] = halve_sse2,
+    [CONVERT_AVX2] = halve_avx2,
+    [CONVERT_AVX512] = halve_avx2,
+#endif
+};
+
+halve_fn convert_halve_level(enum convert_level level) {
+    if (level >= CONVERT_LEVEL_COUNT || !convert_level_supported(level))
+        return NULL;
+    return halve_kernels[level];
+}
+
+static const filter_row_fn filter_row_kernels[CONVERT_LEVEL_COUNT] = {
+    [CONVERT_SCALAR] = filter_row_scalar,
+#ifdef CONVERT_X86
+    [CONVERT_SSE2] = filter_row_sse2,
+    [CONVERT_SSSE3] = filter_row_sse2,
+    [CONVERT_AVX2] = filter_row_avx2,
+    [CONVERT_AVX512] = filter_row_avx2,
+#endif
+};
+
+filter_row_fn convert_filter_row_level(enum convert_level level) {
+    if (level >= CONVERT_LEVEL_COUNT || !convert_level_supported(level))
+        return NULL;
+    return filter_row_kernels[level];
+}
+
+static const filter_column_fn filter_column_kernels[CONVERT_LEVEL_COUNT] = {
+    [CONVERT_SCALAR] = filter_column_scalar,
+#ifdef CONVERT_X86
+    [CONVERT_SSE2] = filter_column_sse2,
+    [CONVERT_SSSE3] = filter_column_sse2,
+    [CONVERT_AVX2] = filter_column_avx2,
+    [CONVERT_AVX512] = filter_column_avx2,
+#endif
+};
+
+filter_column_fn convert_filter_column_level(enum convert_level level) {
+    if (level >= CONVERT_LEVEL_COUNT || !convert_level_supported(level))
+        return NULL;
+    return filter_column_kernels[level];
+}
+
+static const expand_fn expand_palette_kernels[CONVERT_LEVEL_COUNT] = {
+    [CONVERT_SCALAR] = expand_palette_scalar,
+#ifdef CONVERT_X86
+    [CONVERT_SSE2] = expand_palette_sse2,
+    [CONVERT_SSSE3] = expand_palette_sse2,
+    [CONVERT_AVX2] = expand_palette_avx2,
+    [CONVERT_AVX512] = expand_palette_avx512,
+#endif
+};
+
+expand_fn convert_expand_palette_level(enum convert_level level) {
+    if (level >= CONVERT_LEVEL_COUNT || !convert_level_supported(level))
+        return NULL;
+    return expand_palette_kernels[level];
+}
+
+/* Dispatch */
+
+static enum convert_level active_level = CONVERT_LEVEL_COUNT;
+
+static enum convert_level detect_level(void) {
+    enum convert_level best = CONVERT_SCALAR;
+    for (int level = CONVERT_SCALAR; level < CONVERT_LEVEL_COUNT; ++level) {
+        if (convert_level_supported(level))
+            best = level;
+    }
+
+    const char* forced = getenv("LWR_SIMD");
+    if (forced == NULL || forced[0] == '\0')
+        return best;
+
+    for (int level = CONVERT_SCALAR; level < CONVERT_LEVEL_COUNT; ++level) {
+        if (strcmp(forced, level_names[level]) != 0)
+            continue;
+        if (!convert_level_supported(level)) {
+            printf("[lwr] LWR_SIMD=%s not supported, using %s\n", forced, level_names[best]);
+            return best;
+        }
+        return level;
+    }
+
+    printf("[lwr] LWR_SIMD=%s unknown, using %s\n", forced, level_names[best]);
+    return best;
+}
+
+enum convert_level convert_active_level(void) {
+    if (active_level == CONVERT_LEVEL_COUNT) {
+#ifdef CONVERT_X86
+        __builtin_cpu_init();
+#endif
+        active_level = detect_level();
+    }
+    return active_level;
+}
+
+void convert_rgba_to_argb(uint8_t* dst, const uint8_t* src, size_t pixels) {
+    rgba_to_argb_kernels[convert_active_level()](dst, src, pixels);
+}
+
+bool convert_is_opaque(const uint8_t* data, size_t pixels) {
+    return is_opaque_kernels[convert_active_level()](data, pixels);
+}
+
+bool convert_diff_row(
+    const uint8_t* a,
+    const uint8_t* b,
+    int32_t pixels,
+    int32_t* first,
+    int32_t* last
+) {
+    return diff_row_kernels[convert_active_level()](a, b, pixels, first, last);
+}
+
+uint64_t convert_hash(const uint8_t* data, size_t size) {
+    return hash_kernels[convert_active_level()](data, size);
+}
+
+void convert_halve(
+    uint8_t* dst,
+    int32_t dst_stride,
+    const uint8_t* src,
+    int32_t src_stride,
+    int32_t dst_width,
+    int32_t dst_height
+) {
+    halve_fn fn = halve_kernels[convert_active_level()];
+    fn(dst, dst_stride, src, src_stride, dst_width, dst_height);
+}
+
+void convert_filter_row(
+    int16_t* dst,
+    const uint8_t* src,
+    int32_t width,
+    const int32_t* starts,
+    const int32_t* counts,
+    const int16_t* weights,
+    int32_t taps
+) {
+    filter_row_fn fn = filter_row_kernels[convert_active_level()];
+    fn(dst, src, width, starts, counts, weights, taps);
+}
+
+void convert_filter_column(
+    uint8_t* dst,
+    const int16_t* const* rows,
+    const int16_t* weights,
+    int32_t count,
+    int32_t width
+) {
+    filter_column_kernels[convert_active_level()](dst, rows, weights, count, width);
+}
+
+void convert_expand_palette(
+    uint8_t* dst,
+    const uint8_t* indices,
+    const uint32_t* palette,
+    size_t pixels
+) {
+    expand_palette_kernels[convert_active_level()](dst, indices, palette, pixels);
+}
+
+void convert_copy(uint8_t* dst, const uint8_t* src, size_t pixels) {
+    if (dst != src)
+        memcpy(dst, src, pixels * 4);
+}
+
+/* Premultiplication only runs once per loaded image, so it stays scalar */
+
+static inline uint8_t mul_div_255(uint32_t c, uint32_t a) {
+    uint32_t x = c * a + 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+void convert_premultiply_rgba(uint8_t* data, size_t pixels) {
+    for (size_t i = 0; i < pixels; ++i) {
+        uint8_t* p = data + i * 4;
+        uint8_t a = p[3];
+        if (a == 255)
+            continue;
+        p[0] = mul_div_255(p[0], a);
+        p[1] = mul_div_255(p[1], a);
+        p[2] = mul_div_255(p[2], a);
+    }
+}
+
+/* Indexing runs once per decoded frame as well. Colors are found through an
+ * open-addressed table twice the palette's size, and runs of one color, the
+ * bulk of most GIFs, skip even that. */
+
+#define INDEX_TABLE_SIZE 512
+
+int convert_index_pixels(
+    uint8_t* indices,
+    uint32_t* palette,
+    const uint8_t* src,
+    size_t pixels
+) {
+    uint32_t colors[INDEX_TABLE_SIZE];
+    int16_t slots[INDEX_TABLE_SIZE];
+    memset(slots, 0xff, sizeof(slots));
+    memset(palette, 0, 256 * sizeof(*palette));
+    int count = 0;
+    uint32_t last = 0;
+    uint8_t last_index = 0;
+    for (size_t i = 0; i < pixels; ++i) {
+        uint32_t p;
+        memcpy(&p, src + i * 4, 4);
+        if (i > 0 && p == last) {
+            indices[i] = last_index;
+            continue;
+        }
+        uint32_t h = (p * 0x9e3779b1u) >> 23;
+        while (slots[h] >= 0 && colors[h] != p)
+            h = (h + 1) & (INDEX_TABLE_SIZE - 1);
+        if (slots[h] < 0) {
+            if (count == 256)
+                return 0;
+            colors[h] = p;
+            slots[h] = count;
+            palette[count++] = p;
+        }
+        last = p;
+        last_index = slots[h];
+        indices[i] = last_index;
+    }
+    return count;
+}
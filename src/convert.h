@@ -0,0 +1,178 @@
+#ifndef LWR_CONVERT_H
+#define LWR_CONVERT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Instruction set tiers for the pixel kernels, in order of preference. The
+ * best supported one is picked at runtime from cpuid, LWR_SIMD=<name> forces
+ * a lower one. */
+enum convert_level {
+    CONVERT_SCALAR,
+    CONVERT_SSE2,
+    CONVERT_SSSE3,
+    CONVERT_AVX2,
+    CONVERT_AVX512,
+    CONVERT_LEVEL_COUNT,
+};
+
+/* Reorders `pixels` RGBA pixels (as returned by stb_image) into
+ * little-endian ARGB8888, i.e. BGRA byte order. dst and src may alias. */
+typedef void (*convert_fn)(uint8_t* dst, const uint8_t* src, size_t pixels);
+
+const char* convert_level_name(enum convert_level level);
+bool convert_level_supported(enum convert_level level);
+enum convert_level convert_active_level(void);
+
+/* Kernel for a specific level, NULL if the CPU or build lacks it */
+convert_fn convert_rgba_to_argb_level(enum convert_level level);
+
+void convert_rgba_to_argb(uint8_t* dst, const uint8_t* src, size_t pixels);
+
+/* For targets whose byte order already matches stb_image's RGBA */
+void convert_copy(uint8_t* dst, const uint8_t* src, size_t pixels);
+
+/* True when every pixel of a 4-byte-per-pixel buffer with alpha in the last
+ * byte (RGBA, BGRA) has alpha 255 */
+typedef bool (*opaque_fn)(const uint8_t* data, size_t pixels);
+
+opaque_fn convert_is_opaque_level(enum convert_level level);
+
+bool convert_is_opaque(const uint8_t* data, size_t pixels);
+
+/* Finds the first and last of `pixels` 4-byte pixels that differ between two
+ * rows. Returns false, leaving both alone, when none does. */
+typedef bool (*diff_fn)(
+    const uint8_t* a,
+    const uint8_t* b,
+    int32_t pixels,
+    int32_t* first,
+    int32_t* last
+);
+
+diff_fn convert_diff_row_level(enum convert_level level);
+
+bool convert_diff_row(
+    const uint8_t* a,
+    const uint8_t* b,
+    int32_t pixels,
+    int32_t* first,
+    int32_t* last
+);
+
+/* Hashes `size` bytes into 64 bits, the same at every level. Meant for
+ * telling contents apart, not for resisting anyone crafting collisions. */
+typedef uint64_t (*hash_fn)(const uint8_t* data, size_t size);
+
+hash_fn convert_hash_level(enum convert_level level);
+
+uint64_t convert_hash(const uint8_t* data, size_t size);
+
+/* Box-filters premultiplied 4-byte pixels down by two in each direction: every
+ * destination pixel is the rounded mean of a 2x2 source block. A trailing odd
+ * source row or column is dropped. */
+typedef void (*halve_fn)(
+    uint8_t* dst,
+    int32_t dst_stride,
+    const uint8_t* src,
+    int32_t src_stride,
+    int32_t dst_width,
+    int32_t dst_height
+);
+
+halve_fn convert_halve_level(enum convert_level level);
+
+void convert_halve(
+    uint8_t* dst,
+    int32_t dst_stride,
+    const uint8_t* src,
+    int32_t src_stride,
+    int32_t dst_width,
+    int32_t dst_height
+);
+
+/* Fixed-point separable resampling of premultiplied 4-byte pixels. Weights
+ * are in units of 1 / (1 << CONVERT_FILTER_BITS) and each output's sum to
+ * one. Rows are filtered horizontally into 16-bit channels scaled by
+ * 1 << CONVERT_ROW_BITS, which are then summed vertically into pixels. */
+#define CONVERT_FILTER_BITS 14
+#define CONVERT_ROW_BITS 7
+
+/* Filters `width` output pixels out of a row: pixel x sums counts[x] source
+ * pixels from starts[x] on, weighted by weights[x * taps] on */
+typedef void (*filter_row_fn)(
+    int16_t* dst,
+    const uint8_t* src,
+    int32_t width,
+    const int32_t* starts,
+    const int32_t* counts,
+    const int16_t* weights,
+    int32_t taps
+);
+
+filter_row_fn convert_filter_row_level(enum convert_level level);
+
+void convert_filter_row(
+    int16_t* dst,
+    const uint8_t* src,
+    int32_t width,
+    const int32_t* starts,
+    const int32_t* counts,
+    const int16_t* weights,
+    int32_t taps
+);
+
+/* Sums `count` filtered rows of `width` pixels, weighted by `weights`, into a
+ * row of 4-byte pixels */
+typedef void (*filter_column_fn)(
+    uint8_t* dst,
+    const int16_t* const* rows,
+    const int16_t* weights,
+    int32_t count,
+    int32_t width
+);
+
+filter_column_fn convert_filter_column_level(enum convert_level level);
+
+void convert_filter_column(
+    uint8_t* dst,
+    const int16_t* const* rows,
+    const int16_t* weights,
+    int32_t count,
+    int32_t width
+);
+
+/* Multiplies the color channels of straight-alpha RGBA pixels by their alpha
+ * in place, rounding to nearest. */
+void convert_premultiply_rgba(uint8_t* data, size_t pixels);
+
+/* Writes `pixels` 4-byte pixels, pixel i being palette[indices[i]]. The
+ * palette is in the destination's byte order and has 256 entries. */
+typedef void (*expand_fn)(
+    uint8_t* dst,
+    const uint8_t* indices,
+    const uint32_t* palette,
+    size_t pixels
+);
+
+expand_fn convert_expand_palette_level(enum convert_level level);
+
+void convert_expand_palette(
+    uint8_t* dst,
+    const uint8_t* indices,
+    const uint32_t* palette,
+    size_t pixels
+);
+
+/* Turns 4-byte pixels of at most 256 distinct values into a byte per pixel
+ * indexing `palette`, whose unused entries are zeroed. Returns the number of
+ * colors, or 0 when there are more than 256. */
+int convert_index_pixels(
+    uint8_t* indices,
+    uint32_t* palette,
+    const uint8_t* src,
+    size_t pixels
+);
+
+#endif
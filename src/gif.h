@@ -0,0 +1,47 @@
+#ifndef LWR_GIF_H
+#define LWR_GIF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* GIFs read a frame at a time through stb_image's GIF decoder, which only
+ * ever keeps the canvas the frames are composed on, rather than with
+ * stbi_load_gif_from_memory, which keeps every frame. Implemented in stb.c,
+ * next to the stb_image internals it uses. */
+
+/* What a GIF holds, found by walking its blocks without decoding them */
+struct gif_info {
+    int width;
+    int height;
+    int frame_count;
+    /* ms per frame, malloc'd */
+    int* delays;
+    /* no frame uses a transparent color and nothing of the canvas is left
+     * undrawn by the first, so every pixel of every frame is opaque. False
+     * does not mean some pixel isn't. */
+    bool opaque;
+};
+
+/* Returns false, with stbi_failure_reason set, when the file isn't a GIF or
+ * holds no frame */
+bool gif_scan(const char* path, struct gif_info* info);
+
+struct gif;
+
+struct gif* gif_open(const char* path);
+void gif_close(struct gif* gif);
+
+/* Composes the next frame onto the canvas and returns it, `width` x `height`
+ * straight alpha RGBA valid until the next call. NULL after the last frame,
+ * and on errors, which gif_failed tells apart. */
+const uint8_t* gif_next(struct gif* gif, int* width, int* height);
+bool gif_failed(const struct gif* gif);
+
+/* Starts over from the first frame */
+bool gif_rewind(struct gif* gif);
+
+/* Bytes the decoder keeps for a GIF of the given size, canvas included */
+size_t gif_memory(int width, int height);
+
+#endif
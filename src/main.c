@@ -1,66 +1,298 @@
-#define _POSIX_C_SOURCE 200112L
+/* for ppoll */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <signal.h>
-#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <limits.h>
+#include <math.h>
 #include <stdbool.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "wayland-client-protocol.h"
+#include "viewporter-client-protocol.h"
+#include "fractional-scale-v1-client-protocol.h"
+#include "anim.h"
+#include "bake.h"
+#include "cache.h"
+#include "control.h"
+#include "pool.h"
+#include "shm.h"
+#include "convert.h"
+#include "gif.h"
+#include "region.h"
+#include "resize.h"
+#include "stream.h"
 
-#define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
-
-#define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include "stb_image_resize2.h"
 
-/* Shared memory support code */
-static void randname(char* buf) {
+/* Pixel formats we can produce, cheapest first. stb_image hands out RGBA
+ * bytes, which is ABGR8888 on little-endian, so that one is a plain copy. The
+ * X formats are only used for fully opaque images and spare the compositor
+ * from blending. */
+struct shm_format {
+    enum wl_shm_format format;
+    const char* name;
+    stbir_pixel_layout layout;
+    convert_fn convert;
+    const char* cost;
+    bool opaque_only;
+};
+
+static const struct shm_format shm_formats[] = {
+    {
+        WL_SHM_FORMAT_XBGR8888,
+        "XBGR8888",
+        STBIR_RGBA_PM,
+        convert_copy,
+        "memcpy",
+        true,
+    },
+    {
+        WL_SHM_FORMAT_XRGB8888,
+        "XRGB8888",
+        STBIR_BGRA_PM,
+        convert_rgba_to_argb,
+        "swizzle",
+        true,
+    },
+    {
+        WL_SHM_FORMAT_ABGR8888,
+        "ABGR8888",
+        STBIR_RGBA_PM,
+        convert_copy,
+        "memcpy",
+        false,
+    },
+    {
+        WL_SHM_FORMAT_ARGB8888,
+        "ARGB8888",
+        STBIR_BGRA_PM,
+        convert_rgba_to_argb,
+        "swizzle",
+        false,
+    },
+};
+
+#define SHM_FORMAT_COUNT (sizeof(shm_formats) / sizeof(shm_formats[0]))
+
+static double now_ms(void) {
     struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    long r = ts.tv_nsec;
-    for (int i = 0; i < 6; ++i) {
-        buf[i] = 'A' + (r & 15) + (r & 16) * 2;
-        r >>= 5;
-    }
-}
-
-static int create_shm_file(void) {
-    int retries = 100;
-    do {
-        char name[] = "/wl_shm-XXXXXX";
-        randname(name + sizeof(name) - 7);
-        --retries;
-        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
-        if (fd >= 0) {
-            shm_unlink(name);
-            return fd;
-        }
-    } while (retries > 0 && errno == EEXIST);
-    return -1;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
 }
 
-static int allocate_shm_file(size_t size) {
-    int fd = create_shm_file();
-    if (fd < 0)
-        return -1;
-    int ret;
-    do {
-        ret = ftruncate(fd, size);
-    } while (ret < 0 && errno == EINTR);
-    if (ret < 0) {
-        close(fd);
-        return -1;
+/* Mixes fields into a nonzero 64-bit key */
+static uint64_t hash_fields(const uint64_t* fields, size_t count) {
+    uint64_t key = 0;
+    for (size_t i = 0; i < count; ++i) {
+        /* splitmix64 */
+        key += fields[i] + 0x9e3779b97f4a7c15;
+        key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9;
+        key = (key ^ (key >> 27)) * 0x94d049bb133111eb;
+        key ^= key >> 31;
     }
-    return fd;
+    return key != 0 ? key : 1;
+}
+
+/* Pool key of a drawn variant of an image. Configures that land on a size
+ * drawn before reattach that buffer instead of resampling again. */
+static struct pool_key variant_key(
+    uint64_t image,
+    struct rect crop,
+    int32_t width,
+    int32_t height,
+    uint32_t format,
+    int32_t scale,
+    enum resize_filter filter
+) {
+    return (struct pool_key){ {
+        image,
+        (uint32_t)crop.x,
+        (uint32_t)crop.y,
+        (uint32_t)crop.width,
+        (uint32_t)crop.height,
+        (uint32_t)width,
+        (uint32_t)height,
+        format,
+        (uint32_t)scale,
+        filter,
+    } };
 }
 
+enum scale_mode {
+    /* resample to the exact buffer size with stbir */
+    SCALE_MODE_CPU,
+    /* upload the image, box-halved while it stays larger than the buffer, and
+     * let the compositor scale it through wp_viewport */
+    SCALE_MODE_COMPOSITOR,
+};
+
+/* Decoded images kept around, so showing one again skips decoding it */
+#define IMAGE_CACHE_SIZE 8
+
+struct decode_job;
+
+/* A level of an image's mipmap */
+#define IMAGE_MAX_MIPS 16
+
+struct mip {
+    const uint8_t* data;
+    int32_t width;
+    int32_t height;
+    int32_t stride;
+};
+
+struct image {
+    char* path;
+    /* tells decodes apart in pool keys, kept across reloads */
+    uint64_t id;
+    /* the file's identity in the disk cache, as of the last load */
+    uint64_t source;
+    /* NULL until needed when the size and opacity came from the disk cache, or
+     * from a baked file */
+    uint8_t* data;
+    int width;
+    int height;
+    bool opaque;
+    /* animated images hold their first frame in data, the others are
+     * streamed from the file while playing. Frame i is shown for delays[i]
+     * ms. Still ones have one frame and no delays. */
+    int frame_count;
+    int* delays;
+    /* what changed in data across reloads, in image coordinates */
+    struct damage damage;
+    uint64_t last_used;
+    /* for baked images, the file shared with the compositor, holding a buffer
+     * per size, largest first */
+    struct pool* baked;
+    /* set while a worker thread decodes it, data and opaque are unknown */
+    struct decode_job* decoding;
+    /* with --mipmaps, the image halved over and over, all levels in one
+     * allocation. Built by the first draw at half the size or less. */
+    uint8_t* mipmap;
+    size_t mipmap_size;
+    struct mip mips[IMAGE_MAX_MIPS];
+    int mip_count;
+};
+
+/* The decode of the image shown at startup, run on a worker thread while the
+ * main thread connects to the compositor and sets the overlay up */
+struct decode_job {
+    pthread_t thread;
+    char* path;
+    /* from the image's header, known before the decode */
+    int width;
+    int height;
+    struct image result;
+    bool decoded;
+    double ms;
+};
+
+/* Scales are kept in 120ths, the unit wp_fractional_scale_v1 uses */
+#define SCALE_ONE 120
+
+#define MAX_OUTPUTS 16
+
+/* Overlays alive at once, shown or armed */
+#define MAX_OVERLAYS 4
+
+struct client_state;
+
+struct output {
+    struct client_state* state;
+    struct wl_output* wl_output;
+    uint32_t name;
+    /* e.g. DP-1, NULL until the compositor sends it */
+    char* connector;
+    int32_t scale;
+};
+
+/* The part of an image an overlay shows, from --crop. Each value is in pixels
+ * or, marked percent, in percent of the image's width or height, so it fits
+ * the images swapped in later too. All zero shows the whole image. */
+struct crop {
+    /* x, y, width, height */
+    double values[4];
+    bool percent[4];
+};
+
+/* A layer surface showing an image. Armed overlays get configured and drawn
+ * while still unmapped and hold on to their buffer, so showing one takes a
+ * single commit. */
+struct overlay {
+    struct client_state* state;
+    struct wl_surface* wl_surface;
+    struct zwlr_layer_surface_v1* zwlr_layer_surface_v1;
+    struct wp_viewport* wp_viewport;
+    struct wp_fractional_scale_v1* wp_fractional_scale_v1;
+    /* scale hints for the surface, 0 until the compositor sends one */
+    uint32_t fractional_scale;
+    int32_t preferred_buffer_scale;
+    /* bit i set while the surface is on outputs[i] */
+    uint32_t entered;
+
+    struct image* image;
+    const struct shm_format* shm_format;
+    enum scale_mode scale_mode;
+    enum resize_filter filter;
+    struct crop crop;
+    int target_width;
+    int target_height;
+
+    /* how it was asked for, to find armed overlays by */
+    int requested_width;
+    int requested_height;
+    int margin;
+    uint32_t anchor;
+    struct wl_output* output;
+
+    bool armed;
+    /* mapped, or to be mapped on the next configure */
+    bool visible;
+    /* drawn while hidden, attached by the show */
+    struct pool_buffer* held;
+
+    /* size of the last configure, and what the surface shows */
+    int32_t surface_width;
+    int32_t surface_height;
+    uint32_t attached_scale;
+    struct pool_key attached_key;
+    uint64_t attached_generation;
+
+    /* animated images: the frames drawn at the attached size, the one shown,
+     * and when its time ends on the monotonic clock */
+    struct anim anim;
+    /* decodes the frames after the first until the store holds them all */
+    struct stream* stream;
+    int lookahead;
+    bool keep_frames;
+    int frame;
+    /* the frame attached last, -1 when the surface shows something else */
+    int shown_frame;
+    double frame_due;
+    /* asked for with the last frame's commit */
+    struct wl_callback* frame_callback;
+    /* the compositor is ready for the next frame once it is due */
+    bool frame_ready;
+};
+
+/* Count and spread of timings, such as the time from a show being asked for
+ * to its commit */
+struct latency {
+    unsigned long count;
+    double total;
+    double min;
+    double max;
+};
+
 /* Wayland code */
 struct client_state {
     /* Globals */
@@ -69,76 +301,1642 @@ struct client_state {
     struct wl_shm* wl_shm;
     struct wl_compositor* wl_compositor;
     struct zwlr_layer_shell_v1* zwlr_layer_shell_v1;
-    struct wl_output* wl_output;
+    struct wp_viewporter* wp_viewporter;
+    struct wp_fractional_scale_manager_v1* wp_fractional_scale_manager_v1;
+    struct output outputs[MAX_OUTPUTS];
     /* Objects */
-    struct wl_surface* wl_surface;
-    struct zwlr_layer_surface_v1* zwlr_layer_surface_v1;
+    struct overlay overlays[MAX_OVERLAYS];
+    struct overlay* shown;
+    struct pool pool;
+    /* bit i set when shm_formats[i] was advertised */
+    uint32_t shm_format_mask;
 
     // data
-    uint8_t* image_data;
-    int width;
-    int height;
-    uint8_t* scaled_image_data;
-    int target_width;
-    int target_height;
+    struct image images[IMAGE_CACHE_SIZE];
+    uint64_t image_clock;
+    uint64_t image_ids;
+    struct cache cache;
+    /* started before connecting, until load_image takes it */
+    struct decode_job* prefetch;
 
-    char* output_name;
+    /* for the time to first commit */
+    double start_time;
+    bool committed;
+    struct latency armed_latency;
+    struct latency cold_latency;
+    /* draws at another size than the image's */
+    struct latency resize_latency;
+    bool mipmaps;
+    /* bytes an animation may keep, frame store and decoder included */
+    size_t anim_memory;
+
+    /* daemon mode only, -1 otherwise */
+    int control_fd;
+    char control_path[CONTROL_MAX_PATH];
+    struct control_client control_clients[CONTROL_MAX_CLIENTS];
+    /* the signal mask to wait with, the handled signals are blocked otherwise */
+    sigset_t wait_mask;
 };
 
-static struct client_state* g_state;
+static struct client_state* g_state;
+static volatile sig_atomic_t reload_requested;
+/* the signal asking to exit, 0 until one does */
+static volatile sig_atomic_t exit_signal;
+
+static void latency_add(struct latency* latency, double ms) {
+    if (latency->count == 0 || ms < latency->min)
+        latency->min = ms;
+    if (latency->count == 0 || ms > latency->max)
+        latency->max = ms;
+    latency->total += ms;
+    ++latency->count;
+}
+
+static void latency_format(const struct latency* latency, char* buffer, size_t size) {
+    if (latency->count == 0) {
+        snprintf(buffer, size, "none");
+        return;
+    }
+    snprintf(
+        buffer,
+        size,
+        "%lu, %.3f/%.3f/%.3f ms min/avg/max",
+        latency->count,
+        latency->min,
+        latency->total / latency->count,
+        latency->max
+    );
+}
+
+/* Resize times, and the memory mipmaps take on top of their images */
+static void resize_stats_format(const struct client_state* state, char* buffer, size_t size) {
+    char resizes[96];
+    latency_format(&state->resize_latency, resizes, sizeof(resizes));
+    size_t mips = 0;
+    size_t images = 0;
+    for (int i = 0; i < IMAGE_CACHE_SIZE; ++i) {
+        const struct image* image = &state->images[i];
+        if (image->mipmap == NULL)
+            continue;
+        mips += image->mipmap_size;
+        images += (size_t)image->width * image->height * 4;
+    }
+    snprintf(
+        buffer,
+        size,
+        "resize %s, mipmaps %zu bytes (%.1f%% over their images)",
+        resizes,
+        mips,
+        images != 0 ? 100.0 * mips / images : 0.0
+    );
+}
+
+/* Frames of the animations in frame stores found to look like earlier ones,
+ * and the buffer memory that spares */
+static void anim_stats_format(const struct client_state* state, char* buffer, size_t size) {
+    int frames = 0;
+    int duplicates = 0;
+    size_t saved = 0;
+    for (int i = 0; i < MAX_OVERLAYS; ++i) {
+        const struct anim* anim = &state->overlays[i].anim;
+        if (anim->buffers == NULL)
+            continue;
+        frames += anim->frame_count;
+        duplicates += anim->duplicates;
+        saved += anim_saved(anim);
+    }
+    snprintf(
+        buffer,
+        size,
+        "animation frames %d, %d duplicates (%.1f%% deduplicated), %zu bytes saved",
+        frames,
+        duplicates,
+        frames != 0 ? 100.0 * duplicates / frames : 0.0,
+        saved
+    );
+}
+
+/* GIFs are told apart by their signature, they may be animated */
+static bool is_gif(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    char magic[4];
+    bool gif = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+               memcmp(magic, "GIF8", sizeof(magic)) == 0;
+    fclose(file);
+    return gif;
+}
+
+/* Decodes the first frame of a GIF, scanning the file for how many follow and
+ * how long each is shown. The others are decoded while it plays. */
+static uint8_t* load_gif(const char* path, struct gif_info* info) {
+    if (!gif_scan(path, info))
+        return NULL;
+    struct gif* gif = gif_open(path);
+    int width, height;
+    const uint8_t* canvas = gif != NULL ? gif_next(gif, &width, &height) : NULL;
+    uint8_t* data = NULL;
+    if (canvas != NULL && width == info->width && height == info->height) {
+        data = malloc((size_t)width * height * 4);
+        if (data != NULL)
+            memcpy(data, canvas, (size_t)width * height * 4);
+    }
+    gif_close(gif);
+    if (data == NULL)
+        free(info->delays);
+    return data;
+}
+
+/* Decodes an image, premultiplied, or the first frame of an animated one */
+static bool decode_image(struct image* image, const char* path) {
+    int width, height;
+    struct gif_info gif = { 0 };
+    bool is_animation = false;
+    uint8_t* data;
+    if (is_gif(path)) {
+        data = load_gif(path, &gif);
+        width = gif.width;
+        height = gif.height;
+        is_animation = gif.frame_count > 1;
+    } else {
+        data = stbi_load(path, &width, &height, NULL, 4);
+    }
+    if (data == NULL) {
+        const char* reason = stbi_failure_reason();
+        printf(
+            "[lwr] error: unable to load image %s: %s\n",
+            path,
+            reason != NULL ? reason : strerror(errno)
+        );
+        return false;
+    }
+
+    printf("[lwr] loading image %s (%dx%d)\n", path, width, height);
+    int frame_count = 1;
+    int* delays = NULL;
+    if (is_animation) {
+        frame_count = gif.frame_count;
+        delays = gif.delays;
+        anim_fix_delays(delays, frame_count);
+        printf("[lwr] image is animated, %d frames\n", frame_count);
+    } else {
+        free(gif.delays);
+    }
+
+    // wl_shm buffers are premultiplied, do it once here rather than on every draw
+    size_t pixels = (size_t)width * height;
+    /* the later frames aren't decoded yet, only the scan speaks for them */
+    bool opaque = is_animation ? gif.opaque : convert_is_opaque(data, pixels);
+    if (!opaque) {
+        convert_premultiply_rgba(data, pixels);
+    }
+    printf("[lwr] image is %s\n", opaque ? "opaque" : "translucent");
+
+    image->data = data;
+    image->width = width;
+    image->height = height;
+    image->opaque = opaque;
+    image->frame_count = frame_count;
+    image->delays = delays;
+    return true;
+}
+
+static bool image_animated(const struct image* image) {
+    return image->frame_count > 1;
+}
+
+/* Frees the decoded frames of an image */
+static void free_frames(struct image* image) {
+    stbi_image_free(image->data);
+    free(image->delays);
+    image->data = NULL;
+    image->delays = NULL;
+}
+
+static bool image_in_use(struct client_state* state, const struct image* image) {
+    for (int i = 0; i < MAX_OVERLAYS; ++i) {
+        if (state->overlays[i].wl_surface != NULL && state->overlays[i].image == image)
+            return true;
+    }
+    return false;
+}
+
+static const struct shm_format*
+choose_shm_format(struct client_state* state, const struct image* image);
+
+static void* decode_worker(void* data) {
+    struct decode_job* job = data;
+    double start = now_ms();
+    job->decoded = decode_image(&job->result, job->path);
+    job->ms = now_ms() - start;
+    return NULL;
+}
+
+/* Starts decoding the image shown at startup on a worker thread. Baked images
+ * and ones the disk cache knows start showing without a decode, and images
+ * whose header can't be read are left for load_image to report. */
+static void prefetch_image(struct client_state* state, const char* path) {
+    int width, height;
+    bool opaque;
+    if (bake_probe(path))
+        return;
+    /* the disk cache doesn't know how many frames a GIF has */
+    if (!is_gif(path) &&
+        cache_get_info(&state->cache, cache_source(path), &width, &height, &opaque))
+        return;
+    if (!stbi_info(path, &width, &height, NULL))
+        return;
+
+    struct decode_job* job = calloc(1, sizeof(*job));
+    if (job == NULL)
+        return;
+    job->path = strdup(path);
+    job->width = width;
+    job->height = height;
+    if (job->path == NULL || pthread_create(&job->thread, NULL, decode_worker, job) != 0) {
+        free(job->path);
+        free(job);
+        return;
+    }
+    state->prefetch = job;
+}
+
+/* Hands the decode started for `path` over to the image being loaded */
+static struct decode_job* take_prefetch(struct client_state* state, const char* path) {
+    struct decode_job* job = state->prefetch;
+    if (job == NULL || strcmp(job->path, path) != 0)
+        return NULL;
+    state->prefetch = NULL;
+    return job;
+}
+
+/* Waits for the worker decoding an image. Knowing whether it is opaque may
+ * allow its overlays a cheaper format. */
+static bool finish_decode(struct client_state* state, struct image* image) {
+    struct decode_job* job = image->decoding;
+    image->decoding = NULL;
+    double start = now_ms();
+    pthread_join(job->thread, NULL);
+    double waited = now_ms() - start;
+
+    bool decoded = job->decoded && job->result.width == image->width &&
+                   job->result.height == image->height;
+    if (decoded) {
+        printf(
+            "[lwr] decoded on a worker thread in %.3f ms, waited %.3f ms for it\n",
+            job->ms,
+            waited
+        );
+        image->data = job->result.data;
+        image->opaque = job->result.opaque;
+        image->frame_count = job->result.frame_count;
+        image->delays = job->result.delays;
+        cache_put_info(
+            &state->cache,
+            image->source,
+            image->width,
+            image->height,
+            image->opaque
+        );
+        for (int i = 0; i < MAX_OVERLAYS; ++i) {
+            struct overlay* overlay = &state->overlays[i];
+            if (overlay->wl_surface == NULL || overlay->image != image)
+                continue;
+            const struct shm_format* format = choose_shm_format(state, image);
+            if (format != overlay->shm_format)
+                printf("[lwr] shm format: %s (%s)\n", format->name, format->cost);
+            overlay->shm_format = format;
+        }
+    } else {
+        if (job->decoded)
+            printf("[lwr] error: %s changed while loading it\n", image->path);
+        free_frames(&job->result);
+    }
+    free(job->path);
+    free(job);
+    return decoded;
+}
+
+/* Decodes an image that was loaded from the disk cache's info alone, now
+ * that its pixels are needed. Baked images are read back from their largest
+ * size. */
+static bool image_decoded(struct image* image) {
+    if (image->data != NULL)
+        return true;
+    if (image->baked != NULL) {
+        struct pool_buffer* level = &image->baked->buffers[0];
+        uint8_t* data = malloc((size_t)level->width * level->height * 4);
+        if (data == NULL)
+            return false;
+        /* swapping red and blue takes ARGB8888 back to RGBA as well */
+        for (int32_t y = 0; y < level->height; ++y) {
+            convert_rgba_to_argb(
+                data + (size_t)y * level->width * 4,
+                pool_buffer_data(level) + (size_t)y * level->stride,
+                level->width
+            );
+        }
+        image->data = data;
+        return true;
+    }
+    struct image decoded = { 0 };
+    if (!decode_image(&decoded, image->path))
+        return false;
+    if (decoded.width != image->width || decoded.height != image->height ||
+        decoded.opaque != image->opaque || image_animated(&decoded)) {
+        printf("[lwr] error: %s changed while loading it\n", image->path);
+        free_frames(&decoded);
+        return false;
+    }
+    image->data = decoded.data;
+    return true;
+}
+
+static void drop_mips(struct image* image) {
+    free(image->mipmap);
+    image->mipmap = NULL;
+    image->mipmap_size = 0;
+    image->mip_count = 0;
+}
+
+/* Builds the image's mipmap, every level a 2x2 box reduction of the one
+ * above it, down to a pixel wide or tall */
+static bool build_mips(struct image* image) {
+    double start = now_ms();
+    int count = 0;
+    size_t size = 0;
+    for (int32_t w = image->width / 2, h = image->height / 2;
+         count < IMAGE_MAX_MIPS && w > 0 && h > 0;
+         w /= 2, h /= 2) {
+        size += (size_t)w * h * 4;
+        ++count;
+    }
+    if (count == 0)
+        return true;
+    uint8_t* data = malloc(size);
+    if (data == NULL) {
+        printf("[lwr] error: unable to allocate %zu bytes of mipmap\n", size);
+        return false;
+    }
+
+    struct mip above = { image->data, image->width, image->height, image->width * 4 };
+    size_t offset = 0;
+    for (int i = 0; i < count; ++i) {
+        struct mip* mip = &image->mips[i];
+        int32_t width = above.width / 2;
+        int32_t height = above.height / 2;
+        *mip = (struct mip){ data + offset, width, height, width * 4 };
+        convert_halve(data + offset, mip->stride, above.data, above.stride, width, height);
+        offset += (size_t)mip->width * mip->height * 4;
+        above = *mip;
+    }
+    image->mipmap = data;
+    image->mipmap_size = size;
+    image->mip_count = count;
+    printf(
+        "[lwr] built %d mip levels (%zu bytes, %.1f%% of the image) in %.3f ms\n",
+        count,
+        size,
+        100.0 * size / ((size_t)image->width * image->height * 4),
+        now_ms() - start
+    );
+    return true;
+}
+
+/* The crop of the image, or of its smallest mip level that still covers a
+ * buffer of the given size with it, to resample from. Halving rounds down, so
+ * mip level i holds the crop shifted right by i + 1. */
+static struct mip
+image_source(const struct image* image, struct rect crop, int32_t width, int32_t height) {
+    struct mip level = { image->data, image->width, image->height, image->width * 4 };
+    int shift = 0;
+    for (int i = 0; i < image->mip_count; ++i) {
+        if ((crop.width >> (i + 1)) < width || (crop.height >> (i + 1)) < height)
+            break;
+        level = image->mips[i];
+        shift = i + 1;
+    }
+    size_t offset = (size_t)(crop.y >> shift) * level.stride + (size_t)(crop.x >> shift) * 4;
+    return (struct mip){
+        level.data + offset,
+        crop.width >> shift,
+        crop.height >> shift,
+        level.stride,
+    };
+}
+
+/* Shares a baked file with the compositor as a pool with a buffer per size,
+ * taking the file over */
+static struct pool*
+share_baked(struct client_state* state, const struct image* image, struct bake_file* bake) {
+    struct pool* pool = malloc(sizeof(*pool));
+    if (pool == NULL) {
+        bake_close(bake);
+        return NULL;
+    }
+    const struct bake_header* header = bake->header;
+    pool_init_file(pool, state->wl_shm, bake->fd, bake->data, bake->size);
+
+    uint32_t format = header->opaque ? WL_SHM_FORMAT_XRGB8888 : WL_SHM_FORMAT_ARGB8888;
+    for (int i = 0; i < header->level_count; ++i) {
+        const struct bake_level* level = &header->levels[i];
+        struct pool_buffer* buffer = pool_add_buffer(
+            pool,
+            level->offset,
+            level->width,
+            level->height,
+            level->stride,
+            format
+        );
+        if (buffer == NULL)
+            break;
+        /* keyed apart from buffers drawn at the same size */
+        buffer->key = variant_key(
+            image->id,
+            (struct rect){ 0, 0, image->width, image->height },
+            level->width,
+            level->height,
+            format,
+            -1,
+            RESIZE_STBIR
+        );
+        buffer->opaque.count = level->opaque_count;
+        memcpy(buffer->opaque.rects, level->opaque, sizeof(level->opaque));
+    }
+    return pool;
+}
+
+/* Stops sharing an image's baked file. Overlays holding one of its buffers
+ * forget it, their next refresh attaches another. */
+static void drop_baked(struct client_state* state, struct image* image) {
+    if (image->baked == NULL)
+        return;
+    for (int i = 0; i < MAX_OVERLAYS; ++i) {
+        struct overlay* overlay = &state->overlays[i];
+        if (overlay->held != NULL && overlay->held->pool == image->baked)
+            overlay->held = NULL;
+    }
+    pool_finish(image->baked);
+    free(image->baked);
+    image->baked = NULL;
+}
+
+/* Returns the image at `path`, decoding it unless it is cached and `fresh` is
+ * false. The least recently used image no overlay shows makes room for it in
+ * the cache. A fresh decode of a cached image records what changed. New images
+ * the disk cache knows are not decoded until a draw misses the disk cache, and
+ * baked ones only when none of their sizes fits. The image decoding since
+ * startup is taken over as is. */
+static struct image* load_image(struct client_state* state, const char* path, bool fresh) {
+    struct image* image = NULL;
+    struct image* victim = NULL;
+    for (int i = 0; i < IMAGE_CACHE_SIZE; ++i) {
+        struct image* entry = &state->images[i];
+        if (entry->path != NULL && strcmp(entry->path, path) == 0) {
+            image = entry;
+        } else if (!image_in_use(state, entry)) {
+            if (victim == NULL || entry->last_used < victim->last_used)
+                victim = entry;
+        }
+    }
+    if (image == NULL && victim == NULL) {
+        printf("[lwr] error: no room to cache %s\n", path);
+        return NULL;
+    }
+
+    if (image == NULL || fresh) {
+        uint64_t source = cache_source(path);
+        struct image decoded = { 0 };
+        bool added = image == NULL;
+        int* width = &decoded.width;
+        int* height = &decoded.height;
+        struct bake_file bake;
+        struct decode_job* job = NULL;
+        bool baked = bake_open(&bake, path);
+        if (baked) {
+            *width = bake.header->levels[0].width;
+            *height = bake.header->levels[0].height;
+            decoded.opaque = bake.header->opaque;
+            printf(
+                "[lwr] image %s is baked (%dx%d, %d sizes)\n",
+                path,
+                *width,
+                *height,
+                bake.header->level_count
+            );
+            if (bake.fd < 0) {
+                printf(
+                    "[lwr] baked image %s isn't writable, copying its sizes into the pool "
+                    "instead of sharing the file\n",
+                    path
+                );
+            }
+        } else if (added && !is_gif(path) &&
+                   cache_get_info(&state->cache, source, width, height, &decoded.opaque)) {
+            printf("[lwr] image %s is cached (%dx%d)\n", path, *width, *height);
+        } else if (added && (job = take_prefetch(state, path)) != NULL) {
+            *width = job->width;
+            *height = job->height;
+        } else {
+            if (!decode_image(&decoded, path))
+                return NULL;
+            cache_put_info(&state->cache, source, *width, *height, decoded.opaque);
+        }
+
+        if (added) {
+            image = victim;
+            if (image->decoding != NULL)
+                finish_decode(state, image);
+            free(image->path);
+            free_frames(image);
+            drop_mips(image);
+            drop_baked(state, image);
+            image->path = strdup(path);
+            image->id = ++state->image_ids;
+            damage_init(&image->damage);
+        }
+
+        /* only the parts that differ need redrawing if the size stayed the same */
+        if (!added) {
+            if (image->decoding != NULL)
+                finish_decode(state, image);
+            struct region changed;
+            bool same_size = decoded.width == image->width && decoded.height == image->height;
+            if (image->data != NULL && decoded.data != NULL && same_size) {
+                region_diff(
+                    &changed,
+                    image->data,
+                    decoded.data,
+                    decoded.width,
+                    decoded.height,
+                    decoded.width * 4
+                );
+            } else {
+                region_clear(&changed);
+                region_add(&changed, (struct rect){ 0, 0, decoded.width, decoded.height });
+            }
+            damage_push(&image->damage, &changed);
+            free_frames(image);
+            drop_mips(image);
+            drop_baked(state, image);
+        }
+
+        if (baked)
+            image->baked = share_baked(state, image, &bake);
+        image->decoding = job;
+        image->source = source;
+        image->data = decoded.data;
+        image->width = decoded.width;
+        image->height = decoded.height;
+        image->opaque = decoded.opaque;
+        image->frame_count = decoded.frame_count;
+        image->delays = decoded.delays;
+    }
+    image->last_used = ++state->image_clock;
+    return image;
+}
+
+/* Finds the parts of a freshly drawn buffer that need no blending. Those of
+ * the first frame say nothing about the others of a translucent animation. */
+static void find_opaque_region(const struct image* image, struct pool_buffer* buffer) {
+    struct region* opaque = &buffer->opaque;
+    if (image->opaque) {
+        opaque->rects[0] = (struct rect){ 0, 0, buffer->width, buffer->height };
+        opaque->count = 1;
+    } else if (image_animated(image)) {
+        opaque->count = 0;
+    } else {
+        opaque->count = region_find_opaque(
+            pool_buffer_data(buffer),
+            buffer->width,
+            buffer->height,
+            buffer->stride,
+            REGION_TILE * REGION_TILE * 4,
+            opaque->rects,
+            REGION_MAX_RECTS
+        );
+    }
+
+    int64_t area = 0;
+    for (int i = 0; i < opaque->count; ++i)
+        area += (int64_t)opaque->rects[i].width * opaque->rects[i].height;
+    printf(
+        "[lwr] opaque region: %d rects, %.1f%% of the surface\n",
+        opaque->count,
+        100.0 * area / ((int64_t)buffer->width * buffer->height)
+    );
+}
+
+/* Tells the compositor which parts of the surface need no blending. The
+ * region is in surface coordinates, so rects are shrunk inwards when the
+ * buffer is scaled. */
+static void apply_opaque_region(struct overlay* overlay, struct pool_buffer* buffer) {
+    int32_t sw = overlay->surface_width;
+    int32_t sh = overlay->surface_height;
+    struct wl_region* region = wl_compositor_create_region(overlay->state->wl_compositor);
+    for (int i = 0; i < buffer->opaque.count; ++i) {
+        struct rect* r = &buffer->opaque.rects[i];
+        int32_t x0 = ((int64_t)r->x * sw + buffer->width - 1) / buffer->width;
+        int32_t y0 = ((int64_t)r->y * sh + buffer->height - 1) / buffer->height;
+        int32_t x1 = (int64_t)(r->x + r->width) * sw / buffer->width;
+        int32_t y1 = (int64_t)(r->y + r->height) * sh / buffer->height;
+        if (x1 > x0 && y1 > y0)
+            wl_region_add(region, x0, y0, x1 - x0, y1 - y0);
+    }
+    wl_surface_set_opaque_region(overlay->wl_surface, region);
+    wl_region_destroy(region);
+}
+
+/* The crop in pixels of an image of the given size, clipped to it. The whole
+ * image when there is no crop or nothing of it is left. */
+static struct rect crop_rect(const struct crop* crop, int32_t width, int32_t height) {
+    int32_t sizes[] = { width, height, width, height };
+    int32_t values[4];
+    for (int i = 0; i < 4; ++i) {
+        double value = crop->percent[i] ? crop->values[i] * sizes[i] / 100 : crop->values[i];
+        values[i] = value < INT32_MAX ? (int32_t)(value + 0.5) : INT32_MAX;
+    }
+    struct rect whole = { 0, 0, width, height };
+    struct rect r = { values[0], values[1], values[2], values[3] };
+    r = rect_intersect(r, whole);
+    return rect_empty(r) ? whole : r;
+}
+
+static bool crop_equal(const struct crop* a, const struct crop* b) {
+    for (int i = 0; i < 4; ++i) {
+        if (a->values[i] != b->values[i] || a->percent[i] != b->percent[i])
+            return false;
+    }
+    return true;
+}
+
+/* The part of its image the overlay shows */
+static struct rect overlay_crop(const struct overlay* overlay) {
+    return crop_rect(&overlay->crop, overlay->image->width, overlay->image->height);
+}
+
+static bool crop_whole(const struct image* image, struct rect crop) {
+    return crop.width == image->width && crop.height == image->height;
+}
+
+/* The overlay's pixels in the disk cache: those of the file, or of the crop
+ * of it, which draws apart from the whole image */
+static uint64_t overlay_source(const struct overlay* overlay, struct rect crop) {
+    const struct image* image = overlay->image;
+    if (crop_whole(image, crop))
+        return image->source;
+    uint64_t fields[] = {
+        image->source,
+        (uint32_t)crop.x,
+        (uint32_t)crop.y,
+        (uint32_t)crop.width,
+        (uint32_t)crop.height,
+    };
+    return hash_fields(fields, sizeof(fields) / sizeof(fields[0]));
+}
+
+/* How far, in buffer pixels, a changed source pixel can reach through the
+ * resampling filter. stbir's default filters span two pixels on the wider
+ * side of the scale, one more covers rounding. */
+static int32_t resample_margin(int32_t src, int32_t dst) {
+    if (src == dst)
+        return 0;
+    return 3 + (dst > src ? (2 * dst + src - 1) / src : 0);
+}
+
+/* Maps changes in image coordinates onto a buffer of the given size showing
+ * the image's `crop`. Changes outside the crop don't count, resampling never
+ * reads past its edges. */
+static void changes_to_buffer(
+    const struct region* changed,
+    struct rect crop,
+    int32_t width,
+    int32_t height,
+    struct region* out
+) {
+    struct region cropped;
+    region_clear(&cropped);
+    for (int i = 0; i < changed->count; ++i) {
+        struct rect r = rect_intersect(changed->rects[i], crop);
+        if (rect_empty(r))
+            continue;
+        r.x -= crop.x;
+        r.y -= crop.y;
+        region_add(&cropped, r);
+    }
+    int32_t margin_x = resample_margin(crop.width, width);
+    int32_t margin_y = resample_margin(crop.height, height);
+    int32_t margin = margin_x > margin_y ? margin_x : margin_y;
+    region_scale(out, &cropped, crop.width, crop.height, width, height, margin);
+}
+
+/* What changed in the `crop` of the image since `generation`, mapped onto a
+ * buffer of the given size. Everything when that is unknown. */
+static void buffer_damage_since(
+    const struct image* image,
+    struct rect crop,
+    uint64_t generation,
+    int32_t width,
+    int32_t height,
+    struct region* out
+) {
+    struct region changed;
+    if (!damage_since(&image->damage, generation, &changed)) {
+        region_clear(out);
+        region_add(out, (struct rect){ 0, 0, width, height });
+        return;
+    }
+    changes_to_buffer(&changed, crop, width, height, out);
+}
+
+/* Renders one rectangle of the image's `crop` into a buffer of the given size,
+ * from the smallest mip level covering it when there are levels. Only the
+ * crop's pixels are read. */
+static bool draw_rect(
+    const struct image* image,
+    struct rect crop,
+    struct pool_buffer* buffer,
+    const struct shm_format* format,
+    enum resize_filter filter,
+    struct rect r
+) {
+    uint8_t* data = pool_buffer_data(buffer);
+    struct mip source = image_source(image, crop, buffer->width, buffer->height);
+    if (buffer->width == source.width && buffer->height == source.height) {
+        for (int32_t y = r.y; y < r.y + r.height; ++y) {
+            format->convert(
+                data + (size_t)y * buffer->stride + (size_t)r.x * 4,
+                source.data + (size_t)y * source.stride + (size_t)r.x * 4,
+                r.width
+            );
+        }
+        return true;
+    }
+
+    if (filter != RESIZE_STBIR) {
+        bool resized = resize_fixed(
+            filter,
+            data,
+            buffer->width,
+            buffer->height,
+            buffer->stride,
+            source.data,
+            source.width,
+            source.height,
+            source.stride,
+            r
+        );
+        /* the fixed-point filters keep the channel order, reorder in place */
+        for (int32_t y = r.y; resized && y < r.y + r.height; ++y) {
+            uint8_t* row = data + (size_t)y * buffer->stride + (size_t)r.x * 4;
+            format->convert(row, row, r.width);
+        }
+        return resized;
+    }
+
+    /* resize straight into the buffer, reordering channels on the way */
+    STBIR_RESIZE resize;
+    stbir_resize_init(
+        &resize,
+        source.data,
+        source.width,
+        source.height,
+        source.stride,
+        data,
+        buffer->width,
+        buffer->height,
+        buffer->stride,
+        STBIR_RGBA_PM,
+        STBIR_TYPE_UINT8_SRGB
+    );
+    stbir_set_pixel_layouts(&resize, STBIR_RGBA_PM, format->layout);
+    stbir_set_pixel_subrect(&resize, r.x, r.y, r.width, r.height);
+    return resize_run(&resize);
+}
+
+/* Halves the image's `crop` until it has the buffer's size, then converts
+ * that level into the buffer. The levels take turns in two scratch buffers,
+ * each allocated at the size of the first level it holds, the largest. The
+ * last halving writes straight into the buffer when the format needs no
+ * conversion. A mipmap already holds that level. */
+static bool draw_reduced(
+    const struct image* image,
+    struct rect crop,
+    struct pool_buffer* buffer,
+    const struct shm_format* format
+) {
+    struct mip source = image_source(image, crop, buffer->width, buffer->height);
+    const uint8_t* src = source.data;
+    uint8_t* scratch[2] = { NULL, NULL };
+    int32_t width = source.width;
+    int32_t height = source.height;
+    int32_t stride = source.stride;
+    bool direct = format->convert == convert_copy;
+
+    for (int i = 0; width != buffer->width || height != buffer->height; ++i) {
+        int32_t half_width = width / 2;
+        int32_t half_height = height / 2;
+        bool last = half_width == buffer->width && half_height == buffer->height;
+
+        if (last && direct) {
+            convert_halve(
+                pool_buffer_data(buffer),
+                buffer->stride,
+                src,
+                stride,
+                half_width,
+                half_height
+            );
+            free(scratch[0]);
+            free(scratch[1]);
+            return true;
+        }
+
+        uint8_t** half = &scratch[i % 2];
+        if (*half == NULL)
+            *half = malloc((size_t)half_width * half_height * 4);
+        if (*half == NULL) {
+            free(scratch[0]);
+            free(scratch[1]);
+            return false;
+        }
+        convert_halve(*half, half_width * 4, src, stride, half_width, half_height);
+        src = *half;
+        width = half_width;
+        height = half_height;
+        stride = width * 4;
+    }
+
+    for (int32_t y = 0; y < height; ++y) {
+        format->convert(
+            pool_buffer_data(buffer) + (size_t)y * buffer->stride,
+            src + (size_t)y * stride,
+            width
+        );
+    }
+    free(scratch[0]);
+    free(scratch[1]);
+    return true;
+}
+
+/* Tells apart the ways of drawing a buffer of one size in the disk cache */
+static uint32_t cache_variant(const struct overlay* overlay, bool reduced) {
+    if (reduced)
+        return 1;
+    /* stbir draws keep the variant they had before there were filters */
+    uint32_t variant = overlay->filter == RESIZE_STBIR ? 0 : 2 + overlay->filter;
+    /* resampling from a mip level comes out slightly different */
+    return overlay->state->mipmaps ? variant | 0x100 : variant;
+}
+
+/* Fills a buffer with what an earlier draw of the same file at the same size
+ * left in the disk cache, opaque region included */
+static bool draw_cached(struct overlay* overlay, struct pool_buffer* buffer, bool reduced) {
+    double start = now_ms();
+    struct cache_pixels pixels;
+    bool found = cache_get(
+        &overlay->state->cache,
+        overlay_source(overlay, overlay_crop(overlay)),
+        buffer->width,
+        buffer->height,
+        buffer->format,
+        cache_variant(overlay, reduced),
+        &pixels
+    );
+    if (!found)
+        return false;
+
+    uint8_t* data = pool_buffer_data(buffer);
+    for (int32_t y = 0; y < buffer->height; ++y) {
+        memcpy(
+            data + (size_t)y * buffer->stride,
+            pixels.data + (size_t)y * pixels.stride,
+            (size_t)buffer->width * 4
+        );
+    }
+    buffer->opaque = pixels.opaque;
+    cache_pixels_release(&pixels);
+    printf(
+        "[lwr] copied %dx%d %s from the cache in %.3f ms\n",
+        buffer->width,
+        buffer->height,
+        overlay->shm_format->name,
+        now_ms() - start
+    );
+    return true;
+}
+
+/* Brings a buffer up to the current generation of the image, redrawing only
+ * what changed since the contents it already holds. Buffers holding nothing
+ * yet are filled from the disk cache when it has them, and stored in it once
+ * drawn when it doesn't. */
+static struct pool_buffer*
+draw_frame(struct overlay* overlay, const struct pool_key* key, int32_t width, int32_t height) {
+    struct image* image = overlay->image;
+    struct rect crop = overlay_crop(overlay);
+    const struct shm_format* format = overlay->shm_format;
+    struct pool_buffer* buffer =
+        pool_acquire(&overlay->state->pool, key, width, height, format->format);
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    bool resized = width != crop.width || height != crop.height;
+    /* reduced levels are cheap enough to always redraw whole */
+    bool reduced = overlay->scale_mode == SCALE_MODE_COMPOSITOR && resized;
+    bool empty = buffer->generation == 0;
+    if (empty && draw_cached(overlay, buffer, reduced)) {
+        buffer->generation = image->damage.generation;
+        return buffer;
+    }
+    if (!image_decoded(image)) {
+        pool_release(buffer);
+        return NULL;
+    }
+    struct region dirty;
+    if (reduced) {
+        region_clear(&dirty);
+        region_add(&dirty, (struct rect){ 0, 0, width, height });
+    } else {
+        buffer_damage_since(image, crop, buffer->generation, width, height, &dirty);
+    }
+    /* without a mipmap, drawing at half the size or less resamples from it */
+    bool covered = width <= crop.width / 2 && height <= crop.height / 2;
+    if (overlay->state->mipmaps && covered && image->mip_count == 0)
+        build_mips(image);
+
+    /* Draw image */
+    double start = now_ms();
+    int64_t area = 0;
+    for (int i = 0; i < dirty.count; ++i) {
+        struct rect r = dirty.rects[i];
+        bool drawn = reduced ? draw_reduced(image, crop, buffer, format)
+                             : draw_rect(image, crop, buffer, format, overlay->filter, r);
+        if (!drawn) {
+            printf("[lwr] error: unable to resize image\n");
+            pool_release(buffer);
+            return NULL;
+        }
+        area += (int64_t)r.width * r.height;
+    }
+    double elapsed = now_ms() - start;
+    if (resized)
+        latency_add(&overlay->state->resize_latency, elapsed);
+    printf(
+        "[lwr] drew %d rects (%.1f%% of %dx%d %s, %s%s) in %.3f ms\n",
+        dirty.count,
+        100.0 * area / ((int64_t)width * height),
+        width,
+        height,
+        format->name,
+        reduced   ? "box reduce"
+        : resized ? resize_filter_name(overlay->filter)
+                  : format->cost,
+        buffer->generation != 0 ? ", partial" : "",
+        elapsed
+    );
+
+    buffer->generation = image->damage.generation;
+    find_opaque_region(image, buffer);
+    if (empty) {
+        cache_put(
+            &overlay->state->cache,
+            overlay_source(overlay, crop),
+            width,
+            height,
+            format->format,
+            cache_variant(overlay, reduced),
+            pool_buffer_data(buffer),
+            buffer->stride,
+            &buffer->opaque
+        );
+    }
+    return buffer;
+}
+
+/* The scale to render at. A fractional scale needs wp_viewporter to map the
+ * buffer back onto the surface, otherwise the integer hints are used, and
+ * without those the highest scale of the outputs the surface is on. */
+static uint32_t surface_scale(struct overlay* overlay) {
+    if (overlay->fractional_scale != 0 && overlay->wp_viewport != NULL)
+        return overlay->fractional_scale;
+    if (overlay->preferred_buffer_scale > 0)
+        return overlay->preferred_buffer_scale * SCALE_ONE;
+
+    int32_t scale = 1;
+    for (int i = 0; i < MAX_OUTPUTS; ++i) {
+        struct output* output = &overlay->state->outputs[i];
+        bool entered = overlay->entered & (1u << i);
+        if (output->wl_output != NULL && entered && output->scale > scale)
+            scale = output->scale;
+    }
+    return scale * SCALE_ONE;
+}
+
+/* Logs the time to the first commit since the show was asked for */
+static void show_committed(struct client_state* state, bool armed) {
+    if (state->committed)
+        return;
+    double elapsed = now_ms() - state->start_time;
+    printf("[lwr] first commit after %.3f ms%s\n", elapsed, armed ? ", armed" : "");
+    latency_add(armed ? &state->armed_latency : &state->cold_latency, elapsed);
+    state->committed = true;
+}
+
+/* The size of a baked image to attach for a buffer of the given size: one of
+ * exactly that size, or in compositor mode the smallest one covering it, and
+ * the largest when none does. NULL when it has to be drawn instead. */
+static struct pool_buffer* baked_level(struct overlay* overlay, int32_t width, int32_t height) {
+    struct pool* baked = overlay->image->baked;
+    struct pool_buffer* best = NULL;
+    for (int i = 0; i < baked->buffer_count; ++i) {
+        struct pool_buffer* level = &baked->buffers[i];
+        if (level->width == width && level->height == height)
+            return level;
+        /* largest first, so the last covering one is the smallest */
+        bool covers = level->width >= width && level->height >= height;
+        if (overlay->scale_mode == SCALE_MODE_COMPOSITOR && (covers || best == NULL))
+            best = level;
+    }
+    return best;
+}
+
+/* Copies a size of a baked file that can't be shared into the pool, unless a
+ * buffer there already holds it */
+static struct pool_buffer* copy_baked(struct overlay* overlay, struct pool_buffer* level) {
+    struct pool* pool = &overlay->state->pool;
+    uint64_t generation = overlay->image->damage.generation;
+    struct pool_buffer* buffer = pool_lookup(pool, &level->key, generation);
+    if (buffer != NULL)
+        return buffer;
+    buffer = pool_acquire(pool, &level->key, level->width, level->height, level->format);
+    if (buffer == NULL)
+        return NULL;
+    const uint8_t* src = pool_buffer_data(level);
+    uint8_t* dst = pool_buffer_data(buffer);
+    for (int32_t y = 0; y < level->height; ++y) {
+        memcpy(
+            dst + (size_t)y * buffer->stride,
+            src + (size_t)y * level->stride,
+            (size_t)level->width * 4
+        );
+    }
+    buffer->generation = generation;
+    buffer->opaque = level->opaque;
+    return buffer;
+}
+
+/* Gets the image drawn for the overlay's current size and scale, and sets the
+ * surface state that goes with the buffer, short of attaching it */
+static struct pool_buffer* prepare(struct overlay* overlay) {
+    struct image* image = overlay->image;
+    /* the startup decode has had until the first configure to finish */
+    if (image->decoding != NULL && !finish_decode(overlay->state, image))
+        return NULL;
+    uint32_t scale = surface_scale(overlay);
+    /* rounding half away from zero, as wp_fractional_scale_v1 asks */
+    int32_t width = ((int64_t)overlay->surface_width * scale + SCALE_ONE / 2) / SCALE_ONE;
+    int32_t height = ((int64_t)overlay->surface_height * scale + SCALE_ONE / 2) / SCALE_ONE;
+    bool viewport = scale % SCALE_ONE != 0;
+
+    /* baked sizes are of the whole image */
+    struct rect crop = overlay_crop(overlay);
+    struct pool_buffer* buffer = NULL;
+    if (image->baked != NULL && crop_whole(image, crop))
+        buffer = baked_level(overlay, width, height);
+    if (buffer != NULL) {
+        printf("[lwr] attaching baked %dx%d buffer\n", buffer->width, buffer->height);
+        viewport = viewport || buffer->width != width || buffer->height != height;
+        buffer->generation = image->damage.generation;
+        if (buffer->wl_buffer == NULL && (buffer = copy_baked(overlay, buffer)) == NULL)
+            return NULL;
+    } else {
+        uint32_t key_scale = scale;
+        enum resize_filter key_filter = overlay->filter;
+        if (overlay->scale_mode == SCALE_MODE_COMPOSITOR) {
+            /* halve the crop while that still covers the buffer size */
+            int32_t reduced_width = crop.width;
+            int32_t reduced_height = crop.height;
+            while (reduced_width / 2 >= width && reduced_height / 2 >= height) {
+                reduced_width /= 2;
+                reduced_height /= 2;
+            }
+            width = reduced_width;
+            height = reduced_height;
+            viewport = true;
+            /* the same upload serves every scale, and halving is a box filter */
+            key_scale = 0;
+            key_filter = RESIZE_BOX;
+        }
+        struct pool_key key = variant_key(
+            image->id,
+            crop,
+            width,
+            height,
+            overlay->shm_format->format,
+            key_scale,
+            key_filter
+        );
+
+        buffer = pool_lookup(&overlay->state->pool, &key, image->damage.generation);
+        if (buffer != NULL) {
+            printf("[lwr] reusing %dx%d buffer\n", width, height);
+        } else {
+            buffer = draw_frame(overlay, &key, width, height);
+        }
+    }
+    if (buffer == NULL)
+        return NULL;
+
+    if (scale != overlay->attached_scale) {
+        printf("[lwr] rendering at scale %.3f\n", (double)scale / SCALE_ONE);
+        overlay->attached_scale = scale;
+    }
+    if (viewport) {
+        wl_surface_set_buffer_scale(overlay->wl_surface, 1);
+        wp_viewport_set_destination(
+            overlay->wp_viewport,
+            overlay->surface_width,
+            overlay->surface_height
+        );
+    } else {
+        wl_surface_set_buffer_scale(overlay->wl_surface, scale / SCALE_ONE);
+        if (overlay->wp_viewport != NULL)
+            wp_viewport_set_destination(overlay->wp_viewport, -1, -1);
+    }
+    apply_opaque_region(overlay, buffer);
+    return buffer;
+}
+
+static void close_stream(struct overlay* overlay) {
+    stream_close(overlay->stream);
+    overlay->stream = NULL;
+}
+
+/* Picks up what the stream has learned of the changes between frames and of
+ * which are alike. A frame merged into the one playing makes it last longer. */
+static void sync_stream(struct overlay* overlay) {
+    struct anim* anim = &overlay->anim;
+    bool hashed = anim->hashed_count == anim->frame_count;
+    for (int i = 0; i < anim->frame_count; ++i) {
+        if (!anim->known[i])
+            anim->known[i] = stream_changes(overlay->stream, i, &anim->changes[i]);
+        int same;
+        if (anim->hashed[i] || !stream_same(overlay->stream, i, &same))
+            continue;
+        int delay = anim->delays[i];
+        if (anim_add_same(anim, i, same) == overlay->frame)
+            overlay->frame_due += delay;
+    }
+    if (!hashed && anim->hashed_count == anim->frame_count && anim->duplicates > 0) {
+        printf(
+            "[lwr] animation: %d of %d frames are duplicates\n",
+            anim->duplicates,
+            anim->frame_count
+        );
+    }
+}
+
+/* Draws frame i of the overlay's animation into `buffer` of its store, like
+ * draw_frame draws the first, and not from the first frame's mipmap. Frames
+ * after the first come from the stream, opened for the first of them needed.
+ * A buffer still holding frame `previous` only has what changed since redrawn,
+ * unless the frame is reduced, which only works whole. */
+static bool draw_anim_frame(
+    struct overlay* overlay,
+    int i,
+    int previous,
+    struct pool_buffer* buffer
+) {
+    struct image* image = overlay->image;
+    if (!image_decoded(image))
+        return false;
+    const uint8_t* decoded = image->data;
+    if (i > 0 || previous >= 0) {
+        if (overlay->stream == NULL) {
+            overlay->stream = stream_open(
+                image->path,
+                image->width,
+                image->height,
+                image->frame_count,
+                image->opaque,
+                overlay->lookahead,
+                overlay->keep_frames
+            );
+        }
+    }
+    struct rect crop = overlay_crop(overlay);
+    bool resized = buffer->width != crop.width || buffer->height != crop.height;
+    /* once the frames are all kept, their changes expand straight into the buffer */
+    if (!resized && overlay->stream != NULL &&
+        stream_draw(
+            overlay->stream,
+            i,
+            previous,
+            crop,
+            pool_buffer_data(buffer),
+            buffer->stride,
+            overlay->shm_format->convert
+        )) {
+        sync_stream(overlay);
+        buffer->generation = overlay->anim.generation;
+        return true;
+    }
+    if (i > 0) {
+        decoded = overlay->stream != NULL ? stream_frame(overlay->stream, i) : NULL;
+        if (decoded == NULL) {
+            printf("[lwr] error: unable to decode frame %d of %s\n", i, image->path);
+            return false;
+        }
+    }
+    /* the changes up to a frame are known once it is decoded */
+    if (overlay->stream != NULL)
+        sync_stream(overlay);
+
+    bool reduced = overlay->scale_mode == SCALE_MODE_COMPOSITOR && resized;
+    struct region dirty;
+    struct region changed;
+    if (!reduced && previous >= 0 && anim_changes(&overlay->anim, previous, i, &changed)) {
+        changes_to_buffer(&changed, crop, buffer->width, buffer->height, &dirty);
+    } else {
+        region_clear(&dirty);
+        region_add(&dirty, (struct rect){ 0, 0, buffer->width, buffer->height });
+    }
+
+    struct image frame = *image;
+    frame.data = (uint8_t*)decoded;
+    frame.mip_count = 0;
+    double start = now_ms();
+    bool drawn = true;
+    if (reduced) {
+        drawn = draw_reduced(&frame, crop, buffer, overlay->shm_format);
+    } else {
+        for (int r = 0; drawn && r < dirty.count; ++r) {
+            drawn = draw_rect(
+                &frame,
+                crop,
+                buffer,
+                overlay->shm_format,
+                overlay->filter,
+                dirty.rects[r]
+            );
+        }
+    }
+    if (!drawn) {
+        printf("[lwr] error: unable to resize frame %d\n", i);
+        return false;
+    }
+    if (resized)
+        latency_add(&overlay->state->resize_latency, now_ms() - start);
+    buffer->generation = overlay->anim.generation;
+    return true;
+}
+
+/* Sets the overlay's frame store up for buffers like `first`, which holds the
+ * first frame, unless it already is. A new store starts the animation over.
+ * The store is full when it fits --anim-memory next to the smallest stream,
+ * a ring otherwise. A ring's stream keeps the frames, indexed, when they fit
+ * as well, and looks as far ahead as the rest allows.
+ * Returns false when there is no room for one, the first frame is then shown
+ * still. */
+static bool anim_sync(struct overlay* overlay, struct pool_buffer* first) {
+    struct anim* anim = &overlay->anim;
+    if (anim->buffers != NULL && pool_key_equal(&anim->key, &first->key) &&
+        anim->generation == first->generation)
+        return true;
+
+    anim_finish(anim);
+    close_stream(overlay);
+    struct image* image = overlay->image;
+    size_t cap = overlay->state->anim_memory;
+    size_t store = anim_size(image->frame_count, first->width, first->height);
+    bool ring = store + stream_memory(image->width, image->height, 1) > cap;
+    if (ring)
+        store = anim_size(ANIM_RING_BUFFERS, first->width, first->height);
+    size_t kept = stream_kept_memory(image->width, image->height, image->frame_count);
+    overlay->keep_frames =
+        ring && store + kept + stream_memory(image->width, image->height, 1) <= cap;
+    if (overlay->keep_frames)
+        store += kept;
+    overlay->lookahead = STREAM_MAX_LOOKAHEAD;
+    while (overlay->lookahead > 1 &&
+           store + stream_memory(image->width, image->height, overlay->lookahead) > cap)
+        --overlay->lookahead;
+
+    struct pool* pool = &overlay->state->pool;
+    if (!anim_init(
+            anim,
+            pool->wl_shm,
+            pool->backend,
+            pool->shm_flags,
+            image->frame_count,
+            image->delays,
+            ring,
+            first->width,
+            first->height,
+            first->format
+        ))
+        return false;
+    anim->key = first->key;
+    anim->generation = first->generation;
+
+    /* the first frame is drawn already */
+    int previous;
+    struct pool_buffer* frame = anim_claim(anim, 0, &previous);
+    for (int32_t y = 0; y < frame->height; ++y) {
+        memcpy(
+            pool_buffer_data(frame) + (size_t)y * frame->stride,
+            pool_buffer_data(first) + (size_t)y * first->stride,
+            (size_t)frame->width * 4
+        );
+    }
+    frame->generation = anim->generation;
+    overlay->frame = 0;
+    overlay->shown_frame = -1;
+    overlay->frame_due = now_ms() + anim->delays[0];
+    return true;
+}
+
+static void frame_done(void* data, struct wl_callback* wl_callback, uint32_t time);
+
+static const struct wl_callback_listener frame_listener = {
+    .done = frame_done,
+};
+
+/* Asks, with the commit that follows, to hear when the compositor is ready
+ * for another frame */
+static void request_frame(struct overlay* overlay) {
+    if (overlay->frame_callback != NULL)
+        wl_callback_destroy(overlay->frame_callback);
+    overlay->frame_callback = wl_surface_frame(overlay->wl_surface);
+    wl_callback_add_listener(overlay->frame_callback, &frame_listener, overlay);
+    overlay->frame_ready = false;
+}
+
+static void cancel_frame(struct overlay* overlay) {
+    if (overlay->frame_callback != NULL)
+        wl_callback_destroy(overlay->frame_callback);
+    overlay->frame_callback = NULL;
+    overlay->frame_ready = false;
+}
+
+/* Stops animating and drops the frames */
+static void stop_animation(struct overlay* overlay) {
+    cancel_frame(overlay);
+    close_stream(overlay);
+    anim_finish(&overlay->anim);
+    overlay->shown_frame = -1;
+}
+
+/* Attaches the overlay's current frame, drawing it unless the store holds it
+ * already, and damages what changed since the frame shown before. A frame
+ * that can't be drawn stops the animation on the one before, one a ring has
+ * no free buffer for is skipped. */
+static void show_frame(struct overlay* overlay) {
+    struct anim* anim = &overlay->anim;
+    if (overlay->stream != NULL)
+        sync_stream(overlay);
+    struct pool_buffer* buffer = anim_find(anim, overlay->frame);
+    if (buffer == NULL) {
+        int previous;
+        buffer = anim_claim(anim, overlay->frame, &previous);
+        if (buffer == NULL) {
+            request_frame(overlay);
+            wl_surface_commit(overlay->wl_surface);
+            return;
+        }
+        if (!draw_anim_frame(overlay, overlay->frame, previous, buffer)) {
+            cancel_frame(overlay);
+            return;
+        }
+    }
+
+    struct region damaged;
+    struct region changed;
+    if (overlay->shown_frame >= 0 &&
+        anim_changes(anim, overlay->shown_frame, overlay->frame, &changed)) {
+        struct rect crop = overlay_crop(overlay);
+        changes_to_buffer(&changed, crop, buffer->width, buffer->height, &damaged);
+    } else {
+        region_clear(&damaged);
+        region_add(&damaged, (struct rect){ 0, 0, buffer->width, buffer->height });
+    }
+    wl_surface_attach(overlay->wl_surface, buffer->wl_buffer, 0, 0);
+    buffer->busy = true;
+    for (int i = 0; i < damaged.count; ++i) {
+        struct rect* r = &damaged.rects[i];
+        wl_surface_damage_buffer(overlay->wl_surface, r->x, r->y, r->width, r->height);
+    }
+    overlay->shown_frame = overlay->frame;
+    request_frame(overlay);
+    wl_surface_commit(overlay->wl_surface);
+    /* a full store needs no decoding once it holds every frame */
+    if (overlay->stream != NULL && anim_complete(anim))
+        close_stream(overlay);
+    /* not a buffer present can bring up to date */
+    overlay->attached_key = (struct pool_key){ 0 };
+}
+
+/* Moves an animation on to the frame due now, once that is later than the
+ * shown frame's time and the compositor is ready for another */
+static void animate(struct overlay* overlay, double now) {
+    if (!overlay->visible || !overlay->frame_ready || now < overlay->frame_due)
+        return;
+    struct anim* anim = &overlay->anim;
+    overlay->frame = anim_advance(
+        anim->delays,
+        anim->frame_count,
+        overlay->frame,
+        &overlay->frame_due,
+        now
+    );
+    show_frame(overlay);
+}
+
+static void frame_done(void* data, struct wl_callback* wl_callback, uint32_t time) {
+    (void)time;
+    struct overlay* overlay = data;
+    wl_callback_destroy(wl_callback);
+    overlay->frame_callback = NULL;
+    overlay->frame_ready = true;
+    animate(overlay, now_ms());
+}
+
+/* Attaches the image at the last configured size and scale, damaging only
+ * what differs from the buffer attached before. Animations attach their
+ * current frame instead. */
+static void present(struct overlay* overlay) {
+    struct pool_buffer* buffer = prepare(overlay);
+    if (buffer == NULL) {
+        wl_surface_attach(overlay->wl_surface, NULL, 0, 0);
+        wl_surface_commit(overlay->wl_surface);
+        overlay->attached_key = (struct pool_key){ 0 };
+        stop_animation(overlay);
+        return;
+    }
+
+    if (image_animated(overlay->image) && anim_sync(overlay, buffer)) {
+        /* the store holds the first frame too */
+        pool_return(buffer);
+        show_frame(overlay);
+        show_committed(overlay->state, false);
+        return;
+    }
+
+    /* a different key means a different size or format, all of it is new */
+    struct region damaged;
+    if (pool_key_equal(&overlay->attached_key, &buffer->key)) {
+        buffer_damage_since(
+            overlay->image,
+            overlay_crop(overlay),
+            overlay->attached_generation,
+            buffer->width,
+            buffer->height,
+            &damaged
+        );
+    } else {
+        region_clear(&damaged);
+        region_add(&damaged, (struct rect){ 0, 0, buffer->width, buffer->height });
+    }
+
+    wl_surface_attach(overlay->wl_surface, buffer->wl_buffer, 0, 0);
+    for (int i = 0; i < damaged.count; ++i) {
+        struct rect* r = &damaged.rects[i];
+        wl_surface_damage_buffer(overlay->wl_surface, r->x, r->y, r->width, r->height);
+    }
+    wl_surface_commit(overlay->wl_surface);
+    /* no longer animated, after a swap or reload */
+    stop_animation(overlay);
+
+    show_committed(overlay->state, false);
+    overlay->attached_key = buffer->key;
+    overlay->attached_generation = buffer->generation;
+}
+
+/* Draws a hidden overlay ahead of its show, keeping the buffer out of the
+ * pool's reach until then */
+static void draw_armed(struct overlay* overlay) {
+    if (overlay->held != NULL) {
+        pool_return(overlay->held);
+        overlay->held = NULL;
+    }
+    overlay->held = prepare(overlay);
+    if (overlay->held != NULL)
+        printf("[lwr] armed %s\n", overlay->image->path);
+}
+
+/* Maps an armed overlay with the buffer drawn for it, in a single commit */
+static void reveal(struct overlay* overlay) {
+    overlay->visible = true;
+    struct pool_buffer* buffer = overlay->held;
+    if (buffer == NULL) {
+        /* not configured or drawn yet, the configure presents it */
+        return;
+    }
+    overlay->held = NULL;
 
-static void wl_buffer_release(void* data, struct wl_buffer* wl_buffer) {
-    (void)data;
-    /* Sent by the compositor when it's no longer using this buffer */
-    wl_buffer_destroy(wl_buffer);
+    wl_surface_attach(overlay->wl_surface, buffer->wl_buffer, 0, 0);
+    wl_surface_damage_buffer(overlay->wl_surface, 0, 0, buffer->width, buffer->height);
+    if (image_animated(overlay->image) && anim_sync(overlay, buffer)) {
+        /* the held buffer shows the first frame, the store the rest */
+        overlay->frame = 0;
+        overlay->shown_frame = 0;
+        overlay->frame_due = now_ms() + overlay->anim.delays[0];
+        request_frame(overlay);
+    }
+    wl_surface_commit(overlay->wl_surface);
+
+    show_committed(overlay->state, true);
+    overlay->attached_key = buffer->key;
+    overlay->attached_generation = buffer->generation;
 }
 
-static const struct wl_buffer_listener wl_buffer_listener = {
-    .release = wl_buffer_release,
-};
+/* Redraws a configured overlay, shown or armed */
+static void refresh(struct overlay* overlay) {
+    if (overlay->surface_width == 0)
+        return;
+    if (overlay->visible)
+        present(overlay);
+    else
+        draw_armed(overlay);
+}
 
-static struct wl_buffer* draw_frame(struct client_state* state) {
-    printf("[lwr] drawing frame\n");
-    int stride = state->target_width * 4;
-    int size = stride * state->target_height;
+/* Redraws for a new scale, unless nothing has been configured yet */
+static void scale_changed(struct overlay* overlay) {
+    if (overlay->surface_width != 0 && surface_scale(overlay) != overlay->attached_scale)
+        refresh(overlay);
+}
 
-    int fd = allocate_shm_file(size);
-    if (fd == -1) {
-        return NULL;
+/* Index of a wl_output in outputs, -1 for ones we don't track */
+static int output_index(struct client_state* state, struct wl_output* wl_output) {
+    for (int i = 0; i < MAX_OUTPUTS; ++i) {
+        if (state->outputs[i].wl_output == wl_output)
+            return i;
     }
+    return -1;
+}
 
-    uint32_t* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (data == MAP_FAILED) {
-        close(fd);
-        return NULL;
-    }
+static void
+wl_surface_enter(void* data, struct wl_surface* wl_surface, struct wl_output* wl_output) {
+    (void)wl_surface;
+    struct overlay* overlay = data;
+    int i = output_index(overlay->state, wl_output);
+    if (i >= 0)
+        overlay->entered |= 1u << i;
+    scale_changed(overlay);
+}
 
-    struct wl_shm_pool* pool = wl_shm_create_pool(state->wl_shm, fd, size);
-    struct wl_buffer* buffer = wl_shm_pool_create_buffer(
-        pool,
-        0,
-        state->target_width,
-        state->target_height,
-        stride,
-        WL_SHM_FORMAT_ARGB8888
-    );
-    wl_shm_pool_destroy(pool);
-    close(fd);
+static void
+wl_surface_leave(void* data, struct wl_surface* wl_surface, struct wl_output* wl_output) {
+    (void)wl_surface;
+    struct overlay* overlay = data;
+    int i = output_index(overlay->state, wl_output);
+    if (i >= 0)
+        overlay->entered &= ~(1u << i);
+    scale_changed(overlay);
+}
 
-    /* Draw image */
-    for (int y = 0; y < state->target_height; ++y) {
-        for (int x = 0; x < state->target_width; ++x) {
-            uint8_t* pixel = state->scaled_image_data + (y * state->target_width + x) * 4;
-            uint32_t color = (pixel[3] << 24) | (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
-            data[y * state->target_width + x] = color;
-        }
-    }
+static void
+wl_surface_preferred_buffer_scale(void* data, struct wl_surface* wl_surface, int32_t factor) {
+    (void)wl_surface;
+    struct overlay* overlay = data;
+    overlay->preferred_buffer_scale = factor;
+    scale_changed(overlay);
+}
 
-    munmap(data, size);
-    wl_buffer_add_listener(buffer, &wl_buffer_listener, NULL);
-    return buffer;
+static void wl_surface_preferred_buffer_transform(
+    void* data,
+    struct wl_surface* wl_surface,
+    uint32_t transform
+) {
+    (void)data;
+    (void)wl_surface;
+    (void)transform;
+}
+
+static const struct wl_surface_listener wl_surface_listener = {
+    .enter = wl_surface_enter,
+    .leave = wl_surface_leave,
+    .preferred_buffer_scale = wl_surface_preferred_buffer_scale,
+    .preferred_buffer_transform = wl_surface_preferred_buffer_transform,
+};
+
+static void wp_fractional_scale_v1_preferred_scale(
+    void* data,
+    struct wp_fractional_scale_v1* wp_fractional_scale_v1,
+    uint32_t scale
+) {
+    (void)wp_fractional_scale_v1;
+    struct overlay* overlay = data;
+    overlay->fractional_scale = scale;
+    scale_changed(overlay);
 }
 
+static const struct wp_fractional_scale_v1_listener wp_fractional_scale_v1_listener = {
+    .preferred_scale = wp_fractional_scale_v1_preferred_scale,
+};
+
 static void zwlr_layer_surface_configure(
     void* data,
     struct zwlr_layer_surface_v1* zwlr_layer_surface_v1,
@@ -146,13 +1944,13 @@ static void zwlr_layer_surface_configure(
     uint32_t width,
     uint32_t height
 ) {
-    struct client_state* state = data;
+    struct overlay* overlay = data;
     zwlr_layer_surface_v1_ack_configure(zwlr_layer_surface_v1, serial);
-    zwlr_layer_surface_v1_set_size(zwlr_layer_surface_v1, width, height);
 
-    struct wl_buffer* buffer = draw_frame(state);
-    wl_surface_attach(state->wl_surface, buffer, 0, 0);
-    wl_surface_commit(state->wl_surface);
+    /* zero means the compositor leaves that dimension up to us */
+    overlay->surface_width = width != 0 ? (int32_t)width : overlay->target_width;
+    overlay->surface_height = height != 0 ? (int32_t)height : overlay->target_height;
+    refresh(overlay);
 }
 
 static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
@@ -160,14 +1958,14 @@ static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
 };
 
 static void wl_output_name(void* data, struct wl_output* wl_output, const char* name) {
-    struct client_state* state = data;
+    (void)wl_output;
+    struct output* output = data;
     printf("[lwr] output name: %s\n", name);
-    if (state->output_name != NULL && strcmp(name, state->output_name) == 0) {
-        state->wl_output = wl_output;
-    }
+    free(output->connector);
+    output->connector = strdup(name);
 }
 
-// we need to fill in all the fields, but we only care about the name
+// we need to fill in all the fields, but we only care about the name and scale
 
 static void
 wl_output_description(void* data, struct wl_output* wl_output, const char* description) {
@@ -182,9 +1980,15 @@ static void wl_output_done(void* data, struct wl_output* wl_output) {
 }
 
 static void wl_output_scale(void* data, struct wl_output* wl_output, int32_t scale) {
-    (void)data;
     (void)wl_output;
-    (void)scale;
+    struct output* output = data;
+    struct client_state* state = output->state;
+    output->scale = scale;
+    uint32_t bit = 1u << (output - state->outputs);
+    for (int i = 0; i < MAX_OVERLAYS; ++i) {
+        if (state->overlays[i].entered & bit)
+            scale_changed(&state->overlays[i]);
+    }
 }
 
 static void wl_output_geometry(
@@ -236,6 +2040,41 @@ static const struct wl_output_listener wl_output_listener = {
     .mode = wl_output_mode,
 };
 
+static void wl_shm_format(void* data, struct wl_shm* wl_shm, uint32_t format) {
+    (void)wl_shm;
+    struct client_state* state = data;
+    for (size_t i = 0; i < SHM_FORMAT_COUNT; ++i) {
+        if (shm_formats[i].format == format)
+            state->shm_format_mask |= 1u << i;
+    }
+}
+
+static const struct wl_shm_listener wl_shm_listener = {
+    .format = wl_shm_format,
+};
+
+static const struct shm_format*
+choose_shm_format(struct client_state* state, const struct image* image) {
+    /* ARGB8888 and XRGB8888 support is mandatory, even if never advertised */
+    uint32_t mask = state->shm_format_mask;
+    uint32_t mandatory = 0;
+    for (size_t i = 0; i < SHM_FORMAT_COUNT; ++i) {
+        if (shm_formats[i].format == WL_SHM_FORMAT_ARGB8888 ||
+            shm_formats[i].format == WL_SHM_FORMAT_XRGB8888)
+            mandatory |= 1u << i;
+    }
+    /* baked images are laid out in those already */
+    mask = image->baked != NULL ? mandatory : mask | mandatory;
+
+    for (size_t i = 0; i < SHM_FORMAT_COUNT; ++i) {
+        if (shm_formats[i].opaque_only && !image->opaque)
+            continue;
+        if (mask & (1u << i))
+            return &shm_formats[i];
+    }
+    return &shm_formats[SHM_FORMAT_COUNT - 1];
+}
+
 static void registry_global(
     void* data,
     struct wl_registry* wl_registry,
@@ -243,27 +2082,64 @@ static void registry_global(
     const char* interface,
     uint32_t version
 ) {
-    (void)version;
     struct client_state* state = data;
     if (strcmp(interface, wl_shm_interface.name) == 0) {
         state->wl_shm = wl_registry_bind(wl_registry, name, &wl_shm_interface, 1);
+        wl_shm_add_listener(state->wl_shm, &wl_shm_listener, state);
     } else if (strcmp(interface, wl_compositor_interface.name) == 0) {
-        state->wl_compositor = wl_registry_bind(wl_registry, name, &wl_compositor_interface, 4);
+        /* version 6 adds wl_surface.preferred_buffer_scale */
+        state->wl_compositor = wl_registry_bind(
+            wl_registry,
+            name,
+            &wl_compositor_interface,
+            version < 6 ? version : 6
+        );
     } else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
         state->zwlr_layer_shell_v1 =
             wl_registry_bind(wl_registry, name, &zwlr_layer_shell_v1_interface, 1);
     } else if (strcmp(interface, wl_output_interface.name) == 0) {
-        struct wl_output* wl_output =
-            wl_registry_bind(wl_registry, name, &wl_output_interface, 4);
-        wl_output_add_listener(wl_output, &wl_output_listener, state);
+        struct output* output = NULL;
+        for (int i = 0; i < MAX_OUTPUTS && output == NULL; ++i) {
+            if (state->outputs[i].wl_output == NULL)
+                output = &state->outputs[i];
+        }
+        if (output == NULL) {
+            printf("[lwr] ignoring output, more than %d connected\n", MAX_OUTPUTS);
+            return;
+        }
+        *output = (struct output){
+            .state = state,
+            .wl_output = wl_registry_bind(wl_registry, name, &wl_output_interface, 4),
+            .name = name,
+            .scale = 1,
+        };
+        wl_output_add_listener(output->wl_output, &wl_output_listener, output);
+    } else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+        state->wp_viewporter = wl_registry_bind(wl_registry, name, &wp_viewporter_interface, 1);
+    } else if (strcmp(interface, wp_fractional_scale_manager_v1_interface.name) == 0) {
+        state->wp_fractional_scale_manager_v1 =
+            wl_registry_bind(wl_registry, name, &wp_fractional_scale_manager_v1_interface, 1);
     }
 }
 
 static void registry_global_remove(void* data, struct wl_registry* wl_registry, uint32_t name) {
-    (void)data;
     (void)wl_registry;
-    (void)name;
-    /* This space deliberately left blank */
+    struct client_state* state = data;
+    for (int i = 0; i < MAX_OUTPUTS; ++i) {
+        struct output* output = &state->outputs[i];
+        if (output->wl_output == NULL || output->name != name)
+            continue;
+        wl_output_destroy(output->wl_output);
+        free(output->connector);
+        for (int j = 0; j < MAX_OVERLAYS; ++j) {
+            struct overlay* overlay = &state->overlays[j];
+            if (overlay->output == output->wl_output)
+                overlay->output = NULL;
+            overlay->entered &= ~(1u << i);
+            scale_changed(overlay);
+        }
+        *output = (struct output){ 0 };
+    }
 }
 
 static const struct wl_registry_listener wl_registry_listener = {
@@ -271,33 +2147,157 @@ static const struct wl_registry_listener wl_registry_listener = {
     .global_remove = registry_global_remove,
 };
 
+/* Tears an overlay down, keeping the connection and the decoded images */
+static void destroy_overlay(struct overlay* overlay) {
+    if (overlay->wl_surface == NULL)
+        return;
+
+    if (overlay->held != NULL)
+        pool_release(overlay->held);
+    /* unmapping first has the compositor release the attached buffer */
+    wl_surface_attach(overlay->wl_surface, NULL, 0, 0);
+    wl_surface_commit(overlay->wl_surface);
+    stop_animation(overlay);
+    if (overlay->wp_fractional_scale_v1 != NULL)
+        wp_fractional_scale_v1_destroy(overlay->wp_fractional_scale_v1);
+    if (overlay->wp_viewport != NULL)
+        wp_viewport_destroy(overlay->wp_viewport);
+    zwlr_layer_surface_v1_destroy(overlay->zwlr_layer_surface_v1);
+    wl_surface_destroy(overlay->wl_surface);
+
+    struct client_state* state = overlay->state;
+    if (state->shown == overlay)
+        state->shown = NULL;
+    *overlay = (struct overlay){ .state = state };
+}
+
+/* Takes the shown overlay off screen. Armed ones are unmapped and armed
+ * again, the rest are torn down. */
+static void hide(struct client_state* state) {
+    struct overlay* overlay = state->shown;
+    if (overlay == NULL)
+        return;
+    if (!overlay->armed) {
+        destroy_overlay(overlay);
+        return;
+    }
+
+    state->shown = NULL;
+    /* the frames drawn stay for the next show, the decoder doesn't */
+    cancel_frame(overlay);
+    close_stream(overlay);
+    overlay->shown_frame = -1;
+    wl_surface_attach(overlay->wl_surface, NULL, 0, 0);
+    wl_surface_commit(overlay->wl_surface);
+    /* an unmapped layer surface gets configured again after a commit
+     * without a buffer, which draws it for the next show */
+    wl_surface_commit(overlay->wl_surface);
+    overlay->visible = false;
+    overlay->surface_width = 0;
+    overlay->surface_height = 0;
+    overlay->attached_key = (struct pool_key){ 0 };
+    overlay->attached_generation = 0;
+    overlay->entered = 0;
+}
+
 static void cleanup(void) {
     // get state
     struct client_state* state = g_state;
 
-    zwlr_layer_surface_v1_destroy(state->zwlr_layer_surface_v1);
-    wl_surface_destroy(state->wl_surface);
+    pool_print_stats(&state->pool);
+    cache_print_stats(&state->cache);
+    char armed[96], cold[96];
+    latency_format(&state->armed_latency, armed, sizeof(armed));
+    latency_format(&state->cold_latency, cold, sizeof(cold));
+    printf("[lwr] show latency: armed %s, cold %s\n", armed, cold);
+    char resizes[192];
+    resize_stats_format(state, resizes, sizeof(resizes));
+    printf("[lwr] %s\n", resizes);
+    char frames[128];
+    anim_stats_format(state, frames, sizeof(frames));
+    printf("[lwr] %s\n", frames);
+
+    for (int i = 0; i < MAX_OVERLAYS; ++i)
+        destroy_overlay(&state->overlays[i]);
+    for (int i = 0; i < IMAGE_CACHE_SIZE; ++i)
+        drop_baked(state, &state->images[i]);
+    pool_finish(&state->pool);
     zwlr_layer_shell_v1_destroy(state->zwlr_layer_shell_v1);
+    if (state->wp_fractional_scale_manager_v1 != NULL)
+        wp_fractional_scale_manager_v1_destroy(state->wp_fractional_scale_manager_v1);
+    if (state->wp_viewporter != NULL)
+        wp_viewporter_destroy(state->wp_viewporter);
+    for (int i = 0; i < MAX_OUTPUTS; ++i) {
+        if (state->outputs[i].wl_output != NULL)
+            wl_output_destroy(state->outputs[i].wl_output);
+        free(state->outputs[i].connector);
+    }
     wl_compositor_destroy(state->wl_compositor);
     wl_shm_destroy(state->wl_shm);
     wl_registry_destroy(state->wl_registry);
     wl_display_disconnect(state->wl_display);
 
-    if (state->scaled_image_data != state->image_data)
-        free(state->scaled_image_data);
+    for (int i = 0; i < IMAGE_CACHE_SIZE; ++i) {
+        if (state->images[i].decoding != NULL)
+            finish_decode(state, &state->images[i]);
+        free(state->images[i].path);
+        free_frames(&state->images[i]);
+        drop_mips(&state->images[i]);
+    }
+    cache_close(&state->cache);
+    resize_finish();
+
+    if (state->control_fd >= 0) {
+        close(state->control_fd);
+        unlink(state->control_path);
+    }
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+        if (state->control_clients[i].fd >= 0)
+            close(state->control_clients[i].fd);
+    }
+}
+
+/* Cleaning up takes locks and joins threads, which can't be done from a
+ * handler interrupting their holders. run() returns instead and main cleans
+ * up. */
+static void signal_exit(int sig) {
+    exit_signal = sig;
+}
 
-    stbi_image_free(state->image_data);
+static void signal_reload(int sig) {
+    (void)sig;
+    reload_requested = 1;
 }
 
-// signal handler
-static void signal_cleanup(int sig) {
-    printf("[lwr] received signal %d\n", sig);
+/* whether signal() resets the handler after the first signal depends on the
+ * feature macros, sigaction keeps it installed */
+static bool set_signal_handler(int sig, void (*handler)(int)) {
+    struct sigaction action = { .sa_handler = handler };
+    sigemptyset(&action.sa_mask);
+    return sigaction(sig, &action, NULL) == 0;
+}
 
-    if (sig == SIGINT || sig == SIGTERM) {
-        printf("[lwr] exiting\n");
+/* Redraws the overlays of an image that changed */
+static void image_changed(struct client_state* state, struct image* image) {
+    for (int i = 0; i < MAX_OVERLAYS; ++i) {
+        struct overlay* overlay = &state->overlays[i];
+        if (overlay->wl_surface == NULL || overlay->image != image)
+            continue;
+        /* opacity may have changed, and with it the cheapest format */
+        overlay->shm_format = choose_shm_format(state, image);
+        refresh(overlay);
     }
-    cleanup();
-    exit(0);
+}
+
+/* Re-reads the shown image from disk and presents whatever changed */
+static void reload(struct client_state* state) {
+    if (state->shown == NULL)
+        return;
+    const char* path = state->shown->image->path;
+    printf("[lwr] reloading %s\n", path);
+    struct image* image = load_image(state, path, true);
+    if (image != NULL)
+        image_changed(state, image);
 }
 
 typedef struct args {
@@ -307,6 +2307,19 @@ typedef struct args {
     int margin;
     enum zwlr_layer_surface_v1_anchor anchor;
     char* output_name;
+    enum scale_mode scale_mode;
+    enum resize_filter filter;
+    struct crop crop;
+    enum shm_backend backend;
+    unsigned shm_flags;
+    /* MiB, 0 turns the disk cache off */
+    int cache_size;
+    /* resize threads, 0 for one per core */
+    int threads;
+    bool mipmaps;
+    /* MiB an animation may keep */
+    int anim_memory;
+    bool daemon;
 } args_t;
 
 void usage(char* argv[]) {
@@ -315,6 +2328,9 @@ void usage(char* argv[]) {
         "get an overlay of your choice on your wayland compositor\n"
         "\n"
         "Usage: %s <path> [OPTIONS]\n"
+        "       %s --daemon [OPTIONS]\n"
+        "       %s --send <command>\n"
+        "       %s --bake <path> <output> [<width>x<height>...]\n"
         "\n"
         "Options:\n"
         "  -w, --width <width>              set the width of the overlay\n"
@@ -328,214 +2344,759 @@ void usage(char* argv[]) {
         "                                   default: top:left\n"
         "  -o, --output <output>            set the output of the overlay\n"
         "                                   default: NULL\n"
+        "  -s, --scale-mode <mode>          who scales the image to the overlay size\n"
+        "                                   (cpu|compositor)\n"
+        "                                   default: cpu\n"
+        "  -f, --filter <filter>            how the cpu resamples the image\n"
+        "                                   (nearest|box|bilinear|stbir)\n"
+        "                                   default: stbir\n"
+        "  -r, --crop <x>,<y>,<w>,<h>       show only that part of the image\n"
+        "                                   in pixels, or in percent as in 10%%\n"
+        "                                   default: the whole image\n"
+        "  -M, --memory <backend>           where buffer memory comes from\n"
+        "                                   (shm|memfd|hugetlb)\n"
+        "                                   default: memfd\n"
+        "  -p, --prefault                   fault buffer memory in when it's mapped\n"
+        "  -C, --cache-size <MiB>           size of the cache of drawn images on disk\n"
+        "                                   0 turns it off\n"
+        "                                   default: 256\n"
+        "  -t, --threads <count>            threads resizing large images\n"
+        "                                   default: one per core\n"
+        "  -z, --mipmaps                    keep halved copies of images to resize from\n"
+        "  -A, --anim-memory <MiB>          memory an animation may keep, beyond which\n"
+        "                                   its frames are decoded again every loop\n"
+        "                                   default: 64\n"
+        "\n"
+        "Daemon commands:\n"
+        "  show <path> [OPTIONS]            show an overlay, replacing the current one\n"
+        "  arm <path> [OPTIONS]             prepare a hidden overlay for the same show\n"
+        "  disarm <path>                    drop the overlays armed for an image\n"
+        "  swap <path>                      change the image of the current overlay\n"
+        "  hide                             remove the current overlay\n"
+        "  stats                            print latencies and animation frame dedupe\n"
+        "  quit                             stop the daemon\n"
         "\n"
         "Example:\n"
         "  %s /path/to/image.png -w 240 -m 8 -a top:middle\n",
         argv[0],
         argv[0],
+        argv[0],
+        argv[0],
+        argv[0],
         argv[0]
     );
 }
 
-args_t args_parse(int argc, char* argv[]) {
-    args_t args = {
+static args_t args_defaults(void) {
+    return (args_t){
         .image_path = NULL,
         .target_width = 0,
         .target_height = 0,
         .anchor = ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT,
         .margin = 0,
         .output_name = NULL,
+        .scale_mode = SCALE_MODE_CPU,
+        .filter = RESIZE_STBIR,
+        .crop = { .values = { 0 } },
+        .backend = SHM_BACKEND_MEMFD,
+        .shm_flags = 0,
+        .cache_size = 256,
+        .threads = 0,
+        .mipmaps = false,
+        .anim_memory = 64,
+        .daemon = false,
     };
-    if (argc < 2) {
-        usage(argv);
-        exit(1);
-    }
-
-    args.image_path = argv[1];
+}
 
-    // check if file exists
-    if (access(args.image_path, F_OK) == -1) {
-        printf("[lwr] error: file %s does not exist\n", args.image_path);
-        exit(1);
+/* Parses --crop's x,y,width,height, each in pixels or, with a trailing %, in
+ * percent of the image's width or height */
+static bool crop_parse(const char* text, struct crop* crop) {
+    struct crop parsed = { .values = { 0 } };
+    for (int i = 0; i < 4; ++i) {
+        char* end;
+        double value = strtod(text, &end);
+        if (end == text || !(value >= 0))
+            return false;
+        parsed.percent[i] = *end == '%';
+        if (parsed.percent[i] ? value > 100 : value > INT32_MAX || value != (int32_t)value)
+            return false;
+        if (parsed.percent[i])
+            ++end;
+        if (*end != (i < 3 ? ',' : '\0'))
+            return false;
+        parsed.values[i] = value;
+        text = end + 1;
     }
+    if (parsed.values[2] == 0 || parsed.values[3] == 0)
+        return false;
+    *crop = parsed;
+    return true;
+}
+
+/* Parses the options from argv[first] on into `args`, returning false on ones
+ * it doesn't know or that lack their value */
+static bool args_parse_options(args_t* args, int argc, char* argv[], int first) {
+    for (int i = first; i < argc; i++) {
+        /* every option but --prefault and --mipmaps takes a value */
+        bool flag = strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--prefault") == 0 ||
+                    strcmp(argv[i], "-z") == 0 || strcmp(argv[i], "--mipmaps") == 0;
+        if (!flag && i + 1 >= argc)
+            return false;
 
-    for (int i = 2; i < argc; i++) {
         if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--width") == 0) {
-            args.target_width = atoi(argv[++i]);
+            args->target_width = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--height") == 0) {
-            args.target_height = atoi(argv[++i]);
+            args->target_height = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--margin") == 0) {
-            args.margin = atoi(argv[++i]);
+            args->margin = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) {
             char* output = argv[++i];
-            args.output_name = output;
+            args->output_name = output;
+        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--scale-mode") == 0) {
+            char* mode = argv[++i];
+            if (strcmp(mode, "cpu") == 0) {
+                args->scale_mode = SCALE_MODE_CPU;
+            } else if (strcmp(mode, "compositor") == 0) {
+                args->scale_mode = SCALE_MODE_COMPOSITOR;
+            } else {
+                return false;
+            }
+        } else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--filter") == 0) {
+            if (!resize_filter_parse(argv[++i], &args->filter)) {
+                return false;
+            }
+        } else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--crop") == 0) {
+            if (!crop_parse(argv[++i], &args->crop)) {
+                return false;
+            }
+        } else if (strcmp(argv[i], "-M") == 0 || strcmp(argv[i], "--memory") == 0) {
+            if (!shm_backend_parse(argv[++i], &args->backend)) {
+                return false;
+            }
+        } else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--prefault") == 0) {
+            args->shm_flags |= SHM_PREFAULT;
+        } else if (strcmp(argv[i], "-z") == 0 || strcmp(argv[i], "--mipmaps") == 0) {
+            args->mipmaps = true;
+        } else if (strcmp(argv[i], "-C") == 0 || strcmp(argv[i], "--cache-size") == 0) {
+            args->cache_size = atoi(argv[++i]);
+            if (args->cache_size < 0) {
+                return false;
+            }
+        } else if (strcmp(argv[i], "-A") == 0 || strcmp(argv[i], "--anim-memory") == 0) {
+            args->anim_memory = atoi(argv[++i]);
+            if (args->anim_memory < 0) {
+                return false;
+            }
+        } else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threads") == 0) {
+            args->threads = atoi(argv[++i]);
+            if (args->threads < 0 || args->threads > RESIZE_MAX_THREADS) {
+                return false;
+            }
         } else if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--anchor") == 0) {
             char* anchor = argv[++i];
             if (strcmp(anchor, "top:left") == 0) {
-                args.anchor =
+                args->anchor =
                     ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT;
             } else if (strcmp(anchor, "top:middle") == 0) {
-                args.anchor = ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP |
-                              ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT |
-                              ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
+                args->anchor = ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP |
+                                ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT |
+                                ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
             } else if (strcmp(anchor, "top:right") == 0) {
-                args.anchor =
+                args->anchor =
                     ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
             } else if (strcmp(anchor, "middle:left") == 0) {
-                args.anchor = ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP |
-                              ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
-                              ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT;
+                args->anchor = ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP |
+                                ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
+                                ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT;
             } else if (strcmp(anchor, "middle:middle") == 0) {
-                args.anchor =
+                args->anchor =
                     ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP | ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
                     ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
             } else if (strcmp(anchor, "middle:right") == 0) {
-                args.anchor = ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP |
-                              ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
-                              ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
+                args->anchor = ZWLR_LAYER_SURFACE_V1_ANCHOR_TOP |
+                                ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
+                                ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
             } else if (strcmp(anchor, "bottom:left") == 0) {
-                args.anchor =
+                args->anchor =
                     ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM | ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT;
             } else if (strcmp(anchor, "bottom:middle") == 0) {
-                args.anchor = ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
-                              ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT |
-                              ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
+                args->anchor = ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM |
+                                ZWLR_LAYER_SURFACE_V1_ANCHOR_LEFT |
+                                ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
             } else if (strcmp(anchor, "bottom:right") == 0) {
-                args.anchor =
+                args->anchor =
                     ZWLR_LAYER_SURFACE_V1_ANCHOR_BOTTOM | ZWLR_LAYER_SURFACE_V1_ANCHOR_RIGHT;
             } else {
-                usage(argv);
-                exit(1);
+                return false;
             }
         } else {
-            usage(argv);
-            exit(1);
+            return false;
         }
     }
-    return args;
+    return true;
 }
 
-int main(int argc, char* argv[]) {
-    args_t args = args_parse(argc, argv);
-
-    struct client_state state = { 0 };
-    g_state = &state;
-
-    // register signal handler
-    if (signal(SIGINT, signal_cleanup) == SIG_ERR) {
-        printf("[lwr] error: unable to register signal handler\n");
-        exit(1);
-    }
-
-    if (signal(SIGTERM, signal_cleanup) == SIG_ERR) {
-        printf("[lwr] error: unable to register signal handler\n");
+args_t args_parse(int argc, char* argv[]) {
+    args_t args = args_defaults();
+    if (argc < 2) {
+        usage(argv);
         exit(1);
     }
 
-    state.image_data = stbi_load(args.image_path, &state.width, &state.height, NULL, 4);
+    if (strcmp(argv[1], "-d") == 0 || strcmp(argv[1], "--daemon") == 0) {
+        args.daemon = true;
+    } else {
+        args.image_path = argv[1];
 
-    printf("[lwr] loading image %s (%dx%d)\n", args.image_path, state.width, state.height);
+        // check if file exists
+        if (access(args.image_path, F_OK) == -1) {
+            printf("[lwr] error: file %s does not exist\n", args.image_path);
+            exit(1);
+        }
+    }
 
-    if (args.target_width == 0 && args.target_height == 0) {
-        args.target_width = state.width;
-        args.target_height = state.height;
-    } else if (args.target_width == 0) {
-        args.target_width =
-            (int)((float)args.target_height * (float)state.width / state.height);
-    } else if (args.target_height == 0) {
-        args.target_height =
-            (int)((float)args.target_width * (float)state.height / state.width);
+    if (!args_parse_options(&args, argc, argv, 2)) {
+        usage(argv);
+        exit(1);
     }
+    return args;
+}
 
-    if (args.target_width != state.width || args.target_height != state.height) {
-        printf(
-            "[lwr] resizing image %s (%dx%d) -> (%dx%d)\n",
-            args.image_path,
-            state.width,
-            state.height,
-            args.target_width,
-            args.target_height
-        );
-        state.scaled_image_data = malloc(args.target_width * args.target_height * 4);
-        if (state.scaled_image_data == NULL) {
-            exit(1);
+/* Finds the output asked for by name, NULL leaves it to the compositor */
+static bool find_output(struct client_state* state, const char* name, struct wl_output** out) {
+    *out = NULL;
+    if (name == NULL)
+        return true;
+    for (int i = 0; i < MAX_OUTPUTS; ++i) {
+        const char* connector = state->outputs[i].connector;
+        if (connector != NULL && strcmp(connector, name) == 0) {
+            *out = state->outputs[i].wl_output;
+            return true;
         }
-        stbir_resize_uint8_srgb(
-            state.image_data,
-            state.width,
-            state.height,
-            0,
-            state.scaled_image_data,
-            args.target_width,
-            args.target_height,
-            0,
-            STBIR_RGBA_PM
-        );
-    } else {
-        state.scaled_image_data = state.image_data;
     }
+    printf("[lwr] error: output %s not found\n", name);
+    return false;
+}
 
-    state.target_width = args.target_width;
-    state.target_height = args.target_height;
+/* Compositor scaling needs wp_viewporter */
+static enum scale_mode usable_scale_mode(struct client_state* state, enum scale_mode mode) {
+    return state->wp_viewporter != NULL ? mode : SCALE_MODE_CPU;
+}
 
-    if (args.output_name != NULL) {
-        state.output_name = args.output_name;
+/* Returns the overlay armed for exactly this request, or NULL */
+static struct overlay*
+find_armed(struct client_state* state, const args_t* args, struct wl_output* output) {
+    for (int i = 0; i < MAX_OVERLAYS; ++i) {
+        struct overlay* overlay = &state->overlays[i];
+        if (overlay->wl_surface == NULL || !overlay->armed)
+            continue;
+        if (strcmp(overlay->image->path, args->image_path) == 0 &&
+            overlay->requested_width == args->target_width &&
+            overlay->requested_height == args->target_height &&
+            overlay->margin == args->margin && overlay->anchor == args->anchor &&
+            overlay->output == output && overlay->filter == args->filter &&
+            crop_equal(&overlay->crop, &args->crop) &&
+            overlay->scale_mode == usable_scale_mode(state, args->scale_mode))
+            return overlay;
     }
+    return NULL;
+}
 
-    state.wl_display = wl_display_connect(NULL);
-    state.wl_registry = wl_display_get_registry(state.wl_display);
-    wl_registry_add_listener(state.wl_registry, &wl_registry_listener, &state);
-    wl_display_roundtrip(state.wl_display);
+/* Creates a layer surface for `image` in a free overlay slot. The initial
+ * commit asks for a configure, which shows the image or, when `armed`, only
+ * draws it. */
+static struct overlay* create_overlay(
+    struct client_state* state,
+    const args_t* args,
+    struct wl_output* output,
+    struct image* image,
+    bool armed
+) {
+    struct overlay* overlay = NULL;
+    for (int i = 0; i < MAX_OVERLAYS && overlay == NULL; ++i) {
+        if (state->overlays[i].wl_surface == NULL)
+            overlay = &state->overlays[i];
+    }
+    if (overlay == NULL) {
+        printf("[lwr] error: all %d overlays are in use\n", MAX_OVERLAYS);
+        return NULL;
+    }
 
-    state.wl_surface = wl_compositor_create_surface(state.wl_compositor);
-    struct wl_region* region = wl_compositor_create_region(state.wl_compositor);
-    wl_surface_set_input_region(state.wl_surface, region);
-    wl_region_destroy(region);
+    /* sized and shaped after the crop */
+    struct rect crop = crop_rect(&args->crop, image->width, image->height);
+    int target_width = args->target_width;
+    int target_height = args->target_height;
+    if (target_width == 0 && target_height == 0) {
+        target_width = crop.width;
+        target_height = crop.height;
+    } else if (target_width == 0) {
+        target_width = (int)((float)target_height * (float)crop.width / crop.height);
+    } else if (target_height == 0) {
+        target_height = (int)((float)target_width * (float)crop.height / crop.width);
+    }
 
-    struct wl_output* output = NULL;
+    if (args->scale_mode == SCALE_MODE_COMPOSITOR && state->wp_viewporter == NULL)
+        printf("[lwr] compositor lacks wp_viewporter, scaling on the cpu\n");
 
-    if (args.output_name != NULL) {
-        wl_display_dispatch(state.wl_display);
+    *overlay = (struct overlay){
+        .state = state,
+        .image = image,
+        .shm_format = choose_shm_format(state, image),
+        .scale_mode = usable_scale_mode(state, args->scale_mode),
+        .filter = args->filter,
+        .crop = args->crop,
+        .target_width = target_width,
+        .target_height = target_height,
+        .requested_width = args->target_width,
+        .requested_height = args->target_height,
+        .margin = args->margin,
+        .anchor = args->anchor,
+        .output = output,
+        .armed = armed,
+        .visible = !armed,
+        .shown_frame = -1,
+    };
+    printf(
+        "[lwr] shm format: %s (%s)\n",
+        overlay->shm_format->name,
+        overlay->shm_format->cost
+    );
 
-        output = state.wl_output;
-        if (output == NULL) {
-            printf("[lwr] error: output %s not found\n", args.output_name);
-            exit(1);
-        }
+    overlay->wl_surface = wl_compositor_create_surface(state->wl_compositor);
+    wl_surface_add_listener(overlay->wl_surface, &wl_surface_listener, overlay);
+    if (state->wp_viewporter != NULL) {
+        overlay->wp_viewport =
+            wp_viewporter_get_viewport(state->wp_viewporter, overlay->wl_surface);
+    }
+    if (state->wp_fractional_scale_manager_v1 != NULL && overlay->wp_viewport != NULL) {
+        overlay->wp_fractional_scale_v1 = wp_fractional_scale_manager_v1_get_fractional_scale(
+            state->wp_fractional_scale_manager_v1,
+            overlay->wl_surface
+        );
+        wp_fractional_scale_v1_add_listener(
+            overlay->wp_fractional_scale_v1,
+            &wp_fractional_scale_v1_listener,
+            overlay
+        );
     }
+    struct wl_region* region = wl_compositor_create_region(state->wl_compositor);
+    wl_surface_set_input_region(overlay->wl_surface, region);
+    wl_region_destroy(region);
 
-    state.zwlr_layer_surface_v1 = zwlr_layer_shell_v1_get_layer_surface(
-        state.zwlr_layer_shell_v1,
-        state.wl_surface,
+    overlay->zwlr_layer_surface_v1 = zwlr_layer_shell_v1_get_layer_surface(
+        state->zwlr_layer_shell_v1,
+        overlay->wl_surface,
         output,
         ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY,
         PROJECT_NAME
     );
-    zwlr_layer_surface_v1_set_size(
-        state.zwlr_layer_surface_v1,
-        args.target_width,
-        args.target_height
-    );
-    zwlr_layer_surface_v1_set_anchor(state.zwlr_layer_surface_v1, args.anchor);
+    zwlr_layer_surface_v1_set_size(overlay->zwlr_layer_surface_v1, target_width, target_height);
+    zwlr_layer_surface_v1_set_anchor(overlay->zwlr_layer_surface_v1, args->anchor);
     zwlr_layer_surface_v1_set_margin(
-        state.zwlr_layer_surface_v1,
-        args.margin,
-        args.margin,
-        args.margin,
-        args.margin
+        overlay->zwlr_layer_surface_v1,
+        args->margin,
+        args->margin,
+        args->margin,
+        args->margin
     );
-    zwlr_layer_surface_v1_set_keyboard_interactivity(state.zwlr_layer_surface_v1, 0);
+    zwlr_layer_surface_v1_set_keyboard_interactivity(overlay->zwlr_layer_surface_v1, 0);
     zwlr_layer_surface_v1_add_listener(
-        state.zwlr_layer_surface_v1,
+        overlay->zwlr_layer_surface_v1,
         &layer_surface_listener,
-        &state
+        overlay
     );
 
-    wl_surface_commit(state.wl_surface);
+    wl_surface_commit(overlay->wl_surface);
+    return overlay;
+}
+
+/* Puts the image at args->image_path up, replacing the shown overlay. One
+ * armed for the same request is shown in a single commit. */
+static bool show(struct client_state* state, const args_t* args) {
+    struct wl_output* output;
+    if (!find_output(state, args->output_name, &output))
+        return false;
+
+    struct overlay* armed = find_armed(state, args, output);
+    if (armed != NULL) {
+        if (armed != state->shown) {
+            hide(state);
+            state->shown = armed;
+            reveal(armed);
+        }
+        return true;
+    }
+
+    struct image* image = load_image(state, args->image_path, false);
+    if (image == NULL)
+        return false;
+    hide(state);
+    state->shown = create_overlay(state, args, output, image, false);
+    return state->shown != NULL;
+}
+
+/* Sets up a hidden overlay for a later show with the same arguments */
+static bool arm_overlay(struct client_state* state, const args_t* args) {
+    struct wl_output* output;
+    if (!find_output(state, args->output_name, &output))
+        return false;
+    if (find_armed(state, args, output) != NULL)
+        return true;
+
+    struct image* image = load_image(state, args->image_path, false);
+    if (image == NULL)
+        return false;
+    return create_overlay(state, args, output, image, true) != NULL;
+}
+
+/* Drops the overlays armed for an image, the shown one once it is hidden */
+static void disarm(struct client_state* state, const char* path) {
+    for (int i = 0; i < MAX_OVERLAYS; ++i) {
+        struct overlay* overlay = &state->overlays[i];
+        if (overlay->wl_surface == NULL || !overlay->armed)
+            continue;
+        if (strcmp(overlay->image->path, path) != 0)
+            continue;
+        overlay->armed = false;
+        if (overlay != state->shown)
+            destroy_overlay(overlay);
+    }
+}
+
+/* Runs one control request, writing its reply. Returns false once the daemon
+ * should stop. */
+static bool daemon_command(
+    struct client_state* state,
+    int argc,
+    char* argv[],
+    char* reply,
+    size_t reply_size
+) {
+    const char* command = argc > 0 ? argv[0] : "";
+    snprintf(reply, reply_size, "ok");
+    /* time to first commit counts from the request */
+    state->start_time = now_ms();
+    state->committed = false;
+
+    bool show_command = strcmp(command, "show") == 0;
+    if ((show_command || strcmp(command, "arm") == 0) && argc >= 2) {
+        args_t args = args_defaults();
+        args.image_path = argv[1];
+        if (!args_parse_options(&args, argc, argv, 2)) {
+            snprintf(reply, reply_size, "error: bad options");
+        } else if (show_command ? !show(state, &args) : !arm_overlay(state, &args)) {
+            snprintf(reply, reply_size, "error: unable to %s %s", command, args.image_path);
+        }
+    } else if (strcmp(command, "disarm") == 0 && argc == 2) {
+        disarm(state, argv[1]);
+    } else if (strcmp(command, "swap") == 0 && argc == 2) {
+        struct overlay* overlay = state->shown;
+        struct image* image = overlay != NULL ? load_image(state, argv[1], false) : NULL;
+        if (overlay == NULL) {
+            snprintf(reply, reply_size, "error: nothing is shown");
+        } else if (image == NULL) {
+            snprintf(reply, reply_size, "error: unable to load %s", argv[1]);
+        } else {
+            /* no longer what it was armed with */
+            overlay->armed = false;
+            overlay->image = image;
+            image_changed(state, image);
+        }
+    } else if (strcmp(command, "hide") == 0 && argc == 1) {
+        hide(state);
+    } else if (strcmp(command, "stats") == 0 && argc == 1) {
+        char armed[96], cold[96];
+        latency_format(&state->armed_latency, armed, sizeof(armed));
+        latency_format(&state->cold_latency, cold, sizeof(cold));
+        int length =
+            snprintf(reply, reply_size, "ok show latency: armed %s, cold %s; ", armed, cold);
+        if (length > 0 && (size_t)length < reply_size) {
+            resize_stats_format(state, reply + length, reply_size - length);
+            length += strlen(reply + length);
+        }
+        if (length > 0 && (size_t)length + 2 < reply_size) {
+            strcpy(reply + length, "; ");
+            anim_stats_format(state, reply + length + 2, reply_size - length - 2);
+        }
+    } else if (strcmp(command, "quit") == 0 && argc == 1) {
+        return false;
+    } else {
+        snprintf(reply, reply_size, "error: unknown command %s", command);
+    }
+    return true;
+}
+
+/* Sets the control socket and connections up in `fds` for the next poll. The
+ * socket is only polled while there is room to accept another connection. */
+static void control_poll_fds(struct client_state* state, struct pollfd* fds) {
+    fds[0] = (struct pollfd){ .fd = -1, .events = POLLIN };
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+        int fd = state->control_clients[i].fd;
+        fds[1 + i] = (struct pollfd){ .fd = fd, .events = POLLIN };
+        if (fd < 0)
+            fds[0].fd = state->control_fd;
+    }
+}
+
+/* Reads what arrived on the control connections polled in `fds`, answering
+ * the requests that are in and dropping clients that took too long, then
+ * accepts a new connection. Returns false on quit. */
+static bool serve_control(struct client_state* state, const struct pollfd* fds, double now) {
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+        struct control_client* client = &state->control_clients[i];
+        if (client->fd < 0)
+            continue;
+        char* words[CONTROL_MAX_WORDS];
+        int word_count;
+        enum control_read status = CONTROL_READ_PENDING;
+        if (fds[1 + i].revents != 0)
+            status = control_read(client, words, &word_count);
+        if (status == CONTROL_READ_PENDING && now - client->accepted >= CONTROL_TIMEOUT_MS)
+            control_reply(client, "error: request timed out");
+        if (status != CONTROL_READ_DONE)
+            continue;
+
+        char reply[CONTROL_MAX_REPLY];
+        bool running = daemon_command(state, word_count, words, reply, sizeof(reply));
+        control_reply(client, reply);
+        if (!running)
+            return false;
+    }
+
+    if (fds[0].revents & POLLIN) {
+        for (int i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+            struct control_client* client = &state->control_clients[i];
+            if (client->fd >= 0)
+                continue;
+            if (control_accept(state->control_fd, client))
+                client->accepted = now;
+            break;
+        }
+    }
+    return true;
+}
+
+/* How long to wait before the first control connection times out, -1 when
+ * none is pending */
+static int control_timeout(const struct client_state* state, double now) {
+    double wait = -1;
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; ++i) {
+        const struct control_client* client = &state->control_clients[i];
+        if (client->fd < 0)
+            continue;
+        double until = client->accepted + CONTROL_TIMEOUT_MS - now;
+        if (until < 0)
+            until = 0;
+        if (wait < 0 || until < wait)
+            wait = until;
+    }
+    return wait < 0 ? -1 : (int)ceil(wait);
+}
+
+/* How long to wait for events before an animation's next frame is due, -1
+ * when none is waiting on the clock alone. Animations whose frame callback
+ * hasn't come yet wait on the compositor instead. */
+static int frame_timeout(struct client_state* state, double now) {
+    double wait = -1;
+    for (int i = 0; i < MAX_OVERLAYS; ++i) {
+        struct overlay* overlay = &state->overlays[i];
+        if (overlay->wl_surface == NULL || !overlay->visible || !overlay->frame_ready)
+            continue;
+        double until = overlay->frame_due > now ? overlay->frame_due - now : 0;
+        if (wait < 0 || until < wait)
+            wait = until;
+    }
+    /* rounded up, waking early would only wait again */
+    return wait < 0 ? -1 : (int)ceil(wait);
+}
+
+/* Dispatches Wayland events and control requests, polling ourselves rather
+ * than through wl_display_dispatch so signals interrupt the wait. They are
+ * only unblocked during it. The wait
+ * ends when an animation's next frame is due, or a control connection times
+ * out. Control requests are read as they come in, so a slow client doesn't
+ * hold the overlays up. Returns on SIGINT or SIGTERM. */
+static void run(struct client_state* state) {
+    struct pollfd fds[2 + CONTROL_MAX_CLIENTS] = {
+        { .fd = wl_display_get_fd(state->wl_display), .events = POLLIN },
+    };
+    nfds_t count = state->control_fd >= 0 ? 2 + CONTROL_MAX_CLIENTS : 1;
+
+    while (exit_signal == 0) {
+        while (wl_display_prepare_read(state->wl_display) != 0) {
+            if (wl_display_dispatch_pending(state->wl_display) < 0)
+                return;
+        }
+        wl_display_flush(state->wl_display);
+
+        double now = now_ms();
+        int timeout = frame_timeout(state, now);
+        if (count > 1) {
+            control_poll_fds(state, &fds[1]);
+            int control = control_timeout(state, now);
+            if (timeout < 0 || (control >= 0 && control < timeout))
+                timeout = control;
+        }
+        struct timespec wait = { timeout / 1000, (long)(timeout % 1000) * 1000000 };
+        int ret = ppoll(fds, count, timeout >= 0 ? &wait : NULL, &state->wait_mask);
+        if (ret < 0) {
+            wl_display_cancel_read(state->wl_display);
+            if (errno != EINTR) {
+                printf("[lwr] error: poll failed: %s\n", strerror(errno));
+                return;
+            }
+        } else if (!(fds[0].revents & POLLIN)) {
+            wl_display_cancel_read(state->wl_display);
+        } else if (wl_display_read_events(state->wl_display) < 0) {
+            printf("[lwr] error: lost connection to the compositor\n");
+            return;
+        }
+
+        if (wl_display_dispatch_pending(state->wl_display) < 0)
+            return;
+
+        now = now_ms();
+        for (int i = 0; i < MAX_OVERLAYS; ++i) {
+            if (state->overlays[i].wl_surface != NULL)
+                animate(&state->overlays[i], now);
+        }
+
+        if (count > 1) {
+            /* an interrupted poll leaves revents as they were */
+            for (nfds_t i = 1; ret < 0 && i < count; ++i)
+                fds[i].revents = 0;
+            if (!serve_control(state, &fds[1], now))
+                return;
+        }
+
+        if (reload_requested) {
+            reload_requested = 0;
+            reload(state);
+        }
+    }
+    printf("[lwr] received signal %d\n[lwr] exiting\n", (int)exit_signal);
+}
+
+/* The thin client, sends argv to the daemon as one request */
+static int send_command(int argc, char* argv[]) {
+    /* the daemon has its own working directory */
+    char path[PATH_MAX];
+    if (argc >= 2 && (strcmp(argv[0], "show") == 0 || strcmp(argv[0], "swap") == 0)) {
+        if (realpath(argv[1], path) == NULL) {
+            printf("[lwr] error: file %s does not exist\n", argv[1]);
+            return 1;
+        }
+        argv[1] = path;
+    }
+    return control_send(argc, argv) ? 0 : 1;
+}
+
+/* Writes an image out baked, at its own size unless sizes are given */
+static int bake_command(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("[lwr] error: --bake needs an image and an output path\n");
+        return 1;
+    }
+    struct bake_size sizes[BAKE_MAX_LEVELS];
+    int count = argc - 2;
+    if (count > BAKE_MAX_LEVELS) {
+        printf("[lwr] error: a baked image holds at most %d sizes\n", BAKE_MAX_LEVELS);
+        return 1;
+    }
+    for (int i = 0; i < count; ++i) {
+        const char* size = argv[i + 2];
+        int end = 0;
+        if (sscanf(size, "%dx%d%n", &sizes[i].width, &sizes[i].height, &end) != 2 ||
+            size[end] != '\0') {
+            printf("[lwr] error: invalid size %s, expected <width>x<height>\n", size);
+            return 1;
+        }
+    }
+
+    struct image image = { 0 };
+    if (!decode_image(&image, argv[0]))
+        return 1;
+    resize_init(0);
+    if (count == 0) {
+        sizes[0] = (struct bake_size){ image.width, image.height };
+        count = 1;
+    }
+    /* animated images are baked as their first frame */
+    bool written =
+        bake_write(argv[1], image.data, image.width, image.height, image.opaque, sizes, count);
+    free_frames(&image);
+    resize_finish();
+    if (!written)
+        return 1;
+    printf("[lwr] baked %s into %s\n", argv[0], argv[1]);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc >= 2 && (strcmp(argv[1], "-c") == 0 || strcmp(argv[1], "--send") == 0))
+        return send_command(argc - 2, argv + 2);
+    if (argc >= 2 && (strcmp(argv[1], "-b") == 0 || strcmp(argv[1], "--bake") == 0))
+        return bake_command(argc - 2, argv + 2);
+
+    args_t args = args_parse(argc, argv);
+
+    struct client_state state = { 0 };
+    g_state = &state;
+    state.start_time = now_ms();
+    state.control_fd = -1;
+    for (int i = 0; i < CONTROL_MAX_CLIENTS; ++i)
+        state.control_clients[i].fd = -1;
+
+    // register signal handler
+    if (!set_signal_handler(SIGINT, signal_exit) || !set_signal_handler(SIGTERM, signal_exit) ||
+        !set_signal_handler(SIGUSR1, signal_reload)) {
+        printf("[lwr] error: unable to register signal handler\n");
+        exit(1);
+    }
+    /* only delivered while run() waits, so none comes between checking the
+     * flags and waiting. Threads started from here on inherit the mask. */
+    sigset_t handled;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &handled, &state.wait_mask);
+
+    resize_init(args.threads);
+    state.mipmaps = args.mipmaps;
+    state.anim_memory = (size_t)args.anim_memory << 20;
+    cache_open(&state.cache, (uint64_t)args.cache_size << 20);
+    /* decode while connecting, the overlay only needs the size up front */
+    if (!args.daemon)
+        prefetch_image(&state, args.image_path);
+
+    state.wl_display = wl_display_connect(NULL);
+    if (state.wl_display == NULL) {
+        printf("[lwr] error: unable to connect to the wayland display\n");
+        exit(1);
+    }
+    state.wl_registry = wl_display_get_registry(state.wl_display);
+    wl_registry_add_listener(state.wl_registry, &wl_registry_listener, &state);
+    wl_display_roundtrip(state.wl_display);
+    /* second roundtrip for the events of the globals bound above */
+    wl_display_roundtrip(state.wl_display);
+    printf("[lwr] connected after %.3f ms\n", now_ms() - state.start_time);
+
+    pool_init(&state.pool, state.wl_shm, args.backend, args.shm_flags);
 
-    while (wl_display_dispatch(state.wl_display)) {
-        /* This space deliberately left blank */
+    if (args.daemon) {
+        if (!control_socket_path(state.control_path, sizeof(state.control_path)))
+            exit(1);
+        state.control_fd = control_listen(state.control_path);
+        if (state.control_fd < 0)
+            exit(1);
+        printf("[lwr] listening on %s\n", state.control_path);
+    } else if (!show(&state, &args)) {
+        exit(1);
     }
 
+    run(&state);
+    cleanup();
+
     return 0;
 }
@@ -0,0 +1,308 @@
+#define _POSIX_C_SOURCE 200112L
+#include "pool.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Slot offsets are kept cache line aligned so the converters never straddle */
+#define POOL_ALIGN 64
+
+static void wl_buffer_release(void* data, struct wl_buffer* wl_buffer) {
+    (void)wl_buffer;
+    /* Sent by the compositor when it's no longer using this buffer */
+    struct pool_buffer* buffer = data;
+    buffer->busy = false;
+}
+
+static const struct wl_buffer_listener wl_buffer_listener = {
+    .release = wl_buffer_release,
+};
+
+void pool_init(
+    struct pool* pool,
+    struct wl_shm* wl_shm,
+    enum shm_backend backend,
+    unsigned shm_flags
+) {
+    memset(pool, 0, sizeof(*pool));
+    pool->wl_shm = wl_shm;
+    pool->backend = backend;
+    pool->shm_flags = shm_flags;
+    pool->shm.fd = -1;
+}
+
+void pool_init_file(
+    struct pool* pool,
+    struct wl_shm* wl_shm,
+    int fd,
+    uint8_t* data,
+    size_t size
+) {
+    pool_init(pool, wl_shm, SHM_BACKEND_SHM_OPEN, 0);
+    pool->shm.fd = fd;
+    pool->shm.data = data;
+    pool->shm.size = size;
+    if (fd >= 0)
+        pool->wl_shm_pool = wl_shm_create_pool(wl_shm, fd, size);
+    pool->size = size;
+    /* nothing is ever allocated from it */
+    pool->used = size;
+}
+
+void pool_finish(struct pool* pool) {
+    for (int i = 0; i < pool->buffer_count; ++i) {
+        if (pool->buffers[i].wl_buffer != NULL)
+            wl_buffer_destroy(pool->buffers[i].wl_buffer);
+    }
+    if (pool->wl_shm_pool != NULL)
+        wl_shm_pool_destroy(pool->wl_shm_pool);
+    shm_file_close(&pool->shm);
+    pool_init(pool, pool->wl_shm, pool->backend, pool->shm_flags);
+}
+
+/* Makes sure the backing memory is at least `size` bytes, creating it on first
+ * use. Existing wl_buffers stay valid since they only refer to offsets. */
+static bool pool_reserve(struct pool* pool, size_t size) {
+    if (size <= pool->size)
+        return true;
+
+    if (pool->shm.fd < 0) {
+        if (!shm_file_open(&pool->shm, pool->backend, pool->shm_flags))
+            return false;
+        printf("[lwr] pool: backed by %s\n", shm_backend_name(pool->shm.backend));
+    }
+    if (!shm_file_grow(&pool->shm, size))
+        return false;
+
+    size = pool->shm.size;
+    if (size > INT32_MAX) {
+        printf("[lwr] error: pool size %zu exceeds wl_shm limits\n", size);
+        return false;
+    }
+
+    if (pool->wl_shm_pool == NULL) {
+        pool->wl_shm_pool = wl_shm_create_pool(pool->wl_shm, pool->shm.fd, size);
+    } else {
+        wl_shm_pool_resize(pool->wl_shm_pool, size);
+    }
+
+    printf("[lwr] pool: %zu -> %zu bytes\n", pool->size, size);
+    pool->size = size;
+    ++pool->stats.allocations;
+    return true;
+}
+
+static void pool_buffer_create(
+    struct pool_buffer* buffer,
+    int32_t width,
+    int32_t height,
+    int32_t stride,
+    uint32_t format
+) {
+    struct pool* pool = buffer->pool;
+    if (buffer->wl_buffer != NULL)
+        wl_buffer_destroy(buffer->wl_buffer);
+
+    buffer->width = width;
+    buffer->height = height;
+    buffer->stride = stride;
+    buffer->format = format;
+    buffer->wl_buffer = NULL;
+    /* a file pool kept from the compositor is only read */
+    if (pool->wl_shm_pool == NULL)
+        return;
+    buffer->wl_buffer = wl_shm_pool_create_buffer(
+        pool->wl_shm_pool,
+        buffer->offset,
+        width,
+        height,
+        buffer->stride,
+        format
+    );
+    wl_buffer_add_listener(buffer->wl_buffer, &wl_buffer_listener, buffer);
+    ++pool->stats.buffer_creations;
+}
+
+/* Whether idle `a` should be recycled before `b`: buffers whose contents were
+ * dropped first, then the least recently used */
+static bool recycle_first(const struct pool_buffer* a, const struct pool_buffer* b) {
+    bool a_empty = pool_key_empty(&a->key);
+    bool b_empty = pool_key_empty(&b->key);
+    if (a_empty != b_empty)
+        return a_empty;
+    return a->last_used < b->last_used;
+}
+
+struct pool_buffer* pool_acquire(
+    struct pool* pool,
+    const struct pool_key* key,
+    int32_t width,
+    int32_t height,
+    uint32_t format
+) {
+    size_t needed = (size_t)width * height * 4;
+    struct pool_buffer* keyed = NULL;
+    struct pool_buffer* same = NULL;
+    struct pool_buffer* fit = NULL;
+    struct pool_buffer* small = NULL;
+
+    for (int i = 0; i < pool->buffer_count; ++i) {
+        struct pool_buffer* buffer = &pool->buffers[i];
+        if (buffer->busy)
+            continue;
+        bool same_layout =
+            buffer->width == width && buffer->height == height && buffer->format == format;
+        if (same_layout && pool_key_equal(&buffer->key, key)) {
+            if (keyed == NULL || buffer->generation > keyed->generation)
+                keyed = buffer;
+        } else if (same_layout) {
+            if (same == NULL || recycle_first(buffer, same))
+                same = buffer;
+        } else if (buffer->capacity >= needed) {
+            if (fit == NULL || recycle_first(buffer, fit))
+                fit = buffer;
+        } else if (small == NULL || recycle_first(buffer, small)) {
+            small = buffer;
+        }
+    }
+
+    if (keyed != NULL) {
+        ++pool->stats.reuses;
+        keyed->busy = true;
+        keyed->last_used = ++pool->clock;
+        return keyed;
+    }
+
+    /* contents are kept for reuse until every slot is taken */
+    bool room = pool->buffer_count < POOL_MAX_BUFFERS;
+    if (room && same != NULL && !pool_key_empty(&same->key))
+        same = NULL;
+    if (room && fit != NULL && !pool_key_empty(&fit->key))
+        fit = NULL;
+
+    if (same != NULL) {
+        ++pool->stats.reuses;
+        fit = same;
+    } else {
+        if (fit == NULL && !room) {
+            /* every idle slot is too small, the one to recycle gets memory at
+             * the end of the pool, growing in place when it already ends it */
+            if (small == NULL) {
+                printf("[lwr] error: all %d pool buffers are busy\n", POOL_MAX_BUFFERS);
+                return NULL;
+            }
+            size_t offset = (pool->used + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+            if (small->offset + small->capacity == pool->used)
+                offset = small->offset;
+            if (!pool_reserve(pool, offset + needed))
+                return NULL;
+            small->offset = offset;
+            small->capacity = needed;
+            pool->used = offset + needed;
+            fit = small;
+        }
+
+        if (fit == NULL) {
+            size_t offset = (pool->used + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+            if (!pool_reserve(pool, offset + needed))
+                return NULL;
+            fit = &pool->buffers[pool->buffer_count++];
+            fit->pool = pool;
+            fit->offset = offset;
+            fit->capacity = needed;
+            pool->used = offset + needed;
+        }
+
+        pool_buffer_create(fit, width, height, width * 4, format);
+    }
+
+    fit->busy = true;
+    fit->key = *key;
+    fit->generation = 0;
+    fit->last_used = ++pool->clock;
+    fit->opaque.count = 0;
+    return fit;
+}
+
+struct pool_buffer* pool_add_buffer(
+    struct pool* pool,
+    size_t offset,
+    int32_t width,
+    int32_t height,
+    int32_t stride,
+    uint32_t format
+) {
+    if (pool->buffer_count == POOL_MAX_BUFFERS) {
+        printf("[lwr] error: all %d pool buffers are taken\n", POOL_MAX_BUFFERS);
+        return NULL;
+    }
+    struct pool_buffer* buffer = &pool->buffers[pool->buffer_count++];
+    pool_buffer_init(pool, buffer, offset, width, height, stride, format);
+    return buffer;
+}
+
+void pool_buffer_init(
+    struct pool* pool,
+    struct pool_buffer* buffer,
+    size_t offset,
+    int32_t width,
+    int32_t height,
+    int32_t stride,
+    uint32_t format
+) {
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->pool = pool;
+    buffer->offset = offset;
+    buffer->capacity = (size_t)stride * height;
+    pool_buffer_create(buffer, width, height, stride, format);
+    buffer->last_used = ++pool->clock;
+}
+
+void pool_buffer_finish(struct pool_buffer* buffer) {
+    if (buffer->wl_buffer != NULL)
+        wl_buffer_destroy(buffer->wl_buffer);
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+struct pool_buffer*
+pool_lookup(struct pool* pool, const struct pool_key* key, uint64_t generation) {
+    if (pool_key_empty(key) || generation == 0)
+        return NULL;
+    for (int i = 0; i < pool->buffer_count; ++i) {
+        struct pool_buffer* buffer = &pool->buffers[i];
+        if (!pool_key_equal(&buffer->key, key) || buffer->generation != generation)
+            continue;
+        ++pool->stats.hits;
+        buffer->busy = true;
+        buffer->last_used = ++pool->clock;
+        return buffer;
+    }
+    return NULL;
+}
+
+void pool_release(struct pool_buffer* buffer) {
+    buffer->busy = false;
+    buffer->key = (struct pool_key){ 0 };
+    buffer->generation = 0;
+}
+
+void pool_return(struct pool_buffer* buffer) {
+    buffer->busy = false;
+}
+
+uint8_t* pool_buffer_data(struct pool_buffer* buffer) {
+    return buffer->pool->shm.data + buffer->offset;
+}
+
+void pool_print_stats(const struct pool* pool) {
+    printf(
+        "[lwr] pool: %zu bytes, %d buffers, %lu allocations, %lu buffer creations, "
+        "%lu reuses, %lu hits\n",
+        pool->size,
+        pool->buffer_count,
+        pool->stats.allocations,
+        pool->stats.buffer_creations,
+        pool->stats.reuses,
+        pool->stats.hits
+    );
+}
@@ -0,0 +1,159 @@
+#ifndef LWR_POOL_H
+#define LWR_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <wayland-client.h>
+
+#include "region.h"
+#include "shm.h"
+
+/* Upper bound on live wl_buffers per pool. Double buffering only ever needs
+ * two, the rest keeps already drawn contents around for reuse. */
+#define POOL_MAX_BUFFERS 8
+
+/* Caller-chosen identity of a buffer's contents, the fields themselves rather
+ * than a hash of them so different contents never pass for each other. All
+ * zero when there are none. */
+#define POOL_KEY_FIELDS 10
+
+struct pool_key {
+    uint64_t fields[POOL_KEY_FIELDS];
+};
+
+static inline bool pool_key_equal(const struct pool_key* a, const struct pool_key* b) {
+    return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+static inline bool pool_key_empty(const struct pool_key* key) {
+    return pool_key_equal(key, &(struct pool_key){ 0 });
+}
+
+struct pool;
+
+struct pool_buffer {
+    struct pool* pool;
+    struct wl_buffer* wl_buffer;
+    size_t offset;
+    size_t capacity;
+    int32_t width;
+    int32_t height;
+    int32_t stride;
+    uint32_t format;
+    /* set from acquire until the compositor sends wl_buffer.release */
+    bool busy;
+    struct pool_key key;
+    /* caller-chosen version of the keyed contents, 0 when unknown */
+    uint64_t generation;
+    uint64_t last_used;
+    struct region opaque;
+};
+
+struct pool_stats {
+    /* backing memory created or grown */
+    unsigned long allocations;
+    /* wl_buffers created on top of existing memory */
+    unsigned long buffer_creations;
+    /* acquires served by an idle buffer of the right size and format */
+    unsigned long reuses;
+    /* lookups served by a buffer that already had the requested contents */
+    unsigned long hits;
+};
+
+struct pool {
+    struct wl_shm* wl_shm;
+    struct wl_shm_pool* wl_shm_pool;
+    enum shm_backend backend;
+    unsigned shm_flags;
+    struct shm_file shm;
+    /* bytes shared with the compositor */
+    size_t size;
+    size_t used;
+    struct pool_buffer buffers[POOL_MAX_BUFFERS];
+    int buffer_count;
+    uint64_t clock;
+    struct pool_stats stats;
+};
+
+/* The backing memory is created on `backend` with the SHM_* `shm_flags` on
+ * first use */
+void pool_init(
+    struct pool* pool,
+    struct wl_shm* wl_shm,
+    enum shm_backend backend,
+    unsigned shm_flags
+);
+/* Shares a file whose contents are final, such as a baked image, as a pool to
+ * add buffers to. The pool takes over `fd` and the mapping of its `size`
+ * bytes at `data`, and never allocates from it. With `fd` -1 nothing is shared
+ * and its buffers have no wl_buffer, their contents are only there to copy. */
+void pool_init_file(
+    struct pool* pool,
+    struct wl_shm* wl_shm,
+    int fd,
+    uint8_t* data,
+    size_t size
+);
+void pool_finish(struct pool* pool);
+
+/* Returns an idle buffer of the given size and format, marked busy and tagged
+ * with `key`. An idle buffer already tagged `key` is preferred, newest
+ * generation first, and keeps its generation so the caller can update only
+ * what changed since. Otherwise idle buffers whose contents were dropped are
+ * recycled with generation 0, then a slot is added while there is room, and
+ * only once every slot is taken are other contents recycled, least recently
+ * used first. When none of them is large enough, the one to recycle gets
+ * memory of its own at the end of the pool. */
+struct pool_buffer* pool_acquire(
+    struct pool* pool,
+    const struct pool_key* key,
+    int32_t width,
+    int32_t height,
+    uint32_t format
+);
+
+/* Creates a buffer over contents already at `offset` in a file pool, with no
+ * key and generation 0 */
+struct pool_buffer* pool_add_buffer(
+    struct pool* pool,
+    size_t offset,
+    int32_t width,
+    int32_t height,
+    int32_t stride,
+    uint32_t format
+);
+
+/* Like pool_add_buffer, for a buffer the caller keeps rather than the pool,
+ * so a file pool can back any number of them. Buffers made this way are not
+ * found by lookups and must be finished before the pool. */
+void pool_buffer_init(
+    struct pool* pool,
+    struct pool_buffer* buffer,
+    size_t offset,
+    int32_t width,
+    int32_t height,
+    int32_t stride,
+    uint32_t format
+);
+void pool_buffer_finish(struct pool_buffer* buffer);
+
+/* Returns the buffer whose contents are tagged `key` at `generation`, marked
+ * busy, or NULL. A buffer that is still attached may be returned, since
+ * reattaching unchanged contents is harmless. */
+struct pool_buffer*
+pool_lookup(struct pool* pool, const struct pool_key* key, uint64_t generation);
+
+/* Hands a buffer back without it having been attached, dropping its contents */
+void pool_release(struct pool_buffer* buffer);
+
+/* Hands a buffer back without it having been attached, keeping its contents
+ * for later lookups and keyed acquires */
+void pool_return(struct pool_buffer* buffer);
+
+uint8_t* pool_buffer_data(struct pool_buffer* buffer);
+
+void pool_print_stats(const struct pool* pool);
+
+#endif
@@ -0,0 +1,282 @@
+#include "region.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+
+struct rect rect_union(struct rect a, struct rect b) {
+    if (rect_empty(a))
+        return b;
+    if (rect_empty(b))
+        return a;
+    int32_t x0 = a.x < b.x ? a.x : b.x;
+    int32_t y0 = a.y < b.y ? a.y : b.y;
+    int32_t x1 = a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width;
+    int32_t y1 = a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height;
+    return (struct rect){ x0, y0, x1 - x0, y1 - y0 };
+}
+
+struct rect rect_intersect(struct rect a, struct rect b) {
+    int32_t x0 = a.x > b.x ? a.x : b.x;
+    int32_t y0 = a.y > b.y ? a.y : b.y;
+    int32_t x1 = a.x + a.width < b.x + b.width ? a.x + a.width : b.x + b.width;
+    int32_t y1 = a.y + a.height < b.y + b.height ? a.y + a.height : b.y + b.height;
+    if (x1 <= x0 || y1 <= y0)
+        return (struct rect){ 0 };
+    return (struct rect){ x0, y0, x1 - x0, y1 - y0 };
+}
+
+static int64_t rect_area(struct rect r) {
+    return rect_empty(r) ? 0 : (int64_t)r.width * r.height;
+}
+
+/* Touching counts as well, two adjacent strips are better sent as one */
+static bool rect_touches(struct rect a, struct rect b) {
+    return a.x <= b.x + b.width && b.x <= a.x + a.width && a.y <= b.y + b.height &&
+           b.y <= a.y + a.height;
+}
+
+void region_clear(struct region* region) {
+    region->count = 0;
+}
+
+void region_add(struct region* region, struct rect r) {
+    if (rect_empty(r))
+        return;
+
+    /* absorb everything r touches, which may make it touch more */
+    bool merged;
+    do {
+        merged = false;
+        for (int i = 0; i < region->count; ++i) {
+            if (!rect_touches(region->rects[i], r))
+                continue;
+            r = rect_union(region->rects[i], r);
+            region->rects[i] = region->rects[--region->count];
+            merged = true;
+            break;
+        }
+    } while (merged);
+
+    if (region->count < REGION_MAX_RECTS) {
+        region->rects[region->count++] = r;
+        return;
+    }
+
+    /* full: merge r into whichever rect grows the least */
+    int best = 0;
+    int64_t best_waste = INT64_MAX;
+    for (int i = 0; i < region->count; ++i) {
+        struct rect u = rect_union(region->rects[i], r);
+        int64_t waste = rect_area(u) - rect_area(region->rects[i]) - rect_area(r);
+        if (waste < best_waste) {
+            best = i;
+            best_waste = waste;
+        }
+    }
+    r = rect_union(region->rects[best], r);
+    region->rects[best] = region->rects[--region->count];
+    region_add(region, r);
+}
+
+void region_union(struct region* dst, const struct region* src) {
+    for (int i = 0; i < src->count; ++i)
+        region_add(dst, src->rects[i]);
+}
+
+void region_scale(
+    struct region* dst,
+    const struct region* src,
+    int32_t src_width,
+    int32_t src_height,
+    int32_t dst_width,
+    int32_t dst_height,
+    int32_t margin
+) {
+    struct rect bounds = { 0, 0, dst_width, dst_height };
+    region_clear(dst);
+    for (int i = 0; i < src->count; ++i) {
+        const struct rect* r = &src->rects[i];
+        int64_t x0 = (int64_t)r->x * dst_width / src_width - margin;
+        int64_t y0 = (int64_t)r->y * dst_height / src_height - margin;
+        int64_t x1 = ((int64_t)(r->x + r->width) * dst_width + src_width - 1) / src_width;
+        int64_t y1 = ((int64_t)(r->y + r->height) * dst_height + src_height - 1) / src_height;
+        x1 += margin;
+        y1 += margin;
+        struct rect scaled = {
+            (int32_t)x0,
+            (int32_t)y0,
+            (int32_t)(x1 - x0),
+            (int32_t)(y1 - y0),
+        };
+        region_add(dst, rect_intersect(scaled, bounds));
+    }
+}
+
+/* Rows are compared in bands of this height, each band that differs adds the
+ * bounding box of its differences */
+#define DIFF_BAND 32
+
+void region_diff(
+    struct region* region,
+    const uint8_t* a,
+    const uint8_t* b,
+    int32_t width,
+    int32_t height,
+    int32_t stride
+) {
+    region_clear(region);
+    for (int32_t band = 0; band < height; band += DIFF_BAND) {
+        int32_t band_end = band + DIFF_BAND < height ? band + DIFF_BAND : height;
+        int32_t x0 = width, x1 = 0, y0 = band_end, y1 = band;
+        for (int32_t y = band; y < band_end; ++y) {
+            int32_t left, right;
+            const uint8_t* row_a = a + (size_t)y * stride;
+            const uint8_t* row_b = b + (size_t)y * stride;
+            if (!convert_diff_row(row_a, row_b, width, &left, &right))
+                continue;
+            x0 = left < x0 ? left : x0;
+            x1 = right + 1 > x1 ? right + 1 : x1;
+            y0 = y < y0 ? y : y0;
+            y1 = y + 1;
+        }
+        if (x1 > x0)
+            region_add(region, (struct rect){ x0, y0, x1 - x0, y1 - y0 });
+    }
+}
+
+void damage_init(struct damage* damage) {
+    memset(damage, 0, sizeof(*damage));
+    damage->generation = 1;
+}
+
+void damage_push(struct damage* damage, const struct region* changed) {
+    ++damage->generation;
+    damage->changes[damage->generation % DAMAGE_HISTORY] = *changed;
+}
+
+bool damage_since(const struct damage* damage, uint64_t generation, struct region* out) {
+    region_clear(out);
+    if (generation == 0 || generation > damage->generation ||
+        damage->generation - generation >= DAMAGE_HISTORY)
+        return false;
+    for (uint64_t g = generation + 1; g <= damage->generation; ++g)
+        region_union(out, &damage->changes[g % DAMAGE_HISTORY]);
+    return true;
+}
+
+/* Largest rectangle of set tiles in the grid, using the usual histogram and
+ * stack walk per row. Sizes are in tiles. */
+static struct rect largest_rect(
+    const uint8_t* grid,
+    int32_t columns,
+    int32_t rows,
+    int32_t* heights,
+    int32_t* stack
+) {
+    struct rect best = { 0 };
+    int64_t best_area = 0;
+
+    for (int32_t x = 0; x < columns; ++x)
+        heights[x] = 0;
+
+    for (int32_t y = 0; y < rows; ++y) {
+        for (int32_t x = 0; x < columns; ++x)
+            heights[x] = grid[y * columns + x] ? heights[x] + 1 : 0;
+
+        int32_t top = 0;
+        for (int32_t x = 0; x <= columns; ++x) {
+            int32_t h = x < columns ? heights[x] : 0;
+            while (top > 0 && heights[stack[top - 1]] >= h) {
+                int32_t rect_height = heights[stack[--top]];
+                int32_t left = top > 0 ? stack[top - 1] + 1 : 0;
+                int64_t area = (int64_t)(x - left) * rect_height;
+                if (area > best_area) {
+                    best = (struct rect){
+                        .x = left,
+                        .y = y - rect_height + 1,
+                        .width = x - left,
+                        .height = rect_height,
+                    };
+                    best_area = area;
+                }
+            }
+            stack[top++] = x;
+        }
+    }
+    return best;
+}
+
+int region_find_opaque(
+    const uint8_t* data,
+    int32_t width,
+    int32_t height,
+    int32_t stride,
+    int64_t min_area,
+    struct rect* rects,
+    int max_rects
+) {
+    int32_t columns = (width + REGION_TILE - 1) / REGION_TILE;
+    int32_t rows = (height + REGION_TILE - 1) / REGION_TILE;
+    if (columns == 0 || rows == 0)
+        return 0;
+
+    uint8_t* grid = malloc((size_t)columns * rows);
+    int32_t* heights = malloc(sizeof(int32_t) * columns);
+    int32_t* stack = malloc(sizeof(int32_t) * (columns + 1));
+    if (grid == NULL || heights == NULL || stack == NULL) {
+        printf("[lwr] error: unable to allocate opaque region grid\n");
+        free(grid);
+        free(heights);
+        free(stack);
+        return 0;
+    }
+
+    /* a tile stays set only while every row span inside it is opaque */
+    for (int32_t i = 0; i < columns * rows; ++i)
+        grid[i] = 1;
+    for (int32_t y = 0; y < height; ++y) {
+        const uint8_t* row = data + (size_t)y * stride;
+        uint8_t* grid_row = grid + (size_t)(y / REGION_TILE) * columns;
+        for (int32_t column = 0; column < columns; ++column) {
+            if (!grid_row[column])
+                continue;
+            int32_t x = column * REGION_TILE;
+            int32_t span = width - x < REGION_TILE ? width - x : REGION_TILE;
+            grid_row[column] = convert_is_opaque(row + (size_t)x * 4, span);
+        }
+    }
+
+    int count = 0;
+    while (count < max_rects) {
+        struct rect tiles = largest_rect(grid, columns, rows, heights, stack);
+        if (tiles.width == 0)
+            break;
+
+        struct rect r = {
+            .x = tiles.x * REGION_TILE,
+            .y = tiles.y * REGION_TILE,
+            .width = tiles.width * REGION_TILE,
+            .height = tiles.height * REGION_TILE,
+        };
+        if (r.x + r.width > width)
+            r.width = width - r.x;
+        if (r.y + r.height > height)
+            r.height = height - r.y;
+        if ((int64_t)r.width * r.height < min_area)
+            break;
+        rects[count++] = r;
+
+        for (int32_t y = tiles.y; y < tiles.y + tiles.height; ++y) {
+            for (int32_t x = tiles.x; x < tiles.x + tiles.width; ++x)
+                grid[y * columns + x] = 0;
+        }
+    }
+
+    free(grid);
+    free(heights);
+    free(stack);
+    return count;
+}
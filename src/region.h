@@ -0,0 +1,100 @@
+#ifndef LWR_REGION_H
+#define LWR_REGION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct rect {
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+};
+
+/* A small set of disjoint rectangles, enough to describe the opaque or damaged
+ * parts of a buffer without handing the compositor hundreds of boxes */
+#define REGION_MAX_RECTS 4
+
+struct region {
+    struct rect rects[REGION_MAX_RECTS];
+    int count;
+};
+
+struct rect rect_union(struct rect a, struct rect b);
+struct rect rect_intersect(struct rect a, struct rect b);
+
+static inline bool rect_empty(struct rect r) {
+    return r.width <= 0 || r.height <= 0;
+}
+
+void region_clear(struct region* region);
+
+/* Adds a rectangle, merging it with the ones it touches. Once the set is full
+ * the pair whose bounding box wastes the least area is merged, so the region
+ * only ever grows to cover more than what was added, never less. */
+void region_add(struct region* region, struct rect r);
+void region_union(struct region* dst, const struct region* src);
+
+/* Maps a region from a src_width x src_height grid onto dst_width x
+ * dst_height, growing each rectangle by `margin` destination pixels for the
+ * filter footprint and clipping to the destination. */
+void region_scale(
+    struct region* dst,
+    const struct region* src,
+    int32_t src_width,
+    int32_t src_height,
+    int32_t dst_width,
+    int32_t dst_height,
+    int32_t margin
+);
+
+/* Records the rectangles that differ between two images of the same size */
+void region_diff(
+    struct region* region,
+    const uint8_t* a,
+    const uint8_t* b,
+    int32_t width,
+    int32_t height,
+    int32_t stride
+);
+
+/* Content changes are numbered by generation. Keeping what changed for the
+ * last few generations lets a buffer holding older contents be brought up to
+ * date by redrawing only the union of the changes it missed. */
+#define DAMAGE_HISTORY 8
+
+struct damage {
+    uint64_t generation;
+    struct region changes[DAMAGE_HISTORY];
+};
+
+/* Starts at generation 1, 0 is left to mean "contents unknown" */
+void damage_init(struct damage* damage);
+
+/* Starts a new generation whose changes are `changed` */
+void damage_push(struct damage* damage, const struct region* changed);
+
+/* Everything that changed after `generation`. Returns false when that is
+ * unknown, because the generation is 0 or too old, and a full redraw is
+ * needed. */
+bool damage_since(const struct damage* damage, uint64_t generation, struct region* out);
+
+/* Opaque regions are searched on a grid of REGION_TILE sized tiles, a tile
+ * only counts as opaque when all of its pixels are. */
+#define REGION_TILE 16
+
+/* Finds up to `max_rects` disjoint rectangles, largest first, that contain only
+ * fully opaque pixels of a buffer with alpha in the last byte of each pixel.
+ * Rectangles smaller than `min_area` pixels are not reported. Returns the
+ * number of rectangles written. */
+int region_find_opaque(
+    const uint8_t* data,
+    int32_t width,
+    int32_t height,
+    int32_t stride,
+    int64_t min_area,
+    struct rect* rects,
+    int max_rects
+);
+
+#endif
@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+#include "resize.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "convert.h"
+
+/* Pixels, read and written, below which a split isn't worth a thread. A
+ * quarter megapixel takes stbir around a millisecond. */
+#define RESIZE_SPLIT_WORK (1 << 18)
+
+/* Runs split `split` of `splits` of a resize, returning whether it worked */
+typedef bool (*split_fn)(void* data, int split, int splits);
+
+static struct {
+    pthread_mutex_t lock;
+    /* signalled when a resize is posted or the workers should stop */
+    pthread_cond_t start;
+    /* signalled when the last split of a resize is done */
+    pthread_cond_t done;
+    pthread_t threads[RESIZE_MAX_THREADS];
+    /* workers, not counting the thread that resizes */
+    int thread_count;
+    bool stop;
+
+    /* the resize being run, NULL in between */
+    split_fn run;
+    void* data;
+    int splits;
+    /* next split nobody has claimed yet */
+    int next;
+    /* splits not finished yet */
+    int remaining;
+    bool failed;
+} workers = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static const char* filter_names[RESIZE_FILTER_COUNT] = {
+    [RESIZE_NEAREST] = "nearest",
+    [RESIZE_BOX] = "box",
+    [RESIZE_BILINEAR] = "bilinear",
+    [RESIZE_STBIR] = "stbir",
+};
+
+const char* resize_filter_name(enum resize_filter filter) {
+    return filter < RESIZE_FILTER_COUNT ? filter_names[filter] : "unknown";
+}
+
+bool resize_filter_parse(const char* name, enum resize_filter* filter) {
+    for (int i = 0; i < RESIZE_FILTER_COUNT; ++i) {
+        if (strcmp(name, filter_names[i]) == 0) {
+            *filter = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Claims and runs splits of the current job until none are left. Called and
+ * returns with the lock held. */
+static void run_splits(void) {
+    while (workers.next < workers.splits) {
+        split_fn run = workers.run;
+        void* data = workers.data;
+        int splits = workers.splits;
+        int split = workers.next++;
+        pthread_mutex_unlock(&workers.lock);
+        bool ok = run(data, split, splits);
+        pthread_mutex_lock(&workers.lock);
+        if (!ok)
+            workers.failed = true;
+        if (--workers.remaining == 0)
+            pthread_cond_signal(&workers.done);
+    }
+}
+
+static void* worker(void* data) {
+    (void)data;
+    pthread_mutex_lock(&workers.lock);
+    for (;;) {
+        while (!workers.stop && (workers.run == NULL || workers.next == workers.splits))
+            pthread_cond_wait(&workers.start, &workers.lock);
+        if (workers.stop)
+            break;
+        run_splits();
+    }
+    pthread_mutex_unlock(&workers.lock);
+    return NULL;
+}
+
+/* Runs all `splits` of a resize, on the workers when there is more than one */
+static bool run_job(split_fn run, void* data, int splits) {
+    if (splits == 1)
+        return run(data, 0, 1);
+
+    pthread_mutex_lock(&workers.lock);
+    workers.run = run;
+    workers.data = data;
+    workers.splits = splits;
+    workers.next = 0;
+    workers.remaining = splits;
+    workers.failed = false;
+    pthread_cond_broadcast(&workers.start);
+    run_splits();
+    while (workers.remaining > 0)
+        pthread_cond_wait(&workers.done, &workers.lock);
+    workers.run = NULL;
+    bool ok = !workers.failed;
+    pthread_mutex_unlock(&workers.lock);
+    return ok;
+}
+
+void resize_init(int threads) {
+    /* the kernels are picked on first use, which isn't thread safe */
+    convert_active_level();
+    resize_finish();
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > RESIZE_MAX_THREADS)
+        threads = RESIZE_MAX_THREADS;
+
+    workers.stop = false;
+    for (int i = 0; i < threads - 1; ++i) {
+        if (pthread_create(&workers.threads[i], NULL, worker, NULL) != 0) {
+            printf("[lwr] error: unable to start resize thread, using %d\n", i + 1);
+            break;
+        }
+        ++workers.thread_count;
+    }
+}
+
+void resize_finish(void) {
+    pthread_mutex_lock(&workers.lock);
+    workers.stop = true;
+    pthread_cond_broadcast(&workers.start);
+    pthread_mutex_unlock(&workers.lock);
+    for (int i = 0; i < workers.thread_count; ++i)
+        pthread_join(workers.threads[i], NULL);
+    workers.thread_count = 0;
+}
+
+int resize_thread_count(void) {
+    return workers.thread_count + 1;
+}
+
+/* How many splits a resize is worth, from the pixels it reads and writes to
+ * fill `width` x `height` pixels of a `dst_height` rows tall output */
+static int wanted_splits(
+    int32_t src_width,
+    int32_t src_height,
+    int32_t dst_height,
+    int32_t width,
+    int32_t height
+) {
+    double written = (double)width * height;
+    /* only the input rows behind the output rows are read */
+    double read = (double)src_width * src_height * height / dst_height;
+    double splits = (written + read) / RESIZE_SPLIT_WORK;
+    int threads = resize_thread_count();
+    return splits < 1 ? 1 : splits > threads ? threads : (int)splits;
+}
+
+static bool stbir_split(void* data, int split, int splits) {
+    (void)splits;
+    return stbir_resize_extended_split(data, split, 1);
+}
+
+bool resize_run(STBIR_RESIZE* resize) {
+    int wanted = wanted_splits(
+        resize->input_w,
+        resize->input_h,
+        resize->output_h,
+        resize->output_subw,
+        resize->output_subh
+    );
+    if (wanted == 1)
+        return stbir_resize_extended(resize);
+
+    /* stbir may use fewer, it keeps splits to at least a few rows */
+    int splits = stbir_build_samplers_with_splits(resize, wanted);
+    if (splits == 0)
+        return false;
+    bool ok = run_job(stbir_split, resize, splits);
+    stbir_free_samplers(resize);
+    return ok;
+}
+
+/* Fixed-point filters */
+
+/* The source pixels behind a range of outputs along one axis, and their
+ * weights. Output i reads counts[i] pixels from starts[i] on, weighted by
+ * weights[i * taps] on. */
+struct taps {
+    int32_t* starts;
+    int32_t* counts;
+    int16_t* weights;
+    int32_t taps;
+};
+
+static void taps_free(struct taps* taps) {
+    free(taps->starts);
+    free(taps->counts);
+    free(taps->weights);
+    memset(taps, 0, sizeof(*taps));
+}
+
+static double filter_kernel(enum resize_filter filter, double x) {
+    if (filter == RESIZE_BOX)
+        return x >= -0.5 && x < 0.5 ? 1 : 0;
+    x = fabs(x);
+    return x < 1 ? 1 - x : 0;
+}
+
+/* Builds the taps of outputs `first` to `first + count` of an axis scaled
+ * from `src` to `dst` pixels */
+static bool taps_build(
+    struct taps* taps,
+    enum resize_filter filter,
+    int32_t src,
+    int32_t dst,
+    int32_t first,
+    int32_t count
+) {
+    double scale = (double)src / dst;
+    /* reducing widens the filter over every source pixel an output covers */
+    double stretch = scale > 1 ? scale : 1;
+    double support = (filter == RESIZE_BOX ? 0.5 : 1) * stretch;
+    taps->taps = (int32_t)ceil(support * 2) + 1;
+    taps->starts = malloc(count * sizeof(int32_t));
+    taps->counts = malloc(count * sizeof(int32_t));
+    taps->weights = calloc((size_t)count * taps->taps, sizeof(int16_t));
+    double* weights = malloc(taps->taps * sizeof(double));
+    if (taps->starts == NULL || taps->counts == NULL || taps->weights == NULL ||
+        weights == NULL) {
+        free(weights);
+        taps_free(taps);
+        return false;
+    }
+
+    for (int32_t i = 0; i < count; ++i) {
+        double center = (first + i + 0.5) * scale;
+        int32_t lo = (int32_t)floor(center - support + 0.5);
+        int32_t hi = (int32_t)floor(center + support + 0.5);
+        lo = lo < 0 ? 0 : lo;
+        hi = hi > src ? src : hi;
+        if (hi - lo > taps->taps)
+            hi = lo + taps->taps;
+
+        double sum = 0;
+        for (int32_t j = lo; j < hi; ++j) {
+            weights[j - lo] = filter_kernel(filter, (j + 0.5 - center) / stretch);
+            sum += weights[j - lo];
+        }
+        /* drop the pixels the filter only reaches with a zero weight */
+        while (hi > lo + 1 && weights[hi - 1 - lo] == 0)
+            --hi;
+        int32_t skip = 0;
+        while (lo + skip < hi - 1 && weights[skip] == 0)
+            ++skip;
+        if (sum == 0) {
+            /* past the image edge, take the nearest pixel */
+            skip = 0;
+            lo = center < src ? (int32_t)center : src - 1;
+            hi = lo + 1;
+            weights[0] = sum = 1;
+        }
+
+        /* round to fixed point, keeping the sum exactly one */
+        int16_t* out = taps->weights + (size_t)i * taps->taps;
+        int32_t total = 0;
+        int32_t largest = 0;
+        for (int32_t t = 0; t < hi - lo - skip; ++t) {
+            out[t] = lround(weights[skip + t] / sum * (1 << CONVERT_FILTER_BITS));
+            total += out[t];
+            if (out[t] > out[largest])
+                largest = t;
+        }
+        out[largest] += (1 << CONVERT_FILTER_BITS) - total;
+        taps->starts[i] = lo + skip;
+        taps->counts[i] = hi - lo - skip;
+    }
+    free(weights);
+    return true;
+}
+
+struct fixed_job {
+    uint8_t* dst;
+    int32_t dst_stride;
+    const uint8_t* src;
+    int32_t src_stride;
+    struct rect r;
+    /* for the nearest filter, the source column and row of each output */
+    int32_t* columns;
+    int32_t* rows;
+    /* for the others, the taps of the output columns and rows in r */
+    struct taps horizontal;
+    struct taps vertical;
+    /* for an exact reduction by 2, 4 or 8, log2 of it */
+    int halvings;
+};
+
+/* Rows `y0` to `y1` of r, in r's coordinates, of one split */
+static void split_rows(
+    const struct fixed_job* job,
+    int split,
+    int splits,
+    int32_t* y0,
+    int32_t* y1
+) {
+    *y0 = (int64_t)job->r.height * split / splits;
+    *y1 = (int64_t)job->r.height * (split + 1) / splits;
+}
+
+static bool nearest_split(void* data, int split, int splits) {
+    struct fixed_job* job = data;
+    int32_t y0, y1;
+    split_rows(job, split, splits, &y0, &y1);
+    for (int32_t y = y0; y < y1; ++y) {
+        const uint8_t* row = job->src + (size_t)job->rows[y] * job->src_stride;
+        uint8_t* out = job->dst + (size_t)(job->r.y + y) * job->dst_stride + job->r.x * 4;
+        for (int32_t x = 0; x < job->r.width; ++x)
+            memcpy(out + x * 4, row + (size_t)job->columns[x] * 4, 4);
+    }
+    return true;
+}
+
+/* Halves the split's source rows down to its output rows, the last halving
+ * writing straight into the output */
+static bool halve_split(void* data, int split, int splits) {
+    struct fixed_job* job = data;
+    int32_t y0, y1;
+    split_rows(job, split, splits, &y0, &y1);
+    int factor = 1 << job->halvings;
+    int32_t width = job->r.width * factor;
+    int32_t height = (y1 - y0) * factor;
+    const uint8_t* src = job->src + (size_t)(job->r.y + y0) * factor * job->src_stride +
+                         (size_t)job->r.x * factor * 4;
+    int32_t src_stride = job->src_stride;
+
+    uint8_t* level = NULL;
+    for (int i = 1; i < job->halvings; ++i) {
+        uint8_t* half = malloc((size_t)(width / 2) * (height / 2) * 4);
+        if (half == NULL) {
+            free(level);
+            return false;
+        }
+        convert_halve(half, width / 2 * 4, src, src_stride, width / 2, height / 2);
+        free(level);
+        src = level = half;
+        src_stride = width / 2 * 4;
+        width /= 2;
+        height /= 2;
+    }
+    convert_halve(
+        job->dst + (size_t)(job->r.y + y0) * job->dst_stride + (size_t)job->r.x * 4,
+        job->dst_stride,
+        src,
+        src_stride,
+        width / 2,
+        height / 2
+    );
+    free(level);
+    return true;
+}
+
+static bool filter_split(void* data, int split, int splits) {
+    struct fixed_job* job = data;
+    int32_t y0, y1;
+    split_rows(job, split, splits, &y0, &y1);
+
+    /* horizontally filtered source rows, kept while later output rows still
+     * need them. The rows behind one output are consecutive and at most
+     * `capacity` of them, so they never share a slot. */
+    int32_t capacity = job->vertical.taps;
+    size_t row_size = (size_t)job->r.width * 4;
+    int16_t* ring = malloc(capacity * row_size * sizeof(int16_t));
+    int32_t* held = malloc(capacity * sizeof(int32_t));
+    const int16_t** rows = malloc(capacity * sizeof(int16_t*));
+    if (ring == NULL || held == NULL || rows == NULL) {
+        free(rows);
+        free(held);
+        free(ring);
+        return false;
+    }
+    for (int32_t i = 0; i < capacity; ++i)
+        held[i] = -1;
+
+    for (int32_t y = y0; y < y1; ++y) {
+        int32_t start = job->vertical.starts[y];
+        int32_t count = job->vertical.counts[y];
+        for (int32_t t = 0; t < count; ++t) {
+            int32_t source = start + t;
+            int16_t* slot = ring + (source % capacity) * row_size;
+            if (held[source % capacity] != source) {
+                convert_filter_row(
+                    slot,
+                    job->src + (size_t)source * job->src_stride,
+                    job->r.width,
+                    job->horizontal.starts,
+                    job->horizontal.counts,
+                    job->horizontal.weights,
+                    job->horizontal.taps
+                );
+                held[source % capacity] = source;
+            }
+            rows[t] = slot;
+        }
+        convert_filter_column(
+            job->dst + (size_t)(job->r.y + y) * job->dst_stride + (size_t)job->r.x * 4,
+            rows,
+            job->vertical.weights + (size_t)y * job->vertical.taps,
+            count,
+            job->r.width
+        );
+    }
+
+    free(rows);
+    free(held);
+    free(ring);
+    return true;
+}
+
+/* log2 of an exact reduction by 2, 4 or 8 on both axes, 0 otherwise */
+static int exact_halvings(
+    int32_t src_width,
+    int32_t src_height,
+    int32_t width,
+    int32_t height
+) {
+    for (int halvings = 1; halvings <= 3; ++halvings) {
+        if (src_width == width << halvings && src_height == height << halvings)
+            return halvings;
+    }
+    return 0;
+}
+
+bool resize_fixed(
+    enum resize_filter filter,
+    uint8_t* dst,
+    int32_t dst_width,
+    int32_t dst_height,
+    int32_t dst_stride,
+    const uint8_t* src,
+    int32_t src_width,
+    int32_t src_height,
+    int32_t src_stride,
+    struct rect r
+) {
+    struct fixed_job job = {
+        .dst = dst,
+        .dst_stride = dst_stride,
+        .src = src,
+        .src_stride = src_stride,
+        .r = r,
+    };
+    if (filter == RESIZE_BOX)
+        job.halvings = exact_halvings(src_width, src_height, dst_width, dst_height);
+
+    split_fn run;
+    bool ready = true;
+    if (job.halvings > 0) {
+        run = halve_split;
+    } else if (filter == RESIZE_NEAREST) {
+        run = nearest_split;
+        job.columns = malloc(r.width * sizeof(int32_t));
+        job.rows = malloc(r.height * sizeof(int32_t));
+        ready = job.columns != NULL && job.rows != NULL;
+        /* the source pixel under the output pixel's center */
+        for (int32_t x = 0; ready && x < r.width; ++x)
+            job.columns[x] = ((int64_t)(r.x + x) * 2 + 1) * src_width / (dst_width * 2);
+        for (int32_t y = 0; ready && y < r.height; ++y)
+            job.rows[y] = ((int64_t)(r.y + y) * 2 + 1) * src_height / (dst_height * 2);
+    } else {
+        run = filter_split;
+        ready = taps_build(&job.horizontal, filter, src_width, dst_width, r.x, r.width) &&
+                taps_build(&job.vertical, filter, src_height, dst_height, r.y, r.height);
+    }
+
+    bool ok = false;
+    if (ready) {
+        int splits = wanted_splits(src_width, src_height, dst_height, r.width, r.height);
+        ok = run_job(run, &job, splits < r.height ? splits : r.height);
+    }
+
+    free(job.columns);
+    free(job.rows);
+    taps_free(&job.horizontal);
+    taps_free(&job.vertical);
+    return ok;
+}
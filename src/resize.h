@@ -0,0 +1,66 @@
+#ifndef LWR_RESIZE_H
+#define LWR_RESIZE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "region.h"
+
+#include "stb_image_resize2.h"
+
+/* Runs resizes over a set of worker threads. A resize is split into bands of
+ * output rows that can be sampled independently, the calling thread takes one
+ * and the workers the rest. Small resizes run on the calling thread alone,
+ * waking workers would cost more than it saves. */
+
+/* Ways to resample, fastest first. All but stbir work on 8-bit premultiplied
+ * pixels in fixed point, without stbir's sRGB linearization. */
+enum resize_filter {
+    RESIZE_NEAREST,
+    /* the mean of the source pixels an output pixel covers, halving the image
+     * when the ratio is exactly 2, 4 or 8 */
+    RESIZE_BOX,
+    /* a triangle filter, widened to cover the source pixels when reducing */
+    RESIZE_BILINEAR,
+    /* stb_image_resize2's default filters, in linear light through floats */
+    RESIZE_STBIR,
+    RESIZE_FILTER_COUNT,
+};
+
+const char* resize_filter_name(enum resize_filter filter);
+bool resize_filter_parse(const char* name, enum resize_filter* filter);
+
+/* upper bound on --threads */
+#define RESIZE_MAX_THREADS 64
+
+/* Starts the workers, `threads` counts the calling thread and 0 means one per
+ * online core. Without it, or after resize_finish, resizes run single
+ * threaded. Also picks the convert kernels, so it must come before any other
+ * thread converts. */
+void resize_init(int threads);
+void resize_finish(void);
+
+/* Threads a large resize runs on, the calling one included */
+int resize_thread_count(void);
+
+/* Performs a resize set up with stbir_resize_init and friends, like
+ * stbir_resize_extended. Only one thread may resize at a time. */
+bool resize_run(STBIR_RESIZE* resize);
+
+/* Resamples premultiplied 4-byte pixels of `src` with one of the fixed-point
+ * filters, filling the `r` part of a dst_width x dst_height image. The channel
+ * order is kept. */
+bool resize_fixed(
+    enum resize_filter filter,
+    uint8_t* dst,
+    int32_t dst_width,
+    int32_t dst_height,
+    int32_t dst_stride,
+    const uint8_t* src,
+    int32_t src_width,
+    int32_t src_height,
+    int32_t src_stride,
+    struct rect r
+);
+
+#endif
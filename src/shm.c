@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+#include "shm.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* backend_names[SHM_BACKEND_COUNT] = {
+    [SHM_BACKEND_SHM_OPEN] = "shm",
+    [SHM_BACKEND_MEMFD] = "memfd",
+    [SHM_BACKEND_HUGETLB] = "hugetlb",
+};
+
+const char* shm_backend_name(enum shm_backend backend) {
+    return backend_names[backend];
+}
+
+bool shm_backend_parse(const char* name, enum shm_backend* backend) {
+    for (int i = 0; i < SHM_BACKEND_COUNT; ++i) {
+        if (strcmp(name, backend_names[i]) == 0) {
+            *backend = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Shared memory support code */
+static void randname(char* buf) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long r = ts.tv_nsec;
+    for (int i = 0; i < 6; ++i) {
+        buf[i] = 'A' + (r & 15) + (r & 16) * 2;
+        r >>= 5;
+    }
+}
+
+static int create_shm_file(void) {
+    int retries = 100;
+    do {
+        char name[] = "/wl_shm-XXXXXX";
+        randname(name + sizeof(name) - 7);
+        --retries;
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd >= 0) {
+            shm_unlink(name);
+            return fd;
+        }
+    } while (retries > 0 && errno == EEXIST);
+    return -1;
+}
+
+static int resize_shm_file(int fd, size_t size) {
+    int ret;
+    do {
+        ret = ftruncate(fd, size);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+#ifdef MFD_ALLOW_SEALING
+static int create_memfd(unsigned extra_flags) {
+    int fd = memfd_create("wl_shm", MFD_CLOEXEC | MFD_ALLOW_SEALING | extra_flags);
+    if (fd < 0)
+        return -1;
+    /* The pool only ever grows in place, so growing stays allowed */
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK);
+    return fd;
+}
+#endif
+
+static bool open_backend(struct shm_file* file, enum shm_backend backend) {
+    file->backend = backend;
+    file->granularity = sysconf(_SC_PAGESIZE);
+
+    switch (backend) {
+    case SHM_BACKEND_SHM_OPEN:
+        file->fd = create_shm_file();
+        break;
+#ifdef MFD_ALLOW_SEALING
+    case SHM_BACKEND_MEMFD:
+        file->fd = create_memfd(0);
+        break;
+#ifdef MFD_HUGETLB
+    case SHM_BACKEND_HUGETLB: {
+        file->fd = create_memfd(MFD_HUGETLB);
+        struct stat st;
+        if (file->fd >= 0 && fstat(file->fd, &st) == 0)
+            file->granularity = st.st_blksize;
+        break;
+    }
+#endif
+#endif
+    default:
+        errno = ENOSYS;
+        file->fd = -1;
+        break;
+    }
+    return file->fd >= 0;
+}
+
+bool shm_file_open(struct shm_file* file, enum shm_backend backend, unsigned flags) {
+    memset(file, 0, sizeof(*file));
+    file->flags = flags;
+
+    if (backend == SHM_BACKEND_HUGETLB) {
+        /* the file opens fine without reserved huge pages, only mapping it
+         * fails, so try a page up front */
+        if (open_backend(file, backend) && shm_file_grow(file, 1))
+            return true;
+        printf("[lwr] hugetlb memfd unavailable (%s), using memfd\n", strerror(errno));
+        shm_file_close(file);
+        file->flags = flags;
+        backend = SHM_BACKEND_MEMFD;
+    }
+    if (backend == SHM_BACKEND_MEMFD) {
+        if (open_backend(file, backend))
+            return true;
+        printf("[lwr] memfd unavailable (%s), using shm_open\n", strerror(errno));
+        backend = SHM_BACKEND_SHM_OPEN;
+    }
+    if (open_backend(file, backend))
+        return true;
+
+    printf("[lwr] error: unable to create shm file: %s\n", strerror(errno));
+    return false;
+}
+
+bool shm_file_grow(struct shm_file* file, size_t size) {
+    if (size <= file->size)
+        return true;
+    size = (size + file->granularity - 1) & ~(file->granularity - 1);
+
+    if (resize_shm_file(file->fd, size) < 0) {
+        printf("[lwr] error: unable to grow shm file: %s\n", strerror(errno));
+        return false;
+    }
+
+    int map_flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (file->flags & SHM_PREFAULT)
+        map_flags |= MAP_POPULATE;
+#endif
+    uint8_t* data = mmap(NULL, size, PROT_READ | PROT_WRITE, map_flags, file->fd, 0);
+    if (data == MAP_FAILED) {
+        if (file->backend != SHM_BACKEND_HUGETLB || file->size != 0)
+            printf("[lwr] error: unable to map shm file: %s\n", strerror(errno));
+        return false;
+    }
+#ifdef MADV_HUGEPAGE
+    /* only honoured for shmem when transparent huge pages are set to advise */
+    if (file->backend != SHM_BACKEND_HUGETLB)
+        madvise(data, size, MADV_HUGEPAGE);
+#endif
+    if (file->data != NULL)
+        munmap(file->data, file->size);
+    file->data = data;
+    file->size = size;
+    return true;
+}
+
+void shm_file_close(struct shm_file* file) {
+    if (file->data != NULL)
+        munmap(file->data, file->size);
+    if (file->fd >= 0)
+        close(file->fd);
+    memset(file, 0, sizeof(*file));
+    file->fd = -1;
+}
@@ -0,0 +1,48 @@
+#ifndef LWR_SHM_H
+#define LWR_SHM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Where the memory behind wl_shm buffers comes from */
+enum shm_backend {
+    /* POSIX shared memory under a random name, unlinked right away */
+    SHM_BACKEND_SHM_OPEN,
+    /* anonymous memfd, sealed against shrinking so the compositor's mapping
+     * can't be cut short under it */
+    SHM_BACKEND_MEMFD,
+    /* memfd on hugetlbfs, fewer page faults and TLB misses for big overlays,
+     * needs huge pages reserved by the system */
+    SHM_BACKEND_HUGETLB,
+    SHM_BACKEND_COUNT,
+};
+
+/* Fault every page in when mapping instead of on first write */
+#define SHM_PREFAULT (1u << 0)
+
+struct shm_file {
+    enum shm_backend backend;
+    unsigned flags;
+    int fd;
+    uint8_t* data;
+    size_t size;
+    /* sizes are rounded up to this, the huge page size for hugetlb */
+    size_t granularity;
+};
+
+const char* shm_backend_name(enum shm_backend backend);
+/* Returns false when `name` isn't a backend name */
+bool shm_backend_parse(const char* name, enum shm_backend* backend);
+
+/* Creates an empty file on `backend`. hugetlb falls back to memfd, and memfd
+ * to shm_open, when the system doesn't support them. */
+bool shm_file_open(struct shm_file* file, enum shm_backend backend, unsigned flags);
+
+/* Grows the file to at least `size` bytes and maps all of it. The mapping may
+ * move, file->data and file->size are updated. */
+bool shm_file_grow(struct shm_file* file, size_t size);
+
+void shm_file_close(struct shm_file* file);
+
+#endif
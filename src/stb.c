@@ -0,0 +1,173 @@
+/* stb implementations, kept out of the other translation units so the
+ * benchmark can link them too */
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#include "stb_image_resize2.h"
+
+/* Incremental GIF decoding, see gif.h */
+#include "gif.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Skips data sub-blocks up to the empty one ending them */
+static void gif_skip_blocks(stbi__context* s) {
+    int length;
+    while ((length = stbi__get8(s)) != 0)
+        stbi__skip(s, length);
+}
+
+bool gif_scan(const char* path, struct gif_info* info) {
+    memset(info, 0, sizeof(*info));
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return stbi__err("can't fopen", "Unable to open file");
+    stbi__context s;
+    stbi__start_file(&s, file);
+    stbi__gif g;
+    memset(&g, 0, sizeof(g));
+    if (!stbi__gif_header(&s, &g, NULL, 1)) {
+        fclose(file);
+        return false;
+    }
+    if (g.flags & 0x80)
+        stbi__skip(&s, 3 * (2 << (g.flags & 7)));
+    info->width = g.w;
+    info->height = g.h;
+    info->opaque = true;
+
+    /* like the decoder, frames without a graphic control extension keep the
+     * delay and transparency of the one before */
+    int delay = 0;
+    bool transparent = false;
+    int capacity = 0;
+    bool done = false;
+    while (!done) {
+        int tag = stbi__get8(&s);
+        if (tag == 0x21) {
+            if (stbi__get8(&s) == 0xF9) {
+                int length = stbi__get8(&s);
+                if (length == 4) {
+                    int flags = stbi__get8(&s);
+                    delay = 10 * stbi__get16le(&s);
+                    stbi__skip(&s, 1);
+                    transparent = flags & 0x01;
+                } else {
+                    stbi__skip(&s, length);
+                }
+            }
+            gif_skip_blocks(&s);
+        } else if (tag == 0x2C) {
+            int x = stbi__get16le(&s);
+            int y = stbi__get16le(&s);
+            int w = stbi__get16le(&s);
+            int h = stbi__get16le(&s);
+            int flags = stbi__get8(&s);
+            if (flags & 0x80)
+                stbi__skip(&s, 3 * (2 << (flags & 7)));
+            /* LZW minimum code size */
+            stbi__get8(&s);
+            gif_skip_blocks(&s);
+
+            /* the decoder fills what the first frame leaves out with the
+             * background color only when it isn't entry 0 */
+            bool covers = x == 0 && y == 0 && w == g.w && h == g.h;
+            if (transparent || (info->frame_count == 0 && !covers && g.bgindex == 0))
+                info->opaque = false;
+            if (info->frame_count == capacity) {
+                capacity = capacity != 0 ? capacity * 2 : 16;
+                int* delays = realloc(info->delays, capacity * sizeof(*delays));
+                if (delays == NULL) {
+                    free(info->delays);
+                    fclose(file);
+                    return stbi__err("outofmem", "Out of memory");
+                }
+                info->delays = delays;
+            }
+            info->delays[info->frame_count++] = delay;
+        } else {
+            /* the trailer, or the end of a truncated file */
+            done = true;
+        }
+    }
+    fclose(file);
+
+    if (info->frame_count == 0) {
+        free(info->delays);
+        info->delays = NULL;
+        return stbi__err("no frames", "GIF holds no frame");
+    }
+    return true;
+}
+
+struct gif {
+    FILE* file;
+    stbi__context s;
+    stbi__gif g;
+    bool failed;
+};
+
+struct gif* gif_open(const char* path) {
+    struct gif* gif = calloc(1, sizeof(*gif));
+    if (gif == NULL)
+        return NULL;
+    gif->file = fopen(path, "rb");
+    if (gif->file == NULL) {
+        free(gif);
+        return NULL;
+    }
+    stbi__start_file(&gif->s, gif->file);
+    return gif;
+}
+
+static void gif_free_canvas(struct gif* gif) {
+    STBI_FREE(gif->g.out);
+    STBI_FREE(gif->g.background);
+    STBI_FREE(gif->g.history);
+    memset(&gif->g, 0, sizeof(gif->g));
+}
+
+void gif_close(struct gif* gif) {
+    if (gif == NULL)
+        return;
+    gif_free_canvas(gif);
+    fclose(gif->file);
+    free(gif);
+}
+
+const uint8_t* gif_next(struct gif* gif, int* width, int* height) {
+    if (gif->failed)
+        return NULL;
+    int comp;
+    /* a frame disposed of to the previous one leaves the canvas as it was
+     * before that frame was drawn, which the decoder keeps as its background,
+     * instead of the frame two back stbi_load_gif_from_memory keeps */
+    stbi_uc* canvas = stbi__gif_load_next(&gif->s, &gif->g, &comp, 4, gif->g.background);
+    if (canvas == (stbi_uc*)&gif->s)
+        return NULL;
+    if (canvas == NULL)
+        gif->failed = true;
+    *width = gif->g.w;
+    *height = gif->g.h;
+    return canvas;
+}
+
+bool gif_failed(const struct gif* gif) {
+    return gif->failed;
+}
+
+bool gif_rewind(struct gif* gif) {
+    gif_free_canvas(gif);
+    gif->failed = false;
+    if (fseek(gif->file, 0, SEEK_SET) != 0)
+        return false;
+    stbi__start_file(&gif->s, gif->file);
+    return true;
+}
+
+size_t gif_memory(int width, int height) {
+    /* the canvas, the background and a byte per pixel of history */
+    return (size_t)width * height * 9 + sizeof(struct gif);
+}
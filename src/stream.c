@@ -0,0 +1,510 @@
+#include "stream.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+#include "gif.h"
+
+/* A frame kept as the indices of the pixels in its changes from the frame
+ * before it, rectangle after rectangle and row after row. The first frame is
+ * kept whole, the keyframe the others apply to. */
+struct kept_frame {
+    uint32_t palette[256];
+    uint8_t* indices;
+};
+
+/* The ring holds one slot more than the lookahead, for the frame the caller
+ * was handed last */
+struct stream {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    /* signalled when a frame is ready or the decode failed */
+    pthread_cond_t ready_cond;
+    /* signalled when a slot frees up or the worker should stop */
+    pthread_cond_t free_cond;
+
+    struct gif* gif;
+    int width;
+    int height;
+    int frame_count;
+    bool opaque;
+
+    uint8_t* slots[STREAM_MAX_LOOKAHEAD + 1];
+    int slot_frames[STREAM_MAX_LOOKAHEAD + 1];
+    int slot_count;
+    /* oldest ready slot, and how many follow it */
+    int head;
+    int ready;
+    /* the slot before head is the caller's */
+    bool held;
+    bool failed;
+    bool stop;
+
+    /* what changed from the frame before frame i, once known */
+    struct region* changes;
+    bool* changes_known;
+    /* frame i's content hash, and the first frame found to have the same
+     * pixels, i itself when none was, once hashed[i] */
+    uint64_t* hashes;
+    int* same;
+    bool* hashed;
+
+    /* the worker's until complete */
+    bool keep;
+    struct kept_frame* kept;
+    int kept_count;
+    size_t kept_size;
+    /* a whole frame indexed, to keep its changes from */
+    uint8_t* indexed;
+    /* every frame is kept, the decoder and ring are gone */
+    bool complete;
+    /* the kept frames applied in order, up to canvas_frame */
+    uint8_t* canvas;
+    int canvas_frame;
+};
+
+static size_t frame_pixels(const struct stream* stream) {
+    return (size_t)stream->width * stream->height;
+}
+
+static size_t frame_size(const struct stream* stream) {
+    return frame_pixels(stream) * 4;
+}
+
+static size_t region_area(const struct region* region) {
+    size_t area = 0;
+    for (int i = 0; i < region->count; ++i)
+        area += (size_t)region->rects[i].width * region->rects[i].height;
+    return area;
+}
+
+/* The first frame still in the ring with the same pixels as `frame`, just
+ * decoded into `slot`, or `frame` itself. Equal hashes are only a hint, and
+ * frames gone from the ring can't be compared at all. */
+static int find_same(struct stream* stream, int frame, int slot, uint64_t hash) {
+    int same = frame;
+    for (int i = 0; i < stream->slot_count; ++i) {
+        int other = stream->slot_frames[i];
+        if (i == slot || other < 0 || other >= same || !stream->hashed[other] ||
+            stream->hashes[other] != hash)
+            continue;
+        if (memcmp(stream->slots[i], stream->slots[slot], frame_size(stream)) == 0)
+            same = stream->same[other];
+    }
+    return same;
+}
+
+/* Composes the next frame into `slot`, starting over after the last one.
+ * Returns the frame's index, or -1 when the file no longer matches its
+ * scan. */
+static int decode_next(struct stream* stream, int frame, uint8_t* slot) {
+    int width, height;
+    const uint8_t* canvas = gif_next(stream->gif, &width, &height);
+    if (canvas == NULL && !gif_failed(stream->gif)) {
+        /* a file with fewer frames than scanned would never loop around */
+        if (frame != stream->frame_count || !gif_rewind(stream->gif))
+            return -1;
+        frame = 0;
+        canvas = gif_next(stream->gif, &width, &height);
+    }
+    if (canvas == NULL || frame >= stream->frame_count || width != stream->width ||
+        height != stream->height)
+        return -1;
+
+    memcpy(slot, canvas, frame_size(stream));
+    if (!stream->opaque)
+        convert_premultiply_rgba(slot, (size_t)stream->width * stream->height);
+    return frame;
+}
+
+static void drop_kept(struct stream* stream) {
+    for (int i = 0; stream->kept != NULL && i < stream->frame_count; ++i)
+        free(stream->kept[i].indices);
+    free(stream->kept);
+    free(stream->indexed);
+    stream->kept = NULL;
+    stream->indexed = NULL;
+    stream->keep = false;
+}
+
+/* Keeps a decoded frame, all of the first and only the part in `changes` of
+ * the others. A frame of too many colors ends the keeping. */
+static void keep_frame(
+    struct stream* stream,
+    int frame,
+    const uint8_t* slot,
+    const struct region* changes
+) {
+    struct kept_frame* kept = &stream->kept[frame];
+    if (convert_index_pixels(stream->indexed, kept->palette, slot, frame_pixels(stream)) == 0) {
+        printf("[lwr] frame %d has over 256 colors, decoding frames every loop\n", frame);
+        drop_kept(stream);
+        return;
+    }
+
+    size_t size = frame == 0 ? frame_pixels(stream) : region_area(changes);
+    kept->indices = malloc(size != 0 ? size : 1);
+    if (kept->indices == NULL) {
+        drop_kept(stream);
+        return;
+    }
+    if (frame == 0) {
+        memcpy(kept->indices, stream->indexed, size);
+    } else {
+        uint8_t* dst = kept->indices;
+        for (int i = 0; i < changes->count; ++i) {
+            const struct rect* r = &changes->rects[i];
+            for (int32_t y = r->y; y < r->y + r->height; ++y) {
+                memcpy(dst, stream->indexed + (size_t)y * stream->width + r->x, r->width);
+                dst += r->width;
+            }
+        }
+    }
+    ++stream->kept_count;
+    stream->kept_size += size + sizeof(*kept);
+}
+
+static void free_slots(struct stream* stream) {
+    for (int i = 0; i < stream->slot_count; ++i) {
+        free(stream->slots[i]);
+        stream->slots[i] = NULL;
+    }
+}
+
+static void stream_free(struct stream* stream) {
+    pthread_cond_destroy(&stream->free_cond);
+    pthread_cond_destroy(&stream->ready_cond);
+    pthread_mutex_destroy(&stream->lock);
+    free_slots(stream);
+    drop_kept(stream);
+    free(stream->canvas);
+    free(stream->changes);
+    free(stream->changes_known);
+    free(stream->hashes);
+    free(stream->same);
+    free(stream->hashed);
+    gif_close(stream->gif);
+    free(stream);
+}
+
+static void* stream_worker(void* data) {
+    struct stream* stream = data;
+    int frame = 0;
+    /* the slot of the frame decoded last, -1 before the first */
+    int previous = -1;
+    pthread_mutex_lock(&stream->lock);
+    for (;;) {
+        while (!stream->stop && stream->ready + stream->held == stream->slot_count)
+            pthread_cond_wait(&stream->free_cond, &stream->lock);
+        if (stream->stop)
+            break;
+        int slot = (stream->head + stream->ready) % stream->slot_count;
+        pthread_mutex_unlock(&stream->lock);
+
+        /* nobody else touches a slot past the ready ones, and the previous
+         * one is at most read until the ring comes around */
+        int decoded = decode_next(stream, frame, stream->slots[slot]);
+        struct region changes = { 0 };
+        if (decoded >= 0 && previous >= 0) {
+            region_diff(
+                &changes,
+                stream->slots[previous],
+                stream->slots[slot],
+                stream->width,
+                stream->height,
+                stream->width * 4
+            );
+        }
+        /* frames are the same every loop, hashing the first is enough */
+        bool unhashed = decoded >= 0 && !stream->hashed[decoded];
+        uint64_t hash = unhashed ? convert_hash(stream->slots[slot], frame_size(stream)) : 0;
+        /* the frames of the first loop come in order, earlier ones hashed */
+        int same = unhashed ? find_same(stream, decoded, slot, hash) : decoded;
+        if (decoded >= 0 && stream->keep && stream->kept[decoded].indices == NULL)
+            keep_frame(stream, decoded, stream->slots[slot], &changes);
+        /* the first frame's changes are known once it comes around again */
+        bool complete = decoded == 0 && previous >= 0 && stream->keep;
+        if (complete) {
+            free(stream->indexed);
+            stream->indexed = NULL;
+            gif_close(stream->gif);
+            stream->gif = NULL;
+        }
+
+        pthread_mutex_lock(&stream->lock);
+        if (decoded >= 0 && previous >= 0) {
+            stream->changes[decoded] = changes;
+            stream->changes_known[decoded] = true;
+        }
+        if (unhashed) {
+            stream->hashes[decoded] = hash;
+            stream->same[decoded] = same;
+            stream->hashed[decoded] = true;
+        }
+        if (decoded < 0 || complete) {
+            stream->failed = !complete;
+            stream->complete = complete;
+            pthread_cond_signal(&stream->ready_cond);
+            break;
+        }
+        stream->slot_frames[slot] = decoded;
+        ++stream->ready;
+        frame = decoded + 1;
+        previous = slot;
+        pthread_cond_signal(&stream->ready_cond);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    if (stream->complete) {
+        printf(
+            "[lwr] kept %d frames in %zu bytes, %.1f%% of their RGBA\n",
+            stream->frame_count,
+            stream->kept_size,
+            100.0 * stream->kept_size / ((double)frame_size(stream) * stream->frame_count)
+        );
+    }
+    return NULL;
+}
+
+struct stream* stream_open(
+    const char* path,
+    int width,
+    int height,
+    int frame_count,
+    bool opaque,
+    int lookahead,
+    bool keep
+) {
+    if (lookahead < 1)
+        lookahead = 1;
+    if (lookahead > STREAM_MAX_LOOKAHEAD)
+        lookahead = STREAM_MAX_LOOKAHEAD;
+
+    struct stream* stream = calloc(1, sizeof(*stream));
+    if (stream == NULL)
+        return NULL;
+    stream->width = width;
+    stream->height = height;
+    stream->frame_count = frame_count;
+    stream->opaque = opaque;
+    stream->slot_count = lookahead + 1;
+    stream->canvas_frame = -1;
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->ready_cond, NULL);
+    pthread_cond_init(&stream->free_cond, NULL);
+    stream->gif = gif_open(path);
+    stream->changes = calloc(frame_count, sizeof(*stream->changes));
+    stream->changes_known = calloc(frame_count, sizeof(*stream->changes_known));
+    stream->hashes = calloc(frame_count, sizeof(*stream->hashes));
+    stream->same = calloc(frame_count, sizeof(*stream->same));
+    stream->hashed = calloc(frame_count, sizeof(*stream->hashed));
+    bool ok = stream->gif != NULL && stream->changes != NULL && stream->changes_known != NULL &&
+              stream->hashes != NULL && stream->same != NULL && stream->hashed != NULL;
+    for (int i = 0; ok && i < stream->slot_count; ++i) {
+        stream->slots[i] = malloc(frame_size(stream));
+        stream->slot_frames[i] = -1;
+        ok = stream->slots[i] != NULL;
+    }
+    if (ok && keep) {
+        stream->kept = calloc(frame_count, sizeof(*stream->kept));
+        stream->indexed = malloc(frame_pixels(stream));
+        stream->keep = stream->kept != NULL && stream->indexed != NULL;
+        if (!stream->keep)
+            drop_kept(stream);
+    }
+    if (!ok || pthread_create(&stream->thread, NULL, stream_worker, stream) != 0) {
+        printf("[lwr] error: unable to start streaming %s\n", path);
+        stream_free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+void stream_close(struct stream* stream) {
+    if (stream == NULL)
+        return;
+    pthread_mutex_lock(&stream->lock);
+    stream->stop = true;
+    pthread_cond_signal(&stream->free_cond);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->thread, NULL);
+    stream_free(stream);
+}
+
+/* Expands the part in `changes` of a kept frame that lies in `crop` into
+ * `dst`, an image of the crop, through `palette` */
+static void apply_kept(
+    struct stream* stream,
+    int frame,
+    const struct region* changes,
+    const uint32_t* palette,
+    struct rect crop,
+    uint8_t* dst,
+    size_t stride
+) {
+    const struct kept_frame* kept = &stream->kept[frame];
+    const uint8_t* src = kept->indices;
+    for (int i = 0; i < changes->count; ++i) {
+        const struct rect* r = &changes->rects[i];
+        struct rect clipped = rect_intersect(*r, crop);
+        for (int32_t y = clipped.y; y < clipped.y + clipped.height; ++y) {
+            /* the keyframe's rows are where they are in the frame */
+            const uint8_t* row = frame == 0 ? kept->indices + (size_t)y * stream->width + r->x
+                                            : src + (size_t)(y - r->y) * r->width;
+            convert_expand_palette(
+                dst + (size_t)(y - crop.y) * stride + (size_t)(clipped.x - crop.x) * 4,
+                row + (clipped.x - r->x),
+                palette,
+                clipped.width
+            );
+        }
+        src += (size_t)r->width * r->height;
+    }
+}
+
+static struct rect whole_frame(const struct stream* stream) {
+    return (struct rect){ 0, 0, stream->width, stream->height };
+}
+
+/* Brings the canvas to `frame`, applying the kept frames on the way */
+static bool advance_canvas(struct stream* stream, int frame) {
+    if (stream->canvas == NULL) {
+        stream->canvas = malloc(frame_size(stream));
+        if (stream->canvas == NULL)
+            return false;
+        struct region whole;
+        region_clear(&whole);
+        region_add(&whole, whole_frame(stream));
+        apply_kept(
+            stream,
+            0,
+            &whole,
+            stream->kept[0].palette,
+            whole_frame(stream),
+            stream->canvas,
+            (size_t)stream->width * 4
+        );
+        stream->canvas_frame = 0;
+    }
+    while (stream->canvas_frame != frame) {
+        int next = (stream->canvas_frame + 1) % stream->frame_count;
+        apply_kept(
+            stream,
+            next,
+            &stream->changes[next],
+            stream->kept[next].palette,
+            whole_frame(stream),
+            stream->canvas,
+            (size_t)stream->width * 4
+        );
+        stream->canvas_frame = next;
+    }
+    return true;
+}
+
+/* Once every frame is kept, the worker is done with the ring, and the caller
+ * with its slot. Called locked. */
+static bool finished(struct stream* stream) {
+    if (!stream->complete)
+        return false;
+    free_slots(stream);
+    stream->ready = 0;
+    return true;
+}
+
+const uint8_t* stream_frame(struct stream* stream, int frame) {
+    const uint8_t* data = NULL;
+    pthread_mutex_lock(&stream->lock);
+    stream->held = false;
+    pthread_cond_signal(&stream->free_cond);
+    for (;;) {
+        while (stream->ready == 0 && !stream->failed && !stream->complete)
+            pthread_cond_wait(&stream->ready_cond, &stream->lock);
+        if (finished(stream)) {
+            if (advance_canvas(stream, frame))
+                data = stream->canvas;
+            break;
+        }
+        if (stream->ready == 0)
+            break;
+        int slot = stream->head;
+        stream->head = (stream->head + 1) % stream->slot_count;
+        --stream->ready;
+        pthread_cond_signal(&stream->free_cond);
+        if (stream->slot_frames[slot] == frame) {
+            stream->held = true;
+            data = stream->slots[slot];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return data;
+}
+
+bool stream_draw(
+    struct stream* stream,
+    int frame,
+    int previous,
+    struct rect crop,
+    uint8_t* dst,
+    size_t stride,
+    convert_fn convert
+) {
+    pthread_mutex_lock(&stream->lock);
+    bool kept = finished(stream);
+    pthread_mutex_unlock(&stream->lock);
+    /* nothing but the caller touches the kept frames once complete */
+    if (!kept)
+        return false;
+
+    uint32_t palette[256];
+    if (previous < 0) {
+        struct region whole;
+        region_clear(&whole);
+        region_add(&whole, whole_frame(stream));
+        convert((uint8_t*)palette, (const uint8_t*)stream->kept[0].palette, 256);
+        apply_kept(stream, 0, &whole, palette, crop, dst, stride);
+        previous = 0;
+    }
+    /* each frame's changes over the ones before it, in order */
+    while (previous != frame) {
+        previous = (previous + 1) % stream->frame_count;
+        const struct kept_frame* kept_frame = &stream->kept[previous];
+        convert((uint8_t*)palette, (const uint8_t*)kept_frame->palette, 256);
+        apply_kept(stream, previous, &stream->changes[previous], palette, crop, dst, stride);
+    }
+    return true;
+}
+
+bool stream_changes(struct stream* stream, int frame, struct region* changes) {
+    pthread_mutex_lock(&stream->lock);
+    bool known = stream->changes_known[frame];
+    if (known)
+        *changes = stream->changes[frame];
+    pthread_mutex_unlock(&stream->lock);
+    return known;
+}
+
+bool stream_same(struct stream* stream, int frame, int* same) {
+    pthread_mutex_lock(&stream->lock);
+    bool known = stream->hashed[frame];
+    if (known)
+        *same = stream->same[frame];
+    pthread_mutex_unlock(&stream->lock);
+    return known;
+}
+
+size_t stream_memory(int width, int height, int lookahead) {
+    if (lookahead > STREAM_MAX_LOOKAHEAD)
+        lookahead = STREAM_MAX_LOOKAHEAD;
+    return gif_memory(width, height) + (size_t)width * height * 4 * (lookahead + 1) +
+           sizeof(struct stream);
+}
+
+size_t stream_kept_memory(int width, int height, int frame_count) {
+    /* frames changing whole, the canvas and the frame indexed while keeping */
+    return (size_t)frame_count * ((size_t)width * height + sizeof(struct kept_frame)) +
+           (size_t)width * height * 5;
+}
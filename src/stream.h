@@ -0,0 +1,79 @@
+#ifndef LWR_STREAM_H
+#define LWR_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "convert.h"
+#include "region.h"
+
+/* Decodes an animated GIF ahead of its playback on a worker thread. Only the
+ * decoder's canvas and a ring of up to `lookahead` ready frames are kept, so
+ * memory doesn't grow with the frame count. The worker loops over the file
+ * for as long as frames are asked for, and records what changed between each
+ * frame and the one before it, and a hash of each frame's pixels.
+ *
+ * A stream may instead keep every frame it decodes, as a byte per pixel
+ * indexing a palette of its own, which GIF frames of 256 colors or less fit
+ * in, and only for the pixels in its changes. Once the first loop is kept
+ * whole the decoder and ring go. From then on frames are drawn by expanding
+ * those changes straight into the caller's buffer, or rebuilt on a canvas
+ * for callers that resize them. */
+
+/* upper bound on the ring */
+#define STREAM_MAX_LOOKAHEAD 8
+
+struct stream;
+
+/* Starts decoding the GIF at `path`, which must still have the given size
+ * and frame count. Frames are premultiplied unless `opaque`, and kept when
+ * `keep`. */
+struct stream* stream_open(
+    const char* path,
+    int width,
+    int height,
+    int frame_count,
+    bool opaque,
+    int lookahead,
+    bool keep
+);
+void stream_close(struct stream* stream);
+
+/* Returns frame `frame`, width x height premultiplied RGBA valid until the
+ * next call. Frames decoded before it are dropped, so asking for an earlier
+ * one than last time waits for the worker to loop around to it, unless the
+ * frames are kept. NULL when the file can't be decoded as it was scanned. */
+const uint8_t* stream_frame(struct stream* stream, int frame);
+
+/* Draws frame `frame` into `dst`, an image of the frames' `crop` holding
+ * frame `previous`, or nothing when -1, by expanding the kept changes from
+ * one to the other through their palettes converted by `convert`. Returns
+ * false, drawing nothing, until every frame is kept. */
+bool stream_draw(
+    struct stream* stream,
+    int frame,
+    int previous,
+    struct rect crop,
+    uint8_t* dst,
+    size_t stride,
+    convert_fn convert
+);
+
+/* What changed from the frame before `frame`, the last one for the first.
+ * Returns false while that is unknown, before the worker decoded both. */
+bool stream_changes(struct stream* stream, int frame, struct region* changes);
+
+/* The first frame found to have the same pixels as frame `frame`, or `frame`
+ * itself. Frames hashing the same are compared while both are in the ring, so
+ * a run of equal frames is always found. Returns false while the worker
+ * hasn't decoded it yet. */
+bool stream_same(struct stream* stream, int frame, int* same);
+
+/* Bytes a stream of the given size and lookahead keeps, decoder included */
+size_t stream_memory(int width, int height, int lookahead);
+
+/* Bytes a stream keeping its frames holds at most once it has them all */
+size_t stream_kept_memory(int width, int height, int frame_count);
+
+#endif